@@ -31,82 +31,143 @@
 #define DEBUG_OUTPUT Serial
 #endif
 
-static char* readBytesWithTimeout(WiFiClient& client, size_t maxLength, size_t& dataLength, int timeout_ms)
+static size_t readBytesWithTimeout(WiFiClient& client, char* buf, size_t length, int timeout_ms)
 {
-  char *buf = nullptr;
-  dataLength = 0;
-  while (dataLength < maxLength) {
+  size_t dataLength = 0;
+  while (dataLength < length) {
     int tries = timeout_ms;
     size_t newLength;
     while (!(newLength = client.available()) && tries--) delay(1);
     if (!newLength) {
       break;
     }
-    if (!buf) {
-      buf = (char *) malloc(newLength + 1);
-      if (!buf) {
-        return nullptr;
-      }
+    if (newLength > length - dataLength) {
+      newLength = length - dataLength;
+    }
+    dataLength += client.readBytes(buf + dataLength, newLength);
+  }
+  return dataLength;
+}
+
+static void skipBytesWithTimeout(WiFiClient& client, size_t length, int timeout_ms)
+{
+  char buf[64];
+  while (length) {
+    size_t skipped = readBytesWithTimeout(client, buf, length < sizeof(buf) ? length : sizeof(buf), timeout_ms);
+    if (!skipped) {
+      break;
+    }
+    length -= skipped;
+  }
+}
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decoding only ever shortens the text, so it is done where it lies
+static void urlDecodeInPlace(char* text)
+{
+  char* out = text;
+  while (*text) {
+    if (*text == '%' && hexValue(text[1]) >= 0 && hexValue(text[2]) >= 0) {
+      *out++ = (hexValue(text[1]) << 4) | hexValue(text[2]);
+      text += 3;
+    } else {
+      *out++ = (*text == '+') ? ' ' : *text;
+      text++;
+    }
+  }
+  *out = '\0';
+}
+
+// Ends the line starting at `line` in place and returns where the next begins
+static char* terminateLine(char* line)
+{
+  char* end = strchr(line, '\n');
+  if (!end) {
+    return line + strlen(line);
+  }
+  *end = '\0';
+  if (end > line && end[-1] == '\r') {
+    end[-1] = '\0';
+  }
+  return end + 1;
+}
+
+bool WebServer::_readRequestHead(HTTPConnection& conn) {
+  // Byte by byte out of the client's receive buffer, so reading stops at the
+  // blank line ending the head and leaves any body for the body parsers
+  while (conn.headLength < HTTP_HEAD_BUFLEN - 1) {
+    int c = conn.client.read();
+    if (c < 0) {
+      return false;
     }
-    else {
-      char* newBuf = (char *) realloc(buf, dataLength + newLength + 1);
-      if (!newBuf) {
-        free(buf);
-        return nullptr;
+    // Line ends left over from the last request on this connection
+    if (conn.headLength == 0 && (c == '\r' || c == '\n')) {
+      continue;
+    }
+    conn.head[conn.headLength++] = c;
+    if (c == '\n' && conn.headLength >= 2) {
+      char* tail = conn.head + conn.headLength;
+      if (tail[-2] == '\n' || (conn.headLength >= 3 && tail[-2] == '\r' && tail[-3] == '\n')) {
+        *tail = '\0';
+        return true;
       }
-      buf = newBuf;
     }
-    client.readBytes(buf + dataLength, newLength);
-    dataLength += newLength;
-    buf[dataLength] = '\0';
   }
-  return buf;
+  return false;
 }
 
-bool WebServer::_parseRequest(WiFiClient& client) {
-  // Read the first line of HTTP request
-  String req = client.readStringUntil('\r');
-  client.readStringUntil('\n');
-  //reset header value
-  for (int i = 0; i < _headerKeysCount; ++i) {
-    _currentHeaders[i].value =String();
-   }
+bool WebServer::_parseRequest(WiFiClient& client, char* head) {
+  // The head is tokenised where it lies: each line, name and value is ended
+  // with a NUL and used in place
+  char* req = head;
+  char* next = terminateLine(req);
+  _clearRequest();
 
   // First line of HTTP request looks like "GET /path HTTP/1.1"
   // Retrieve the "/path" part by finding the spaces
-  int addr_start = req.indexOf(' ');
-  int addr_end = req.indexOf(' ', addr_start + 1);
-  if (addr_start == -1 || addr_end == -1) {
+  char* url = strchr(req, ' ');
+  char* versionStr = url ? strchr(url + 1, ' ') : NULL;
+  if (!url || !versionStr) {
 #ifdef DEBUG_ESP_HTTP_SERVER
     DEBUG_OUTPUT.print("Invalid request: ");
     DEBUG_OUTPUT.println(req);
 #endif
+    _currentVersion = 1;
+    _refuseRequest(400);
     return false;
   }
-
-  String methodStr = req.substring(0, addr_start);
-  String url = req.substring(addr_start + 1, addr_end);
-  String versionEnd = req.substring(addr_end + 8);
-  _currentVersion = atoi(versionEnd.c_str());
-  String searchStr = "";
-  int hasSearch = url.indexOf('?');
-  if (hasSearch != -1){
-    searchStr = urlDecode(url.substring(hasSearch + 1));
-    url = url.substring(0, hasSearch);
+  *url++ = '\0';
+  *versionStr++ = '\0';
+
+  const char* methodStr = req;
+  // "HTTP/1.x"
+  _currentVersion = strlen(versionStr) > 7 ? atoi(versionStr + 7) : 0;
+  char* search = strchr(url, '?');
+  if (search) {
+    *search++ = '\0';
   }
   _currentUri = url;
   _chunked = false;
+  // HTTP/1.1 connections persist unless the client asks otherwise
+  _keepAliveRequested = _currentVersion >= 1;
 
   HTTPMethod method = HTTP_GET;
-  if (methodStr == "POST") {
+  if (!strcmp(methodStr, "POST")) {
     method = HTTP_POST;
-  } else if (methodStr == "DELETE") {
+  } else if (!strcmp(methodStr, "DELETE")) {
     method = HTTP_DELETE;
-  } else if (methodStr == "OPTIONS") {
+  } else if (!strcmp(methodStr, "OPTIONS")) {
     method = HTTP_OPTIONS;
-  } else if (methodStr == "PUT") {
+  } else if (!strcmp(methodStr, "PUT")) {
     method = HTTP_PUT;
-  } else if (methodStr == "PATCH") {
+  } else if (!strcmp(methodStr, "PATCH")) {
     method = HTTP_PATCH;
   }
   _currentMethod = method;
@@ -117,227 +178,209 @@ bool WebServer::_parseRequest(WiFiClient& client) {
   DEBUG_OUTPUT.print(" url: ");
   DEBUG_OUTPUT.print(url);
   DEBUG_OUTPUT.print(" search: ");
-  DEBUG_OUTPUT.println(searchStr);
+  DEBUG_OUTPUT.println(search ? search : "");
 #endif
 
-  //attach handler
-  RequestHandler* handler;
-  for (handler = _firstHandler; handler; handler = handler->next()) {
-    if (handler->canHandle(_currentMethod, _currentUri))
-      break;
+  //attach handler, from the route index first and then any added with addHandler()
+  RequestHandler* handler = _routes.find(_currentMethod, url, _pathArgs, _pathArgCount);
+  if (!handler) {
+    for (handler = _firstHandler; handler; handler = handler->next()) {
+      if (handler->canHandle(_currentMethod, _currentUri))
+        break;
+    }
   }
   _currentHandler = handler;
 
-  String formData;
-  // below is needed only when POST type request
-  if (method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_DELETE){
-    String boundaryStr;
-    String headerName;
-    String headerValue;
-    bool isForm = false;
-    bool isEncoded = false;
-    uint32_t contentLength = 0;
-    //parse headers
-    while(1){
-      req = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (req == "") break;//no moar headers
-      int headerDiv = req.indexOf(':');
-      if (headerDiv == -1){
-        break;
+  String boundaryStr;
+  bool isForm = false;
+  bool isEncoded = false;
+  unsigned long contentLength = 0;
+  //parse headers
+  while (*next) {
+    char* headerName = next;
+    next = terminateLine(headerName);
+    if (!*headerName) break;//no moar headers
+    char* headerValue = strchr(headerName, ':');
+    if (!headerValue) {
+      break;
+    }
+    *headerValue++ = '\0';
+    while (*headerValue == ' ' || *headerValue == '\t') headerValue++;
+    char* valueEnd = headerValue + strlen(headerValue);
+    while (valueEnd > headerValue && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) *--valueEnd = '\0';
+    _collectHeader(headerName, headerValue);
+
+    #ifdef DEBUG_ESP_HTTP_SERVER
+    DEBUG_OUTPUT.print("headerName: ");
+    DEBUG_OUTPUT.println(headerName);
+    DEBUG_OUTPUT.print("headerValue: ");
+    DEBUG_OUTPUT.println(headerValue);
+    #endif
+
+    if (!strcasecmp(headerName, "Content-Type")){
+      if (!strncmp(headerValue, "text/plain", 10)){
+        isForm = false;
+      } else if (!strncmp(headerValue, "application/x-www-form-urlencoded", 33)){
+        isForm = false;
+        isEncoded = true;
+      } else if (!strncmp(headerValue, "multipart/", 10)){
+        const char* boundary = strchr(headerValue, '=');
+        boundaryStr = boundary ? boundary + 1 : headerValue;
+        isForm = true;
       }
-      headerName = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 1);
-      headerValue.trim();
-       _collectHeader(headerName.c_str(),headerValue.c_str());
-
-      #ifdef DEBUG_ESP_HTTP_SERVER
-      DEBUG_OUTPUT.print("headerName: ");
-      DEBUG_OUTPUT.println(headerName);
-      DEBUG_OUTPUT.print("headerValue: ");
-      DEBUG_OUTPUT.println(headerValue);
-      #endif
-
-      if (headerName.equalsIgnoreCase("Content-Type")){
-        if (headerValue.startsWith("text/plain")){
-          isForm = false;
-        } else if (headerValue.startsWith("application/x-www-form-urlencoded")){
-          isForm = false;
-          isEncoded = true;
-        } else if (headerValue.startsWith("multipart/")){
-          boundaryStr = headerValue.substring(headerValue.indexOf('=')+1);
-          isForm = true;
-        }
-      } else if (headerName.equalsIgnoreCase("Content-Length")){
-        contentLength = headerValue.toInt();
-      } else if (headerName.equalsIgnoreCase("Host")){
-        _hostHeader = headerValue;
+    } else if (!strcasecmp(headerName, "Content-Length")){
+      // Digits only: atoi() would let "-1" through as a huge length
+      char* lengthEnd;
+      contentLength = strtoul(headerValue, &lengthEnd, 10);
+      if (!isdigit((unsigned char)*headerValue) || *lengthEnd) {
+        _refuseRequest(400);
+        return false;
       }
+    } else if (!strcasecmp(headerName, "Host")){
+      _hostHeader = headerValue;
+    } else if (!strcasecmp(headerName, "Connection")){
+      _parseConnectionHeader(headerValue);
     }
+  }
 
+  // below is needed only when POST type request
+  if (method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_DELETE){
     if (!isForm){
-      size_t plainLength;
-      char* plainBuf = readBytesWithTimeout(client, contentLength, plainLength, HTTP_MAX_POST_WAIT);
-      if (plainLength < contentLength) {
-      	free(plainBuf);
-      	return false;
-      }
+      char* plainBuf = NULL;
       if (contentLength > 0) {
-        if (searchStr != "") searchStr += '&';
+        // The body is held in the request arena with its terminator; one
+        // that does not fit is refused
+        if (contentLength < HTTP_ARENA_SIZE) {
+          plainBuf = _arena.alloc(contentLength + 1);
+        }
+        if (!plainBuf) {
+#ifdef DEBUG_ESP_HTTP_SERVER
+          DEBUG_OUTPUT.print("Body too large: ");
+          DEBUG_OUTPUT.println(contentLength);
+#endif
+          _refuseRequest(413);
+          return false;
+        }
+        if (readBytesWithTimeout(client, plainBuf, contentLength, HTTP_MAX_POST_WAIT) < contentLength) {
+          _refuseRequest(408);
+          return false;
+        }
+        plainBuf[contentLength] = '\0';
+      }
+      _parseArguments(search);
+      if (plainBuf) {
         if(isEncoded){
           //url encoded form
-          String decoded = urlDecode(plainBuf);
-          size_t decodedLen = decoded.length();
-          memcpy(plainBuf, decoded.c_str(), decodedLen);
-          plainBuf[decodedLen] = 0;
-          searchStr += plainBuf;
-        }
-        _parseArguments(searchStr);
-        if(!isEncoded){
+          _parseArguments(plainBuf);
+        } else {
           //plain post json or other data
-          RequestArgument& arg = _currentArgs[_currentArgCount++];
-          arg.key = "plain";
-          arg.value = String(plainBuf);
+          _addArgument("plain", plainBuf);
         }
 
   #ifdef DEBUG_ESP_HTTP_SERVER
         DEBUG_OUTPUT.print("Plain: ");
         DEBUG_OUTPUT.println(plainBuf);
   #endif
-        free(plainBuf);
       }
     }
 
     if (isForm){
-      _parseArguments(searchStr);
+      _parseArguments(search);
       if (!_parseForm(client, boundaryStr, contentLength)) {
+        // Already answered
         return false;
       }
     }
   } else {
-    String headerName;
-    String headerValue;
-    //parse headers
-    while(1){
-      req = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (req == "") break;//no moar headers
-      int headerDiv = req.indexOf(':');
-      if (headerDiv == -1){
-        break;
-      }
-      headerName = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 2);
-      _collectHeader(headerName.c_str(),headerValue.c_str());
-
-	  #ifdef DEBUG_ESP_HTTP_SERVER
-	  DEBUG_OUTPUT.print("headerName: ");
-	  DEBUG_OUTPUT.println(headerName);
-	  DEBUG_OUTPUT.print("headerValue: ");
-	  DEBUG_OUTPUT.println(headerValue);
-	  #endif
-
-	  if (headerName.equalsIgnoreCase("Host")){
-        _hostHeader = headerValue;
-      }
+    _parseArguments(search);
+    // A body nothing reads is skipped, or it would be taken for the next
+    // request. Waiting for one still on its way would hold up every other
+    // connection, so only one already here is skipped; otherwise the
+    // connection is closed after the response instead.
+    if (contentLength <= HTTP_HEAD_BUFLEN && contentLength <= (unsigned long)client.available()) {
+      skipBytesWithTimeout(client, contentLength, 0);
+    } else if (contentLength > 0) {
+      _keepAliveRequested = false;
     }
-    _parseArguments(searchStr);
   }
-  client.flush();
 
 #ifdef DEBUG_ESP_HTTP_SERVER
   DEBUG_OUTPUT.print("Request: ");
   DEBUG_OUTPUT.println(url);
   DEBUG_OUTPUT.print(" Arguments: ");
-  DEBUG_OUTPUT.println(searchStr);
+  DEBUG_OUTPUT.println(_currentArgCount);
 #endif
 
   return true;
 }
 
 bool WebServer::_collectHeader(const char* headerName, const char* headerValue) {
-  for (int i = 0; i < _headerKeysCount; i++) {
-    if (_currentHeaders[i].key.equalsIgnoreCase(headerName)) {
-            _currentHeaders[i].value=headerValue;
-            return true;
-        }
-  }
-  return false;
+  int i = _findHeader(headerName);
+  if (i < 0)
+    return false;
+  _currentHeaders[i].value = headerValue;
+  return true;
 }
 
-void WebServer::_parseArguments(String data) {
-#ifdef DEBUG_ESP_HTTP_SERVER
-  DEBUG_OUTPUT.print("args: ");
-  DEBUG_OUTPUT.println(data);
-#endif
-  if (_currentArgs)
-    delete[] _currentArgs;
-  _currentArgs = 0;
-  if (data.length() == 0) {
-    _currentArgCount = 0;
-    _currentArgs = new RequestArgument[1];
-    return;
+void WebServer::_parseConnectionHeader(const char* value) {
+  // A list of options such as "keep-alive, Upgrade"; close wins
+  bool keepAlive = false;
+  while (*value) {
+    size_t len = strcspn(value, " \t,");
+    if (len == 5 && !strncasecmp(value, "close", 5)) {
+      _keepAliveRequested = false;
+      return;
+    } else if (len == 10 && !strncasecmp(value, "keep-alive", 10)) {
+      keepAlive = true;
+    }
+    value += len;
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
   }
-  _currentArgCount = 1;
-
-  for (int i = 0; i < (int)data.length(); ) {
-    i = data.indexOf('&', i);
-    if (i == -1)
-      break;
-    ++i;
-    ++_currentArgCount;
+  if (keepAlive) {
+    _keepAliveRequested = true;
   }
-#ifdef DEBUG_ESP_HTTP_SERVER
-  DEBUG_OUTPUT.print("args count: ");
-  DEBUG_OUTPUT.println(_currentArgCount);
-#endif
+}
 
-  _currentArgs = new RequestArgument[_currentArgCount+1];
-  int pos = 0;
-  int iarg;
-  for (iarg = 0; iarg < _currentArgCount;) {
-    int equal_sign_index = data.indexOf('=', pos);
-    int next_arg_index = data.indexOf('&', pos);
+void WebServer::_parseArguments(char* data) {
 #ifdef DEBUG_ESP_HTTP_SERVER
-    DEBUG_OUTPUT.print("pos ");
-    DEBUG_OUTPUT.print(pos);
-    DEBUG_OUTPUT.print("=@ ");
-    DEBUG_OUTPUT.print(equal_sign_index);
-    DEBUG_OUTPUT.print(" &@ ");
-    DEBUG_OUTPUT.println(next_arg_index);
+  DEBUG_OUTPUT.print("args: ");
+  DEBUG_OUTPUT.println(data ? data : "");
 #endif
-    if ((equal_sign_index == -1) || ((equal_sign_index > next_arg_index) && (next_arg_index != -1))) {
+  // "a=1&b=2" is split and decoded in place, and the arguments point into it
+  while (data && *data) {
+    char* next = strchr(data, '&');
+    if (next) {
+      *next++ = '\0';
+    }
+    char* value = strchr(data, '=');
+    if (!value) {
 #ifdef DEBUG_ESP_HTTP_SERVER
       DEBUG_OUTPUT.print("arg missing value: ");
-      DEBUG_OUTPUT.println(iarg);
+      DEBUG_OUTPUT.println(data);
 #endif
-      if (next_arg_index == -1)
-        break;
-      pos = next_arg_index + 1;
+      data = next;
       continue;
     }
-    RequestArgument& arg = _currentArgs[iarg];
-    arg.key = data.substring(pos, equal_sign_index);
-	arg.value = data.substring(equal_sign_index + 1, next_arg_index);
+    *value++ = '\0';
+    urlDecodeInPlace(data);
+    urlDecodeInPlace(value);
+    if (!_addArgument(data, value)) {
+      break;
+    }
 #ifdef DEBUG_ESP_HTTP_SERVER
     DEBUG_OUTPUT.print("arg ");
-    DEBUG_OUTPUT.print(iarg);
+    DEBUG_OUTPUT.print(_currentArgCount - 1);
     DEBUG_OUTPUT.print(" key: ");
-    DEBUG_OUTPUT.print(arg.key);
+    DEBUG_OUTPUT.print(data);
     DEBUG_OUTPUT.print(" value: ");
-    DEBUG_OUTPUT.println(arg.value);
+    DEBUG_OUTPUT.println(value);
 #endif
-    ++iarg;
-    if (next_arg_index == -1)
-      break;
-    pos = next_arg_index + 1;
+    data = next;
   }
-  _currentArgCount = iarg;
 #ifdef DEBUG_ESP_HTTP_SERVER
   DEBUG_OUTPUT.print("args count: ");
   DEBUG_OUTPUT.println(_currentArgCount);
 #endif
-
 }
 
 void WebServer::_uploadWriteByte(uint8_t b){
@@ -378,8 +421,6 @@ bool WebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len){
   client.readStringUntil('\n');
   //start reading the form
   if (line == ("--"+boundary)){
-    RequestArgument* postArgs = new RequestArgument[32];
-    int postArgsLen = 0;
     while(1){
       String argName;
       String argValue;
@@ -438,9 +479,14 @@ bool WebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len){
             DEBUG_OUTPUT.println();
 #endif
 
-            RequestArgument& arg = postArgs[postArgsLen++];
-            arg.key = argName;
-            arg.value = argValue;
+            // Form fields join the query arguments, copied into the arena
+            const char* key = _arena.copy(argName.c_str(), argName.length());
+            const char* value = _arena.copy(argValue.c_str(), argValue.length());
+            if (!key || !value) {
+              _refuseRequest(413);
+              return false;
+            }
+            _addArgument(key, value);
 
             if (line == ("--"+boundary+"--")){
 #ifdef DEBUG_ESP_HTTP_SERVER
@@ -543,28 +589,13 @@ readfile:
       }
     }
 
-    int iarg;
-    int totalArgs = ((32 - postArgsLen) < _currentArgCount)?(32 - postArgsLen):_currentArgCount;
-    for (iarg = 0; iarg < totalArgs; iarg++){
-      RequestArgument& arg = postArgs[postArgsLen++];
-      arg.key = _currentArgs[iarg].key;
-      arg.value = _currentArgs[iarg].value;
-    }
-    if (_currentArgs) delete[] _currentArgs;
-    _currentArgs = new RequestArgument[postArgsLen];
-    for (iarg = 0; iarg < postArgsLen; iarg++){
-      RequestArgument& arg = _currentArgs[iarg];
-      arg.key = postArgs[iarg].key;
-      arg.value = postArgs[iarg].value;
-    }
-    _currentArgCount = iarg;
-    if (postArgs) delete[] postArgs;
     return true;
   }
 #ifdef DEBUG_ESP_HTTP_SERVER
   DEBUG_OUTPUT.print("Error: line: ");
   DEBUG_OUTPUT.println(line);
 #endif
+  _refuseRequest(400);
   return false;
 }
 
@@ -603,5 +634,6 @@ bool WebServer::_parseFormUploadAborted(){
   _currentUpload.status = UPLOAD_FILE_ABORTED;
   if(_currentHandler && _currentHandler->canUpload(_currentUri))
     _currentHandler->upload(*this, _currentUri, _currentUpload);
+  _refuseRequest(400);
   return false;
 }
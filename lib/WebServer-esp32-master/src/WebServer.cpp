@@ -1,6 +1,6 @@
 /*
   WebServer.cpp - Dead simple web-server.
-  Supports only one simultaneous client, knows how to handle GET and POST.
+  Serves up to HTTP_MAX_CLIENTS clients at a time, knows how to handle GET and POST.
 
   Copyright (c) 2014 Ivan Grokhotkov. All rights reserved.
 
@@ -42,17 +42,22 @@ WebServer::WebServer(IPAddress addr, int port)
 : _server(addr, port)
 , _currentMethod(HTTP_ANY)
 , _currentVersion(0)
-, _currentStatus(HC_NONE)
-, _statusChange(0)
+, _pathArgCount(0)
 , _currentHandler(0)
 , _firstHandler(0)
 , _lastHandler(0)
 , _currentArgCount(0)
-, _currentArgs(0)
 , _headerKeysCount(0)
 , _currentHeaders(0)
 , _contentLength(0)
+, _responseStart(HTTP_RESPONSE_RESERVE)
+, _responseEnd(HTTP_RESPONSE_RESERVE)
+, _chunkStart(0)
+, _chunkOpen(false)
+, _hostHeader(0)
 , _chunked(false)
+, _keepAliveRequested(false)
+, _currentKeepAlive(false)
 {
 }
 
@@ -60,17 +65,22 @@ WebServer::WebServer(int port)
 : _server(port)
 , _currentMethod(HTTP_ANY)
 , _currentVersion(0)
-, _currentStatus(HC_NONE)
-, _statusChange(0)
+, _pathArgCount(0)
 , _currentHandler(0)
 , _firstHandler(0)
 , _lastHandler(0)
 , _currentArgCount(0)
-, _currentArgs(0)
 , _headerKeysCount(0)
 , _currentHeaders(0)
 , _contentLength(0)
+, _responseStart(HTTP_RESPONSE_RESERVE)
+, _responseEnd(HTTP_RESPONSE_RESERVE)
+, _chunkStart(0)
+, _chunkOpen(false)
+, _hostHeader(0)
 , _chunked(false)
+, _keepAliveRequested(false)
+, _currentKeepAlive(false)
 {
 }
 
@@ -88,7 +98,10 @@ WebServer::~WebServer() {
 }
 
 void WebServer::begin() {
-  _currentStatus = HC_NONE;
+  _clearRequest();
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    _connections[i].status = HC_NONE;
+  }
   _server.begin();
   if(!_headerKeysCount)
     collectHeaders(0, 0);
@@ -141,7 +154,7 @@ void WebServer::on(const String &uri, HTTPMethod method, WebServer::THandlerFunc
 }
 
 void WebServer::on(const String &uri, HTTPMethod method, WebServer::THandlerFunction fn, WebServer::THandlerFunction ufn) {
-  _addRequestHandler(new FunctionRequestHandler(fn, ufn, uri, method));
+  _routes.add(uri.c_str(), method, new FunctionRequestHandler(fn, ufn, uri, method), false);
 }
 
 void WebServer::addHandler(RequestHandler* handler) {
@@ -160,73 +173,145 @@ void WebServer::_addRequestHandler(RequestHandler* handler) {
 }
 
 void WebServer::serveStatic(const char* uri, FS& fs, const char* path, const char* cache_header) {
-    _addRequestHandler(new StaticRequestHandler(fs, path, uri, cache_header));
+    StaticRequestHandler* handler = new StaticRequestHandler(fs, path, uri, cache_header);
+    _routes.add(uri, HTTP_GET, handler, !handler->isFile());
 }
 
 void WebServer::handleClient() {
-  if (_currentStatus == HC_NONE) {
-    WiFiClient client = _server.available();
-    if (!client) {
-      return;
+  // Take in every pending connection there is a slot for
+  while (_acceptConnection());
+
+  bool busy = false;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (_connections[i].status != HC_NONE) {
+      _handleConnection(_connections[i]);
+      busy = true;
     }
+  }
+  if (busy) {
+    yield();
+  }
+}
+
+bool WebServer::_acceptConnection() {
+  HTTPConnection* slot = NULL;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (_connections[i].status == HC_NONE) {
+      slot = &_connections[i];
+      break;
+    }
+    // With the table full, a client that has had its response but is slow
+    // to close, or is idle between requests, gives up its slot to a new one
+    if ((_connections[i].status == HC_WAIT_CLOSE ||
+         (_connections[i].status == HC_WAIT_READ && _connections[i].requests > 0)) &&
+        (!slot || (long)(_connections[i].statusChange - slot->statusChange) < 0)) {
+      slot = &_connections[i];
+    }
+  }
+  if (!slot) {
+    return false;
+  }
+
+  WiFiClient client = _server.available();
+  if (!client) {
+    return false;
+  }
 
 #ifdef DEBUG_ESP_HTTP_SERVER
-    DEBUG_OUTPUT.println("New client");
+  DEBUG_OUTPUT.println("New client");
 #endif
 
-    _currentClient = client;
-    _currentStatus = HC_WAIT_READ;
-    _statusChange = millis();
+  if (slot->status != HC_NONE) {
+    _closeConnection(*slot);
   }
+  slot->client = client;
+  slot->status = HC_WAIT_READ;
+  slot->statusChange = millis();
+  slot->requests = 0;
+  return true;
+}
 
-  if (!_currentClient.connected()) {
-    _currentClient = WiFiClient();
-    _currentStatus = HC_NONE;
+void WebServer::_handleConnection(HTTPConnection& conn) {
+  if (!conn.client.connected()) {
+    _closeConnection(conn);
     return;
   }
 
-  // Wait for data from client to become available
-  if (_currentStatus == HC_WAIT_READ) {
-    if (!_currentClient.available()) {
-      if (millis() - _statusChange > HTTP_MAX_DATA_WAIT) {
+  // Gather the request head as it arrives, over as many calls as it takes
+  if (conn.status == HC_WAIT_READ) {
+    if (!_readRequestHead(conn)) {
+      unsigned long timeout = conn.requests ? HTTP_KEEPALIVE_TIMEOUT : HTTP_MAX_DATA_WAIT;
+      bool overflow = conn.headLength == HTTP_HEAD_BUFLEN - 1;
+      if (overflow || millis() - conn.statusChange > timeout) {
+        if (!overflow && conn.headLength == 0) {
+          // Nothing asked, so nothing to answer
+          _closeConnection(conn);
+          return;
+        }
+        // A head that fills the buffer without ending, or stops part way,
+        // is answered before the connection is closed
+        _currentClient = conn.client;
+        _currentVersion = 1;
+        _refuseRequest(overflow ? 431 : 408);
         _currentClient = WiFiClient();
-        _currentStatus = HC_NONE;
+        conn.headLength = 0;
+        conn.status = HC_WAIT_CLOSE;
+        conn.statusChange = millis();
       }
-      yield();
       return;
     }
 
-    if (!_parseRequest(_currentClient)) {
+    _currentClient = conn.client;
+    bool parsed = _parseRequest(_currentClient, conn.head);
+    conn.headLength = 0;
+    if (!parsed) {
+      // Refused with a status that closes the connection
       _currentClient = WiFiClient();
-      _currentStatus = HC_NONE;
+      conn.status = HC_WAIT_CLOSE;
+      conn.statusChange = millis();
       return;
     }
+    if (++conn.requests >= HTTP_MAX_KEEPALIVE_REQUESTS) {
+      _keepAliveRequested = false;
+    }
     _currentClient.setTimeout(HTTP_MAX_SEND_WAIT);
     _contentLength = CONTENT_LENGTH_NOT_SET;
+    _currentKeepAlive = false;
     _handleRequest();
+    // Finish a chunked response the handler left open, or the client
+    // would take the next response as part of this one
+    if (_chunked) {
+      sendContent("");
+    }
+    _currentClient = WiFiClient();
 
-    if (!_currentClient.connected()) {
-      _currentClient = WiFiClient();
-      _currentStatus = HC_NONE;
-      return;
+    if (!conn.client.connected()) {
+      _closeConnection(conn);
+    } else if (_currentKeepAlive) {
+      // Ready for the next request on the same connection
+      conn.status = HC_WAIT_READ;
+      conn.statusChange = millis();
     } else {
-      _currentStatus = HC_WAIT_CLOSE;
-      _statusChange = millis();
-      return;
+      conn.status = HC_WAIT_CLOSE;
+      conn.statusChange = millis();
     }
+    return;
   }
 
-  if (_currentStatus == HC_WAIT_CLOSE) {
-    if (millis() - _statusChange > HTTP_MAX_CLOSE_WAIT) {
-      _currentClient = WiFiClient();
-      _currentStatus = HC_NONE;
-    } else {
-      yield();
-      return;
+  if (conn.status == HC_WAIT_CLOSE) {
+    if (millis() - conn.statusChange > HTTP_MAX_CLOSE_WAIT) {
+      _closeConnection(conn);
     }
   }
 }
 
+void WebServer::_closeConnection(HTTPConnection& conn) {
+  conn.client.stop();
+  conn.client = WiFiClient();
+  conn.status = HC_NONE;
+  conn.headLength = 0;
+}
+
 void WebServer::close() {
 #ifdef ESP8266
   _server.stop();
@@ -241,59 +326,123 @@ void WebServer::stop() {
 }
 
 void WebServer::sendHeader(const String& name, const String& value, bool first) {
-  String headerLine = name;
-  headerLine += ": ";
-  headerLine += value;
-  headerLine += "\r\n";
-
-  if (first) {
-    _responseHeaders = headerLine + _responseHeaders;
+  // A header that would crowd out Content-Length or Connection is dropped,
+  // as the client could not find the end of the response without them
+  _addHeader(name.c_str(), value.c_str(), first, HTTP_RESPONSE_FRAMING);
+}
+
+char* WebServer::_reserveResponse(size_t length, bool first) {
+  if (!first) {
+    if (length > sizeof(_responseBuffer) - _responseEnd)
+      return NULL;
+    char* p = _responseBuffer + _responseEnd;
+    _responseEnd += length;
+    return p;
   }
-  else {
-    _responseHeaders += headerLine;
+  if (length > _responseStart) {
+    // Out of room in front, so move what is there up
+    size_t used = _responseEnd - _responseStart;
+    if (length + used > sizeof(_responseBuffer))
+      return NULL;
+    memmove(_responseBuffer + length, _responseBuffer + _responseStart, used);
+    _responseStart = length;
+    _responseEnd = length + used;
   }
+  _responseStart -= length;
+  return _responseBuffer + _responseStart;
+}
+
+// keep is how much of the buffer must still be free once the header is in
+bool WebServer::_addHeader(const char* name, const char* value, bool first, size_t keep) {
+  size_t nameLength = strlen(name);
+  size_t valueLength = strlen(value);
+  size_t length = nameLength + valueLength + 4;
+  char* line = NULL;
+  if (_responseEnd - _responseStart + length + keep <= sizeof(_responseBuffer))
+    line = _reserveResponse(length, first);
+  if (!line) {
+#ifdef DEBUG_ESP_HTTP_SERVER
+    DEBUG_OUTPUT.print("Response header dropped: ");
+    DEBUG_OUTPUT.println(name);
+#endif
+    return false;
+  }
+  memcpy(line, name, nameLength);
+  line += nameLength;
+  *line++ = ':';
+  *line++ = ' ';
+  memcpy(line, value, valueLength);
+  line += valueLength;
+  *line++ = '\r';
+  *line = '\n';
+  return true;
 }
 
 void WebServer::setContentLength(size_t contentLength) {
     _contentLength = contentLength;
 }
 
-void WebServer::_prepareHeader(String& response, int code, const char* content_type, size_t contentLength) {
-    response = "HTTP/1."+String(_currentVersion)+" ";
-    response += String(code);
-    response += " ";
-    response += _responseCodeToString(code);
-    response += "\r\n";
-
+void WebServer::_prepareHeader(int code, const char* content_type, size_t contentLength) {
     if (!content_type)
         content_type = "text/html";
 
-    sendHeader("Content-Type", content_type, true);
+    char number[11];
+    // Everything after Content-Type fits in the room sendHeader() left
+    _addHeader("Content-Type", content_type, true, HTTP_RESPONSE_FRAMING);
     if (_contentLength == CONTENT_LENGTH_NOT_SET) {
-        sendHeader("Content-Length", String(contentLength));
+        snprintf(number, sizeof(number), "%u", (unsigned)contentLength);
+        _addHeader("Content-Length", number);
     } else if (_contentLength != CONTENT_LENGTH_UNKNOWN) {
-        sendHeader("Content-Length", String(_contentLength));
+        snprintf(number, sizeof(number), "%u", (unsigned)_contentLength);
+        _addHeader("Content-Length", number);
     } else if(_contentLength == CONTENT_LENGTH_UNKNOWN && _currentVersion){ //HTTP/1.1 or above client
       //let's do chunked
       _chunked = true;
-      sendHeader("Accept-Ranges","none");
-      sendHeader("Transfer-Encoding","chunked");
+      _addHeader("Accept-Ranges","none");
+      _addHeader("Transfer-Encoding","chunked");
     }
-    sendHeader("Connection", "close");
-
-    response += _responseHeaders;
-    response += "\r\n";
-    _responseHeaders = String();
+    // Only a response the client can find the end of leaves the
+    // connection usable for another request
+    _currentKeepAlive = _keepAliveRequested && (_contentLength != CONTENT_LENGTH_UNKNOWN || _chunked);
+    _addHeader("Connection", _currentKeepAlive ? "keep-alive" : "close");
+
+    // The status line goes in the room left in front of the headers
+    char status[64];
+    int statusLength = snprintf(status, sizeof(status), "HTTP/1.%d %d %s\r\n", _currentVersion, code, _responseCodeText(code));
+    if (statusLength >= (int)sizeof(status))
+        statusLength = sizeof(status) - 1;
+    char* p = _reserveResponse(statusLength, true);
+    if (p)
+        memcpy(p, status, statusLength);
+    p = _reserveResponse(2, false);
+    if (p)
+        memcpy(p, "\r\n", 2);
+}
+
+bool WebServer::_writeResponse(const char* content, size_t length, bool progmem) {
+    // Chunked headers wait in the buffer for the first chunk to join them
+    if (_chunked)
+        return false;
+    // A body that fits goes out in the same write, and segment, as the headers
+    bool coalesce = length <= sizeof(_responseBuffer) - _responseEnd;
+    if (coalesce && length) {
+        if (progmem)
+            memcpy_P(_responseBuffer + _responseEnd, content, length);
+        else
+            memcpy(_responseBuffer + _responseEnd, content, length);
+        _responseEnd += length;
+    }
+    _currentClient.write(_responseBuffer + _responseStart, _responseEnd - _responseStart);
+    _responseStart = _responseEnd = HTTP_RESPONSE_RESERVE;
+    return coalesce;
 }
 
 void WebServer::send(int code, const char* content_type, const String& content) {
-    String header;
     // Can we asume the following?
     //if(code == 200 && content.length() == 0 && _contentLength == CONTENT_LENGTH_NOT_SET)
     //  _contentLength = CONTENT_LENGTH_UNKNOWN;
-    _prepareHeader(header, code, content_type, content.length());
-    _currentClient.write(header.c_str(), header.length());
-    if(content.length())
+    _prepareHeader(code, content_type, content.length());
+    if (!_writeResponse(content.c_str(), content.length(), false) && content.length())
       sendContent(content);
 }
 
@@ -304,21 +453,16 @@ void WebServer::send_P(int code, PGM_P content_type, PGM_P content) {
         contentLength = strlen_P(content);
     }
 
-    String header;
-    char type[64];
-    memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-    _prepareHeader(header, code, (const char* )type, contentLength);
-    _currentClient.write(header.c_str(), header.length());
-    sendContent_P(content);
+    send_P(code, content_type, content, contentLength);
 }
 
 void WebServer::send_P(int code, PGM_P content_type, PGM_P content, size_t contentLength) {
-    String header;
     char type[64];
     memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-    _prepareHeader(header, code, (const char* )type, contentLength);
-    sendContent(header);
-    sendContent_P(content, contentLength);
+    type[sizeof(type) - 1] = '\0';
+    _prepareHeader(code, (const char* )type, contentLength);
+    if (!_writeResponse(content, contentLength, true) && contentLength)
+      sendContent_P(content, contentLength);
 }
 
 void WebServer::send(int code, char* content_type, const String& content) {
@@ -330,20 +474,7 @@ void WebServer::send(int code, const String& content_type, const String& content
 }
 
 void WebServer::sendContent(const String& content) {
-  const char * footer = "\r\n";
-  size_t len = content.length();
-  if(_chunked) {
-    char * chunkSize = (char *)malloc(11);
-    if(chunkSize){
-      sprintf(chunkSize, "%x%s", len, footer);
-      _currentClient.write(chunkSize, strlen(chunkSize));
-      free(chunkSize);
-    }
-  }
-  _currentClient.write(content.c_str(), len);
-  if(_chunked){
-    _currentClient.write(footer, 2);
-  }
+  _sendContent(content.c_str(), content.length(), false);
 }
 
 void WebServer::sendContent_P(PGM_P content) {
@@ -351,27 +482,152 @@ void WebServer::sendContent_P(PGM_P content) {
 }
 
 void WebServer::sendContent_P(PGM_P content, size_t size) {
-  const char * footer = "\r\n";
-  if(_chunked) {
-    char * chunkSize = (char *)malloc(11);
-    if(chunkSize){
-      sprintf(chunkSize, "%x%s", size, footer);
-      _currentClient.write(chunkSize, strlen(chunkSize));
-      free(chunkSize);
+  _sendContent(content, size, true);
+}
+
+void WebServer::_sendContent(const char* content, size_t size, bool progmem) {
+  if (!_chunked) {
+    flushContent();
+    if (progmem)
+      _currentClient.write_P(content, size);
+    else
+      _currentClient.write(content, size);
+    return;
+  }
+  if (size == 0) {
+    _finishChunked();
+    return;
+  }
+  // Content is gathered into one chunk per buffer, with room kept for the
+  // size line in front and the CRLF behind
+  while (size) {
+    if (!_chunkOpen) {
+      if (sizeof(_responseBuffer) - _responseEnd < HTTP_CHUNK_HEADER_SIZE + 2 + 1)
+        flushContent();
+      _responseEnd += HTTP_CHUNK_HEADER_SIZE;
+      _chunkStart = _responseEnd;
+      _chunkOpen = true;
     }
+    size_t room = sizeof(_responseBuffer) - 2 - _responseEnd;
+    size_t length = size < room ? size : room;
+    if (progmem)
+      memcpy_P(_responseBuffer + _responseEnd, content, length);
+    else
+      memcpy(_responseBuffer + _responseEnd, content, length);
+    _responseEnd += length;
+    content += length;
+    size -= length;
+    if (length == room)
+      flushContent();
   }
-  _currentClient.write_P(content, size);
-  if(_chunked){
-    _currentClient.write(footer, 2);
+}
+
+void WebServer::_closeChunk() {
+  if (!_chunkOpen)
+    return;
+  // Fixed width, leading zeros and all, as the size was not known when the
+  // room for it was kept
+  static const char hex[] = "0123456789abcdef";
+  size_t length = _responseEnd - _chunkStart;
+  char* header = _responseBuffer + _chunkStart - HTTP_CHUNK_HEADER_SIZE;
+  for (int i = HTTP_CHUNK_HEADER_SIZE - 3; i >= 0; i--) {
+    header[i] = hex[length & 0xF];
+    length >>= 4;
   }
+  header[HTTP_CHUNK_HEADER_SIZE - 2] = '\r';
+  header[HTTP_CHUNK_HEADER_SIZE - 1] = '\n';
+  _responseBuffer[_responseEnd++] = '\r';
+  _responseBuffer[_responseEnd++] = '\n';
+  _chunkOpen = false;
 }
 
+void WebServer::flushContent() {
+  _closeChunk();
+  if (_responseEnd > _responseStart)
+    _currentClient.write(_responseBuffer + _responseStart, _responseEnd - _responseStart);
+  _responseStart = _responseEnd = HTTP_RESPONSE_RESERVE;
+}
 
-String WebServer::arg(String name) {
-  for (int i = 0; i < _currentArgCount; ++i) {
-    if ( _currentArgs[i].key == name )
-      return _currentArgs[i].value;
+void WebServer::_finishChunked() {
+  _closeChunk();
+  // The zero length chunk ends the response, in the same write if it fits
+  if (sizeof(_responseBuffer) - _responseEnd < 5)
+    flushContent();
+  memcpy(_responseBuffer + _responseEnd, "0\r\n\r\n", 5);
+  _responseEnd += 5;
+  flushContent();
+  _chunked = false;
+}
+
+
+String WebServer::pathArg(int i) {
+  if (i >= 0 && i < _pathArgCount)
+    return _currentUri.substring(_pathArgs[i].start, _pathArgs[i].start + _pathArgs[i].length);
+  return String();
+}
+
+int WebServer::pathArgs() {
+  return _pathArgCount;
+}
+
+// FNV-1a, folded to 16 bits
+static uint16_t hashName(const char* name, bool ignoreCase) {
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) {
+    hash ^= (uint8_t)(ignoreCase ? tolower(*name) : *name);
+    hash *= 16777619u;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+bool WebServer::_addArgument(const char* key, const char* value) {
+  if (_currentArgCount == HTTP_MAX_ARGS)
+    return false;
+  RequestArgument& arg = _currentArgs[_currentArgCount];
+  arg.key = key;
+  arg.value = value;
+  arg.hash = hashName(key, false);
+  // Appended to the end of its bucket, so the first of a repeated name is found
+  arg.next = 0xFF;
+  uint8_t* link = &_argBuckets[arg.hash % HTTP_ARG_BUCKETS];
+  while (*link != 0xFF)
+    link = &_currentArgs[*link].next;
+  *link = _currentArgCount++;
+  return true;
+}
+
+int WebServer::_findArgument(const char* name) {
+  uint16_t hash = hashName(name, false);
+  for (uint8_t i = _argBuckets[hash % HTTP_ARG_BUCKETS]; i != 0xFF; i = _currentArgs[i].next) {
+    if (_currentArgs[i].hash == hash && !strcmp(_currentArgs[i].key, name))
+      return i;
+  }
+  return -1;
+}
+
+int WebServer::_findHeader(const char* name) {
+  uint16_t hash = hashName(name, true);
+  for (int i = 0; i < _headerKeysCount; ++i) {
+    if (_currentHeaders[i].hash == hash && _currentHeaders[i].key.equalsIgnoreCase(name))
+      return i;
+  }
+  return -1;
+}
+
+void WebServer::_clearRequest() {
+  _arena.reset();
+  _currentArgCount = 0;
+  memset(_argBuckets, 0xFF, sizeof(_argBuckets));
+  for (int i = 0; i < _headerKeysCount; ++i) {
+    _currentHeaders[i].value = NULL;
   }
+  _hostHeader = NULL;
+}
+
+String WebServer::arg(String name) {
+  int i = _findArgument(name.c_str());
+  if (i >= 0)
+    return _currentArgs[i].value;
   return String();
 }
 
@@ -392,19 +648,14 @@ int WebServer::args() {
 }
 
 bool WebServer::hasArg(String  name) {
-  for (int i = 0; i < _currentArgCount; ++i) {
-    if (_currentArgs[i].key == name)
-      return true;
-  }
-  return false;
+  return _findArgument(name.c_str()) >= 0;
 }
 
 
 String WebServer::header(String name) {
-  for (int i = 0; i < _headerKeysCount; ++i) {
-    if (_currentHeaders[i].key.equalsIgnoreCase(name))
-      return _currentHeaders[i].value;
-  }
+  int i = _findHeader(name.c_str());
+  if (i >= 0 && _currentHeaders[i].value)
+    return _currentHeaders[i].value;
   return String();
 }
 
@@ -412,15 +663,19 @@ void WebServer::collectHeaders(const char* headerKeys[], const size_t headerKeys
   _headerKeysCount = headerKeysCount + 1;
   if (_currentHeaders)
      delete[]_currentHeaders;
-  _currentHeaders = new RequestArgument[_headerKeysCount];
+  _currentHeaders = new RequestHeader[_headerKeysCount];
   _currentHeaders[0].key = AUTHORIZATION_HEADER;
   for (int i = 1; i < _headerKeysCount; i++){
     _currentHeaders[i].key = headerKeys[i-1];
   }
+  for (int i = 0; i < _headerKeysCount; i++){
+    _currentHeaders[i].hash = hashName(_currentHeaders[i].key.c_str(), true);
+    _currentHeaders[i].value = NULL;
+  }
 }
 
 String WebServer::header(int i) {
-  if (i < _headerKeysCount)
+  if (i < _headerKeysCount && _currentHeaders[i].value)
     return _currentHeaders[i].value;
   return String();
 }
@@ -436,15 +691,12 @@ int WebServer::headers() {
 }
 
 bool WebServer::hasHeader(String name) {
-  for (int i = 0; i < _headerKeysCount; ++i) {
-    if ((_currentHeaders[i].key.equalsIgnoreCase(name)) &&  (_currentHeaders[i].value.length() > 0))
-      return true;
-  }
-  return false;
+  int i = _findHeader(name.c_str());
+  return i >= 0 && _currentHeaders[i].value && *_currentHeaders[i].value;
 }
 
 String WebServer::hostHeader() {
-  return _hostHeader;
+  return _hostHeader ? _hostHeader : "";
 }
 
 void WebServer::onFileUpload(THandlerFunction fn) {
@@ -481,50 +733,72 @@ void WebServer::_handleRequest() {
   }
 
   _currentUri = String();
+  _clearRequest();
+}
+
+void WebServer::_refuseRequest(int code) {
+  // Whatever else the client sent is not read, so the connection closes
+  _keepAliveRequested = false;
+  _chunked = false;
+  _contentLength = CONTENT_LENGTH_NOT_SET;
+  send(code, "text/plain", _responseCodeText(code));
+}
+
+static const struct {
+  int code;
+  const char* text;
+} responseCodes[] = {
+  { 100, "Continue" },
+  { 101, "Switching Protocols" },
+  { 200, "OK" },
+  { 201, "Created" },
+  { 202, "Accepted" },
+  { 203, "Non-Authoritative Information" },
+  { 204, "No Content" },
+  { 205, "Reset Content" },
+  { 206, "Partial Content" },
+  { 300, "Multiple Choices" },
+  { 301, "Moved Permanently" },
+  { 302, "Found" },
+  { 303, "See Other" },
+  { 304, "Not Modified" },
+  { 305, "Use Proxy" },
+  { 307, "Temporary Redirect" },
+  { 400, "Bad Request" },
+  { 401, "Unauthorized" },
+  { 402, "Payment Required" },
+  { 403, "Forbidden" },
+  { 404, "Not Found" },
+  { 405, "Method Not Allowed" },
+  { 406, "Not Acceptable" },
+  { 407, "Proxy Authentication Required" },
+  { 408, "Request Time-out" },
+  { 409, "Conflict" },
+  { 410, "Gone" },
+  { 411, "Length Required" },
+  { 412, "Precondition Failed" },
+  { 413, "Request Entity Too Large" },
+  { 414, "Request-URI Too Large" },
+  { 415, "Unsupported Media Type" },
+  { 416, "Requested range not satisfiable" },
+  { 417, "Expectation Failed" },
+  { 431, "Request Header Fields Too Large" },
+  { 500, "Internal Server Error" },
+  { 501, "Not Implemented" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Time-out" },
+  { 505, "HTTP Version not supported" },
+};
+
+const char* WebServer::_responseCodeText(int code) {
+  for (size_t i = 0; i < sizeof(responseCodes) / sizeof(responseCodes[0]); i++) {
+    if (responseCodes[i].code == code)
+      return responseCodes[i].text;
+  }
+  return "";
 }
 
 String WebServer::_responseCodeToString(int code) {
-  switch (code) {
-    case 100: return F("Continue");
-    case 101: return F("Switching Protocols");
-    case 200: return F("OK");
-    case 201: return F("Created");
-    case 202: return F("Accepted");
-    case 203: return F("Non-Authoritative Information");
-    case 204: return F("No Content");
-    case 205: return F("Reset Content");
-    case 206: return F("Partial Content");
-    case 300: return F("Multiple Choices");
-    case 301: return F("Moved Permanently");
-    case 302: return F("Found");
-    case 303: return F("See Other");
-    case 304: return F("Not Modified");
-    case 305: return F("Use Proxy");
-    case 307: return F("Temporary Redirect");
-    case 400: return F("Bad Request");
-    case 401: return F("Unauthorized");
-    case 402: return F("Payment Required");
-    case 403: return F("Forbidden");
-    case 404: return F("Not Found");
-    case 405: return F("Method Not Allowed");
-    case 406: return F("Not Acceptable");
-    case 407: return F("Proxy Authentication Required");
-    case 408: return F("Request Time-out");
-    case 409: return F("Conflict");
-    case 410: return F("Gone");
-    case 411: return F("Length Required");
-    case 412: return F("Precondition Failed");
-    case 413: return F("Request Entity Too Large");
-    case 414: return F("Request-URI Too Large");
-    case 415: return F("Unsupported Media Type");
-    case 416: return F("Requested range not satisfiable");
-    case 417: return F("Expectation Failed");
-    case 500: return F("Internal Server Error");
-    case 501: return F("Not Implemented");
-    case 502: return F("Bad Gateway");
-    case 503: return F("Service Unavailable");
-    case 504: return F("Gateway Time-out");
-    case 505: return F("HTTP Version not supported");
-    default:  return "";
-  }
+  return _responseCodeText(code);
 }
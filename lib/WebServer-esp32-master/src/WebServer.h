@@ -1,6 +1,6 @@
 /*
   WebServer.h - Dead simple web-server.
-  Supports only one simultaneous client, knows how to handle GET and POST.
+  Serves up to HTTP_MAX_CLIENTS clients at a time, knows how to handle GET and POST.
 
   Copyright (c) 2014 Ivan Grokhotkov. All rights reserved.
 
@@ -44,11 +44,47 @@ enum HTTPClientStatus { HC_NONE, HC_WAIT_READ, HC_WAIT_CLOSE };
 #define HTTP_UPLOAD_BUFLEN 2048
 #endif
 
+#ifndef HTTP_RESPONSE_BUFLEN
+#define HTTP_RESPONSE_BUFLEN 1460 //bytes of response headers, and a small body, sent in one write
+#endif
+#define HTTP_RESPONSE_RESERVE 96 //bytes kept in front of the headers for the status line
+#define HTTP_RESPONSE_FRAMING 144 //bytes sendHeader() leaves for the status line and the headers send() adds
+#define HTTP_CHUNK_HEADER_SIZE 6 //"05a8\r\n", room for a chunk size up to 0xffff
+
+#ifndef HTTP_HEAD_BUFLEN
+#define HTTP_HEAD_BUFLEN 1024 //bytes held per connection for the request line and headers
+#endif
+
 #define HTTP_MAX_DATA_WAIT 1000 //ms to wait for the client to send the request
 #define HTTP_MAX_POST_WAIT 1000 //ms to wait for POST data to arrive
 #define HTTP_MAX_SEND_WAIT 5000 //ms to wait for data chunk to be ACKed
 #define HTTP_MAX_CLOSE_WAIT 2000 //ms to wait for the client to close the connection
 
+#define HTTP_KEEPALIVE_TIMEOUT 2000 //ms to keep an idle persistent connection open
+
+#ifndef HTTP_MAX_KEEPALIVE_REQUESTS
+#define HTTP_MAX_KEEPALIVE_REQUESTS 16 //requests served on one connection before it is closed
+#endif
+
+// A POST, PUT, PATCH or DELETE body that is not multipart must fit in the
+// arena whole, with a byte to spare; a larger one is answered with 413
+#ifndef HTTP_ARENA_SIZE
+#define HTTP_ARENA_SIZE 2048 //bytes for a request's body and decoded form fields
+#endif
+
+#ifndef HTTP_MAX_ARGS
+#define HTTP_MAX_ARGS 32 //arguments kept from the query string and form
+#endif
+#define HTTP_ARG_BUCKETS 16 //hash buckets for looking up arguments by name
+
+#ifndef HTTP_MAX_PATH_ARGS
+#define HTTP_MAX_PATH_ARGS 4 //{parameters} captured from a route's path
+#endif
+
+#ifndef HTTP_MAX_CLIENTS
+#define HTTP_MAX_CLIENTS 4 //connections served at once, each in its own slot
+#endif
+
 #define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
 #define CONTENT_LENGTH_NOT_SET ((size_t) -2)
 
@@ -65,6 +101,8 @@ typedef struct {
 } HTTPUpload;
 
 #include "detail/RequestHandler.h"
+#include "detail/RouteTree.h"
+#include "detail/RequestArena.h"
 
 namespace fs {
 class FS;
@@ -100,6 +138,8 @@ public:
   WiFiClient client() { return _currentClient; }
   HTTPUpload& upload() { return _currentUpload; }
 
+  String pathArg(int i);          // get value of the i-th {parameter} in the route's path
+  int pathArgs();                 // get path parameter count
   String arg(String name);        // get request argument value by name
   String arg(int i);              // get request argument value by number
   String argName(int i);          // get request argument name by number
@@ -129,6 +169,9 @@ public:
   void sendContent(const String& content);
   void sendContent_P(PGM_P content);
   void sendContent_P(PGM_P content, size_t size);
+  // chunked content is gathered into blocks of up to HTTP_RESPONSE_BUFLEN;
+  // send what is buffered now rather than when the block fills
+  void flushContent();
 
   static String urlDecode(const String& text);
 
@@ -186,21 +229,57 @@ template<typename T> size_t streamFile(T &file, const String& contentType){
 #endif
 
 protected:
+  struct HTTPConnection {
+    WiFiClient       client;
+    HTTPClientStatus status = HC_NONE;
+    unsigned long    statusChange = 0;
+    uint8_t          requests = 0;
+    uint16_t         headLength = 0;
+    char             head[HTTP_HEAD_BUFLEN];
+  };
+
   void _addRequestHandler(RequestHandler* handler);
+  bool _acceptConnection();
+  void _handleConnection(HTTPConnection& conn);
+  void _closeConnection(HTTPConnection& conn);
   void _handleRequest();
-  bool _parseRequest(WiFiClient& client);
-  void _parseArguments(String data);
+  void _refuseRequest(int code);
+  bool _readRequestHead(HTTPConnection& conn);
+  bool _parseRequest(WiFiClient& client, char* head);
+  void _parseArguments(char* data);
+  bool _addArgument(const char* key, const char* value);
+  int _findArgument(const char* name);
+  int _findHeader(const char* name);
+  void _clearRequest();
   static String _responseCodeToString(int code);
+  static const char* _responseCodeText(int code);
   bool _parseForm(WiFiClient& client, String boundary, uint32_t len);
   bool _parseFormUploadAborted();
   void _uploadWriteByte(uint8_t b);
   uint8_t _uploadReadByte(WiFiClient& client);
-  void _prepareHeader(String& response, int code, const char* content_type, size_t contentLength);
+  void _prepareHeader(int code, const char* content_type, size_t contentLength);
+  bool _addHeader(const char* name, const char* value, bool first = false, size_t keep = 0);
+  char* _reserveResponse(size_t length, bool first);
+  bool _writeResponse(const char* content, size_t length, bool progmem);
+  void _sendContent(const char* content, size_t size, bool progmem);
+  void _closeChunk();
+  void _finishChunked();
   bool _collectHeader(const char* headerName, const char* headerValue);
+  void _parseConnectionHeader(const char* value);
 
+  // Arguments and header values are views into the connection's head
+  // buffer or the request arena, valid until the request is done
   struct RequestArgument {
-    String key;
-    String value;
+    const char* key;
+    const char* value;
+    uint16_t    hash;
+    uint8_t     next;   // next argument in the same hash bucket
+  };
+
+  struct RequestHeader {
+    String      key;
+    uint16_t    hash;
+    const char* value;
   };
 
   WiFiServer  _server;
@@ -209,8 +288,12 @@ protected:
   HTTPMethod  _currentMethod;
   String      _currentUri;
   uint8_t     _currentVersion;
-  HTTPClientStatus _currentStatus;
-  unsigned long _statusChange;
+
+  HTTPConnection _connections[HTTP_MAX_CLIENTS];
+
+  RouteTree        _routes;
+  RoutePathArg     _pathArgs[HTTP_MAX_PATH_ARGS];
+  uint8_t          _pathArgCount;
 
   RequestHandler*  _currentHandler;
   RequestHandler*  _firstHandler;
@@ -218,17 +301,27 @@ protected:
   THandlerFunction _notFoundHandler;
   THandlerFunction _fileUploadHandler;
 
+  RequestArena     _arena;
   int              _currentArgCount;
-  RequestArgument* _currentArgs;
+  RequestArgument  _currentArgs[HTTP_MAX_ARGS];
+  uint8_t          _argBuckets[HTTP_ARG_BUCKETS];
   HTTPUpload       _currentUpload;
 
   int              _headerKeysCount;
-  RequestArgument* _currentHeaders;
+  RequestHeader*   _currentHeaders;
   size_t           _contentLength;
-  String           _responseHeaders;
-
-  String           _hostHeader;
+  // Headers are built from the middle of the buffer: sendHeader(..., true)
+  // and the status line grow down into the reserve, the rest grow up
+  char             _responseBuffer[HTTP_RESPONSE_BUFLEN];
+  uint16_t         _responseStart;
+  uint16_t         _responseEnd;
+  uint16_t         _chunkStart;     // first data byte of the open chunk
+  bool             _chunkOpen;
+
+  const char*      _hostHeader;
   bool             _chunked;
+  bool             _keepAliveRequested;
+  bool             _currentKeepAlive;
 
 };
 
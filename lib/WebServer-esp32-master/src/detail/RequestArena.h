@@ -0,0 +1,39 @@
+#ifndef REQUESTARENA_H
+#define REQUESTARENA_H
+
+// Bump allocator for data that lives only as long as one request, such as a
+// request body or decoded form fields. Nothing is freed on its own; reset()
+// releases everything at once when the request is done.
+class RequestArena {
+public:
+    RequestArena() : _used(0) { }
+
+    void reset() { _used = 0; }
+
+    // nullptr if the request has used up the arena
+    char* alloc(size_t size) {
+        if (size > HTTP_ARENA_SIZE - _used)
+            return nullptr;
+        char* p = _buf + _used;
+        _used += size;
+        return p;
+    }
+
+    // A NUL terminated copy of length bytes of text
+    char* copy(const char* text, size_t length) {
+        char* p = alloc(length + 1);
+        if (p) {
+            memcpy(p, text, length);
+            p[length] = '\0';
+        }
+        return p;
+    }
+
+    size_t used() const { return _used; }
+
+private:
+    char _buf[HTTP_ARENA_SIZE];
+    size_t _used;
+};
+
+#endif //REQUESTARENA_H
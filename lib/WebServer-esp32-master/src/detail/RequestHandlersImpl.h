@@ -17,7 +17,7 @@ public:
         if (_method != HTTP_ANY && _method != requestMethod)
             return false;
 
-        if (requestUri != _uri)
+        if (!RouteTree::matches(_uri.c_str(), requestUri.c_str()))
             return false;
 
         return true;
@@ -133,6 +133,8 @@ public:
         return true;
     }
 
+    bool isFile() const { return _isFile; }
+
     static String getContentType(const String& path) {
         if (path.endsWith(".html")) return "text/html";
         else if (path.endsWith(".htm")) return "text/html";
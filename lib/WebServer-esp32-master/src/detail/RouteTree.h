@@ -0,0 +1,181 @@
+#ifndef ROUTETREE_H
+#define ROUTETREE_H
+
+#include "RequestHandler.h"
+
+struct RoutePathArg {
+    uint16_t start;     // offset into the request path
+    uint16_t length;
+};
+
+// Index of handlers by path, built as they are registered. Each node is one
+// path segment; a segment written {name} matches any single segment and is
+// captured as a path argument. Lookup walks one node per segment, so its cost
+// does not grow with the number of routes.
+class RouteTree {
+public:
+    RouteTree() : _root(new Node()) { }
+
+    ~RouteTree() {
+        _delete(_root);
+    }
+
+    // Takes ownership of handler. An exact route answers only its own path,
+    // a prefix route also answers every path below it.
+    void add(const char* uri, HTTPMethod method, RequestHandler* handler, bool prefix) {
+        Node* node = _root;
+        const char* path = (*uri == '/') ? uri + 1 : uri;
+        // "/static/" serves the same paths as "/static"
+        while (path && !(prefix && *path == '\0')) {
+            const char* end = _segmentEnd(path);
+            node = _child(node, path, end - path);
+            path = *end ? end + 1 : nullptr;
+        }
+        Route* route = new Route();
+        route->handler = handler;
+        route->methods = _methodBits(method);
+        Route** list = prefix ? &node->prefixes : &node->routes;
+        while (*list) list = &(*list)->next;
+        *list = route;
+    }
+
+    // The handler for method on path, preferring exact segments over
+    // parameters and the deepest prefix route otherwise. Fills args with
+    // the captured parameters.
+    RequestHandler* find(HTTPMethod method, const char* path, RoutePathArg* args, uint8_t& argCount) {
+        argCount = 0;
+        if (*path != '/')
+            return nullptr;
+        return _find(_root, _methodBits(method), path, path + 1, args, 0, argCount);
+    }
+
+    // True if path matches pattern segment for segment, {name} matching any
+    static bool matches(const char* pattern, const char* path) {
+        while (*pattern && *path) {
+            if (*pattern == '{') {
+                pattern = _segmentEnd(pattern);
+                path = _segmentEnd(path);
+            } else if (*pattern++ != *path++) {
+                return false;
+            }
+        }
+        return *pattern == *path;
+    }
+
+private:
+    struct Route {
+        RequestHandler* handler = nullptr;
+        uint8_t methods = 0;
+        Route* next = nullptr;
+    };
+
+    struct Node {
+        char* segment = nullptr;    // nullptr for a {parameter}
+        size_t length = 0;
+        Node* children = nullptr;   // literal segments
+        Node* param = nullptr;
+        Node* next = nullptr;
+        Route* routes = nullptr;
+        Route* prefixes = nullptr;
+    };
+
+    static uint8_t _methodBits(HTTPMethod method) {
+        return method == HTTP_ANY ? 0xFF : (1 << method);
+    }
+
+    static const char* _segmentEnd(const char* path) {
+        while (*path && *path != '/') path++;
+        return path;
+    }
+
+    static Node* _child(Node* node, const char* segment, size_t length) {
+        if (length >= 2 && segment[0] == '{' && segment[length - 1] == '}') {
+            if (!node->param)
+                node->param = new Node();
+            return node->param;
+        }
+        for (Node* child = node->children; child; child = child->next) {
+            if (child->length == length && !memcmp(child->segment, segment, length))
+                return child;
+        }
+        Node* child = new Node();
+        child->segment = new char[length + 1];
+        memcpy(child->segment, segment, length);
+        child->segment[length] = '\0';
+        child->length = length;
+        child->next = node->children;
+        node->children = child;
+        return child;
+    }
+
+    static RequestHandler* _match(Route* route, uint8_t bit) {
+        for (; route; route = route->next) {
+            if (route->methods & bit)
+                return route->handler;
+        }
+        return nullptr;
+    }
+
+    // path is the rest of the request after the segments already matched,
+    // or nullptr once every segment is used
+    static RequestHandler* _find(Node* node, uint8_t bit, const char* uri, const char* path,
+                                 RoutePathArg* args, uint8_t depth, uint8_t& argCount) {
+        RequestHandler* handler;
+        if (!path) {
+            handler = _match(node->routes, bit);
+            if (handler) {
+                argCount = depth;
+                return handler;
+            }
+        } else {
+            const char* end = _segmentEnd(path);
+            size_t length = end - path;
+            const char* rest = *end ? end + 1 : nullptr;
+            for (Node* child = node->children; child; child = child->next) {
+                if (child->length == length && !memcmp(child->segment, path, length)) {
+                    handler = _find(child, bit, uri, rest, args, depth, argCount);
+                    if (handler)
+                        return handler;
+                    break;
+                }
+            }
+            if (node->param && length > 0 && depth < HTTP_MAX_PATH_ARGS) {
+                args[depth].start = path - uri;
+                args[depth].length = length;
+                handler = _find(node->param, bit, uri, rest, args, depth + 1, argCount);
+                if (handler)
+                    return handler;
+            }
+        }
+        handler = _match(node->prefixes, bit);
+        if (handler)
+            argCount = depth;
+        return handler;
+    }
+
+    static void _delete(Node* node) {
+        while (node) {
+            Node* next = node->next;
+            _delete(node->children);
+            _delete(node->param);
+            _delete(node->routes);
+            _delete(node->prefixes);
+            delete[] node->segment;
+            delete node;
+            node = next;
+        }
+    }
+
+    static void _delete(Route* route) {
+        while (route) {
+            Route* next = route->next;
+            delete route->handler;
+            delete route;
+            route = next;
+        }
+    }
+
+    Node* _root;
+};
+
+#endif //ROUTETREE_H
@@ -0,0 +1,288 @@
+#include "WebServer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+static bool contains(const std::string& text, const char* part) {
+    return text.find(part) != std::string::npos;
+}
+
+static int responses(const std::string& text) {
+    int count = 0;
+    for (size_t i = text.find("HTTP/1."); i != std::string::npos; i = text.find("HTTP/1.", i + 1))
+        count++;
+    return count;
+}
+
+static void serve(WebServer& server, int calls = 3) {
+    for (int i = 0; i < calls; i++)
+        server.handleClient();
+}
+
+static void hello(WebServer& server) {
+    server.on("/hello", [&server]() { server.send(200, "text/plain", "hi " + server.arg("name")); });
+    server.begin();
+}
+
+
+int test_connection_serves_many() {
+    IT("answers one client while others are still sending");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> slow[HTTP_MAX_CLIENTS - 1];
+    for (int i = 0; i < HTTP_MAX_CLIENTS - 1; i++)
+        slow[i] = connectClient("GET /hello?name=slow HTTP/1.1\r\n");
+    std::shared_ptr<ShimConnection> fast = connectClient("GET /hello?name=fast HTTP/1.1\r\n\r\n");
+    serve(server);
+    IS_TRUE(contains(fast->output, "hi fast"));
+    for (int i = 0; i < HTTP_MAX_CLIENTS - 1; i++) {
+        IS_TRUE(slow[i]->output.empty());
+        IS_TRUE(slow[i]->open);
+        slow[i]->input += "\r\n";
+    }
+    serve(server);
+    for (int i = 0; i < HTTP_MAX_CLIENTS - 1; i++)
+        IS_TRUE(contains(slow[i]->output, "hi slow"));
+
+    END_IT
+}
+
+int test_connection_keep_alive() {
+    IT("keeps an HTTP/1.1 connection open for the next request");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello?name=a HTTP/1.1\r\n\r\n");
+    serve(server);
+    IS_TRUE(contains(c->output, "HTTP/1.1 200 OK\r\n"));
+    IS_TRUE(contains(c->output, "Content-Length: 4\r\n"));
+    IS_TRUE(contains(c->output, "Connection: keep-alive\r\n"));
+    IS_TRUE(c->open);
+
+    c->output.clear();
+    c->input += "GET /hello?name=b HTTP/1.1\r\n\r\n";
+    serve(server);
+    IS_TRUE(contains(c->output, "hi b"));
+    IS_TRUE(c->open);
+
+    END_IT
+}
+
+int test_connection_pipelined() {
+    IT("answers requests pipelined on one connection in order");
+    WebServer server(80);
+    server.on("/a", [&server]() { server.send(200, "text/plain", "first"); });
+    server.on("/user/{id}", [&server]() { server.send(200, "text/plain", "user " + server.pathArg(0)); });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /user/42 HTTP/1.1\r\nHost: x\r\n\r\n");
+    serve(server);
+    IS_TRUE(responses(c->output) == 2);
+    size_t first = c->output.find("first");
+    IS_TRUE(first != std::string::npos);
+    IS_TRUE(c->output.find("user 42", first) != std::string::npos);
+
+    END_IT
+}
+
+int test_connection_skips_unread_body() {
+    IT("skips a body no handler reads before the next request");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello?name=a HTTP/1.1\r\nContent-Length: 18\r\n\r\nGET /nothere HTTP/"
+                                                      "GET /hello?name=b HTTP/1.1\r\n\r\n");
+    serve(server);
+    IS_TRUE(responses(c->output) == 2);
+    IS_TRUE(contains(c->output, "hi a"));
+    IS_TRUE(contains(c->output, "hi b"));
+    IS_FALSE(contains(c->output, "404"));
+
+    END_IT
+}
+
+int test_connection_closes_on_pending_body() {
+    IT("closes instead of waiting for a body no handler reads");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello?name=a HTTP/1.1\r\nContent-Length: 100000\r\n\r\nabc");
+    std::shared_ptr<ShimConnection> other = connectClient("GET /hello?name=b HTTP/1.1\r\n\r\n");
+    unsigned long start = millis();
+    serve(server, 1);
+    IS_TRUE(millis() - start < HTTP_MAX_POST_WAIT);
+    IS_TRUE(contains(c->output, "hi a"));
+    IS_TRUE(contains(c->output, "Connection: close\r\n"));
+    IS_TRUE(contains(other->output, "hi b"));
+    // The rest of the body is never taken for a request
+    c->input += std::string(1000, 'x') + "GET /hello?name=c HTTP/1.1\r\n\r\n";
+    serve(server);
+    IS_FALSE(contains(c->output, "hi c"));
+    IS_TRUE(responses(c->output) == 1);
+
+    END_IT
+}
+
+int test_connection_http10_closes() {
+    IT("closes an HTTP/1.0 connection after the response");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello?name=a HTTP/1.0\r\n\r\n");
+    serve(server);
+    IS_TRUE(contains(c->output, "HTTP/1.0 200 OK\r\n"));
+    IS_TRUE(contains(c->output, "Connection: close\r\n"));
+    // Left for the client to close first, then closed by the server
+    IS_TRUE(c->open);
+    advanceMillis(HTTP_MAX_CLOSE_WAIT + 1);
+    serve(server);
+    IS_FALSE(c->open);
+
+    END_IT
+}
+
+int test_connection_client_close() {
+    IT("honours Connection: close from an HTTP/1.1 client");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello?name=a HTTP/1.1\r\nConnection: keep-alive, close\r\n\r\n");
+    serve(server);
+    IS_TRUE(contains(c->output, "Connection: close\r\n"));
+    c->input += "GET /hello?name=b HTTP/1.1\r\n\r\n";
+    serve(server);
+    IS_FALSE(contains(c->output, "hi b"));
+
+    END_IT
+}
+
+int test_connection_split_head() {
+    IT("gathers a request head over several calls");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hel");
+    serve(server);
+    IS_TRUE(c->output.empty());
+    c->input += "lo?name=split HTTP/1.1\r\nHost: x\r";
+    serve(server);
+    IS_TRUE(c->output.empty());
+    c->input += "\n\r\n";
+    serve(server);
+    IS_TRUE(contains(c->output, "hi split"));
+
+    END_IT
+}
+
+int test_connection_idle_timeout() {
+    IT("closes a keep-alive connection left idle");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello HTTP/1.1\r\n\r\n");
+    serve(server);
+    IS_TRUE(c->open);
+    advanceMillis(HTTP_KEEPALIVE_TIMEOUT / 2);
+    serve(server);
+    IS_TRUE(c->open);
+    advanceMillis(HTTP_KEEPALIVE_TIMEOUT);
+    serve(server);
+    IS_FALSE(c->open);
+
+    END_IT
+}
+
+int test_connection_request_limit() {
+    IT("closes after HTTP_MAX_KEEPALIVE_REQUESTS requests");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient();
+    for (int i = 1; i <= HTTP_MAX_KEEPALIVE_REQUESTS; i++) {
+        c->output.clear();
+        c->input += "GET /hello HTTP/1.1\r\n\r\n";
+        serve(server);
+        IS_TRUE(responses(c->output) == 1);
+        IS_TRUE(contains(c->output, i < HTTP_MAX_KEEPALIVE_REQUESTS ? "Connection: keep-alive" : "Connection: close"));
+    }
+
+    END_IT
+}
+
+int test_connection_reclaims_slot() {
+    IT("gives the slot of an answered client to a new one when full");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> done[HTTP_MAX_CLIENTS];
+    for (int i = 0; i < HTTP_MAX_CLIENTS; i++)
+        done[i] = connectClient("GET /hello HTTP/1.0\r\n\r\n");
+    serve(server);
+    std::shared_ptr<ShimConnection> next = connectClient("GET /hello?name=next HTTP/1.1\r\n\r\n");
+    serve(server);
+    IS_TRUE(contains(next->output, "hi next"));
+    IS_FALSE(done[0]->open);
+    IS_TRUE(done[1]->open);
+
+    END_IT
+}
+
+int test_connection_head_timeout() {
+    IT("answers 408 to a client that stops part way through its request");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello HTTP/1.1\r\n");
+    std::shared_ptr<ShimConnection> quiet = connectClient();
+    serve(server);
+    IS_TRUE(c->open);
+    advanceMillis(HTTP_MAX_DATA_WAIT + 1);
+    serve(server);
+    IS_TRUE(c->output.find("HTTP/1.1 408 Request Time-out\r\n") == 0);
+    IS_TRUE(contains(c->output, "Connection: close\r\n"));
+    // one that never sent anything is closed without an answer
+    IS_TRUE(quiet->output.empty());
+    IS_FALSE(quiet->open);
+    advanceMillis(HTTP_MAX_CLOSE_WAIT + 1);
+    serve(server);
+    IS_FALSE(c->open);
+
+    END_IT
+}
+
+int test_connection_head_overflow() {
+    IT("answers 431 to a request head longer than HTTP_HEAD_BUFLEN");
+    WebServer server(80);
+    hello(server);
+
+    std::shared_ptr<ShimConnection> c = connectClient("GET /hello HTTP/1.1\r\nCookie: " + std::string(HTTP_HEAD_BUFLEN, 'c') + "\r\n\r\n");
+    serve(server);
+    IS_TRUE(c->output.find("HTTP/1.1 431 Request Header Fields Too Large\r\n") == 0);
+    IS_TRUE(contains(c->output, "Connection: close\r\n"));
+    IS_FALSE(contains(c->output, "hi"));
+    advanceMillis(HTTP_MAX_CLOSE_WAIT + 1);
+    serve(server);
+    IS_FALSE(c->open);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Connections");
+    test_connection_serves_many();
+    test_connection_keep_alive();
+    test_connection_pipelined();
+    test_connection_skips_unread_body();
+    test_connection_closes_on_pending_body();
+    test_connection_http10_closes();
+    test_connection_client_close();
+    test_connection_split_head();
+    test_connection_idle_timeout();
+    test_connection_request_limit();
+    test_connection_reclaims_slot();
+    test_connection_head_timeout();
+    test_connection_head_overflow();
+
+    FINISH
+}
@@ -0,0 +1,26 @@
+#ifndef allocations_h
+#define allocations_h
+
+#include <stddef.h>
+
+// On Linux the shim replaces malloc, calloc and realloc (and so operator
+// new) with versions that count calls, so specs and benchmarks can check
+// that a path does not touch the heap:
+//
+//     AllocationCounter allocations;
+//     client.publish("topic","payload");
+//     IS_TRUE(allocations.count() == 0);
+//
+// Counting is disabled under AddressSanitizer, which has its own allocator.
+unsigned long allocationCount();
+
+class AllocationCounter {
+private:
+    unsigned long start;
+public:
+    AllocationCounter();
+    unsigned long count();
+    void reset();
+};
+
+#endif
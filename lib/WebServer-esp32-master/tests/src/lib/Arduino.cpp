@@ -0,0 +1,27 @@
+#include "Arduino.h"
+
+static unsigned long clockMillis = 0;
+
+unsigned long millis() {
+    return clockMillis;
+}
+
+unsigned long micros() {
+    return clockMillis * 1000;
+}
+
+void delay(unsigned long ms) {
+    clockMillis += ms;
+}
+
+void yield() {
+    clockMillis += 1;
+}
+
+void advanceMillis(unsigned long ms) {
+    clockMillis += ms;
+}
+
+void resetClock() {
+    clockMillis = 0;
+}
@@ -0,0 +1,103 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// The shim runs on a virtual clock that starts at zero and only moves when
+// a test advances it, so timeouts can be exercised without waiting for them.
+// delay() advances it by the time asked for and yield() by 1ms.
+void advanceMillis(unsigned long ms);
+void resetClock();
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+typedef const char* PGM_P;
+typedef const void* PGM_VOID_P;
+#define memcpy_P memcpy
+#define memccpy_P memccpy
+#define strlen_P strlen
+
+// Just enough of Arduino's String for the library, kept on a std::string
+class String {
+public:
+    String() { }
+    String(const char* text) : _s(text ? text : "") { }
+    String(const std::string& text) : _s(text) { }
+    explicit String(char c) : _s(1, c) { }
+    explicit String(int value) : _s(std::to_string(value)) { }
+    explicit String(unsigned int value) : _s(std::to_string(value)) { }
+    explicit String(long value) : _s(std::to_string(value)) { }
+    explicit String(unsigned long value) : _s(std::to_string(value)) { }
+
+    const char* c_str() const { return _s.c_str(); }
+    unsigned int length() const { return _s.size(); }
+    char charAt(unsigned int i) const { return i < _s.size() ? _s[i] : 0; }
+    long toInt() const { return atol(_s.c_str()); }
+
+    String substring(unsigned int from) const { return substring(from, _s.size()); }
+    String substring(unsigned int from, unsigned int to) const {
+        if (to > _s.size()) to = _s.size();
+        if (from >= to) return String();
+        return String(_s.substr(from, to - from));
+    }
+    int indexOf(char c, unsigned int from = 0) const {
+        size_t i = _s.find(c, from);
+        return i == std::string::npos ? -1 : (int)i;
+    }
+    int indexOf(const char* text, unsigned int from = 0) const {
+        size_t i = _s.find(text, from);
+        return i == std::string::npos ? -1 : (int)i;
+    }
+    bool startsWith(const String& prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+    bool endsWith(const String& suffix) const {
+        return _s.size() >= suffix._s.size() && _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+    }
+    bool equals(const String& other) const { return _s == other._s; }
+    bool equalsIgnoreCase(const String& other) const { return strcasecmp(_s.c_str(), other._s.c_str()) == 0; }
+    void toLowerCase() {
+        for (size_t i = 0; i < _s.size(); i++)
+            _s[i] = tolower((unsigned char)_s[i]);
+    }
+    void trim() {
+        size_t first = _s.find_first_not_of(" \t\r\n");
+        size_t last = _s.find_last_not_of(" \t\r\n");
+        _s = first == std::string::npos ? std::string() : _s.substr(first, last - first + 1);
+    }
+
+    String& operator+=(const String& other) { _s += other._s; return *this; }
+    String& operator+=(const char* other) { _s += other; return *this; }
+    String& operator+=(char c) { _s += c; return *this; }
+    bool operator==(const String& other) const { return _s == other._s; }
+    bool operator==(const char* other) const { return _s == other; }
+    bool operator!=(const String& other) const { return _s != other._s; }
+    bool operator!=(const char* other) const { return _s != other; }
+
+    friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+    friend String operator+(const String& a, const char* b) { return String(a._s + b); }
+    friend String operator+(const char* a, const String& b) { return String(a + b._s); }
+
+private:
+    std::string _s;
+};
+
+class IPAddress {
+public:
+    IPAddress() { }
+    IPAddress(uint8_t, uint8_t, uint8_t, uint8_t) { }
+};
+
+#endif // Arduino_h
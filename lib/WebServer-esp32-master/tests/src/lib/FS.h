@@ -0,0 +1,55 @@
+#ifndef fs_h
+#define fs_h
+
+#include "Arduino.h"
+#include <map>
+#include <memory>
+#include <string>
+
+namespace fs {
+
+// An open file reads from its own copy of the contents
+class File {
+public:
+    File() : _open(false), _pos(0) { }
+    File(const std::string& name, const std::string& contents) : _open(true), _name(name), _contents(contents), _pos(0) { }
+
+    explicit operator bool() const { return _open; }
+    const char* name() const { return _name.c_str(); }
+    size_t size() const { return _contents.size(); }
+    int available() const { return _contents.size() - _pos; }
+    int read(uint8_t* buffer, size_t length) {
+        size_t count = _contents.copy((char*)buffer, length, _pos);
+        _pos += count;
+        return count;
+    }
+
+private:
+    bool _open;
+    std::string _name;
+    std::string _contents;
+    size_t _pos;
+};
+
+// Files held in memory; copies of an FS see the same files
+class FS {
+public:
+    FS() : _files(std::make_shared<std::map<std::string, std::string> >()) { }
+
+    void addFile(const char* path, const std::string& contents) { (*_files)[path] = contents; }
+    bool exists(const String& path) const { return _files->count(path.c_str()) > 0; }
+    File open(const String& path, const char*) const {
+        std::map<std::string, std::string>::const_iterator it = _files->find(path.c_str());
+        return it == _files->end() ? File() : File(it->first, it->second);
+    }
+
+private:
+    std::shared_ptr<std::map<std::string, std::string> > _files;
+};
+
+}
+
+using fs::FS;
+using fs::File;
+
+#endif
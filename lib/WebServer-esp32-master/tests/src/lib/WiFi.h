@@ -0,0 +1,7 @@
+#ifndef wifi_h
+#define wifi_h
+
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+
+#endif
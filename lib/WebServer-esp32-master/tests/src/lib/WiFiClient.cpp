@@ -0,0 +1,52 @@
+#include "WiFiClient.h"
+
+uint8_t WiFiClient::connected() {
+    return _connection && _connection->open;
+}
+
+int WiFiClient::available() {
+    if (!_connection)
+        return 0;
+    return _connection->input.size() - _connection->readPos;
+}
+
+int WiFiClient::read() {
+    if (!available())
+        return -1;
+    return (uint8_t)_connection->input[_connection->readPos++];
+}
+
+size_t WiFiClient::readBytes(char* buffer, size_t length) {
+    size_t count = 0;
+    while (count < length && available()) {
+        buffer[count++] = read();
+    }
+    return count;
+}
+
+String WiFiClient::readStringUntil(char terminator) {
+    std::string text;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) {
+        text += (char)c;
+    }
+    return String(text);
+}
+
+size_t WiFiClient::write(const char* buffer, size_t length) {
+    if (!connected())
+        return 0;
+    _connection->output.append(buffer, length);
+    _connection->writes++;
+    return length;
+}
+
+void WiFiClient::flush() {
+    if (_connection)
+        _connection->readPos = _connection->input.size();
+}
+
+void WiFiClient::stop() {
+    if (_connection)
+        _connection->open = false;
+}
@@ -0,0 +1,43 @@
+#ifndef wificlient_h
+#define wificlient_h
+
+#include "Arduino.h"
+#include <memory>
+#include <string>
+
+// The far end of one connection. A spec writes the request into input and
+// reads the server's reply from output; the server's WiFiClient and the
+// spec share it, as copies of an ESP32 WiFiClient share one socket.
+struct ShimConnection {
+    std::string input;
+    size_t      readPos = 0;
+    std::string output;
+    int         writes = 0;     // calls to write(), one per segment sent
+    bool        open = true;    // until either end closes
+};
+
+class WiFiClient {
+public:
+    WiFiClient() { }
+    WiFiClient(const std::shared_ptr<ShimConnection>& connection) : _connection(connection) { }
+
+    uint8_t connected();
+    int available();
+    int read();
+    size_t readBytes(char* buffer, size_t length);
+    size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+    String readStringUntil(char terminator);
+    size_t write(const char* buffer, size_t length);
+    size_t write(const uint8_t* buffer, size_t length) { return write((const char*)buffer, length); }
+    // Like the ESP32 core, throws away whatever has been received and not read
+    void flush();
+    void stop();
+    void setTimeout(unsigned long) { }
+
+    explicit operator bool() const { return (bool)_connection; }
+
+private:
+    std::shared_ptr<ShimConnection> _connection;
+};
+
+#endif
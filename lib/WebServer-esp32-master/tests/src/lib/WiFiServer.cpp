@@ -0,0 +1,19 @@
+#include "WiFiServer.h"
+#include <deque>
+
+static std::deque<std::shared_ptr<ShimConnection> > pending;
+
+std::shared_ptr<ShimConnection> connectClient(const std::string& request) {
+    std::shared_ptr<ShimConnection> connection = std::make_shared<ShimConnection>();
+    connection->input = request;
+    pending.push_back(connection);
+    return connection;
+}
+
+WiFiClient WiFiServer::available() {
+    if (pending.empty())
+        return WiFiClient();
+    WiFiClient client(pending.front());
+    pending.pop_front();
+    return client;
+}
@@ -0,0 +1,20 @@
+#ifndef wifiserver_h
+#define wifiserver_h
+
+#include "WiFiClient.h"
+
+// Connections are queued with connectClient() and handed out one per call
+// to available(), to whichever WiFiServer asks first
+std::shared_ptr<ShimConnection> connectClient(const std::string& request = "");
+
+class WiFiServer {
+public:
+    WiFiServer(IPAddress, int) { }
+    WiFiServer(int) { }
+
+    WiFiClient available();
+    void begin() { }
+    void end() { }
+};
+
+#endif
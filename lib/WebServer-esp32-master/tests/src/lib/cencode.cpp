@@ -0,0 +1,23 @@
+#include "libb64/cencode.h"
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int base64_encode_expected_len(int plaintext_len) {
+    return (plaintext_len + 2) / 3 * 4;
+}
+
+int base64_encode_chars(const char* plaintext_in, int length_in, char* code_out) {
+    const unsigned char* in = (const unsigned char*)plaintext_in;
+    char* out = code_out;
+    for (int i = 0; i < length_in; i += 3) {
+        unsigned long group = (unsigned long)in[i] << 16;
+        if (i + 1 < length_in) group |= (unsigned long)in[i + 1] << 8;
+        if (i + 2 < length_in) group |= in[i + 2];
+        *out++ = alphabet[(group >> 18) & 0x3F];
+        *out++ = alphabet[(group >> 12) & 0x3F];
+        *out++ = i + 1 < length_in ? alphabet[(group >> 6) & 0x3F] : '=';
+        *out++ = i + 2 < length_in ? alphabet[group & 0x3F] : '=';
+    }
+    *out = '\0';
+    return out - code_out;
+}
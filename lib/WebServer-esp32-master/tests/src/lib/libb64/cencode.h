@@ -0,0 +1,8 @@
+#ifndef cencode_h
+#define cencode_h
+
+// The two libb64 entry points WebServer::authenticate() uses
+int base64_encode_expected_len(int plaintext_len);
+int base64_encode_chars(const char* plaintext_in, int length_in, char* code_out);
+
+#endif
@@ -0,0 +1,238 @@
+#include "WebServer.h"
+#include "Allocations.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+static std::string body(const std::string& response) {
+    size_t end = response.find("\r\n\r\n");
+    return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+static std::string request(WebServer& server, const std::string& text) {
+    std::shared_ptr<ShimConnection> c = connectClient(text);
+    server.handleClient();
+    return c->output;
+}
+
+static std::string post(WebServer& server, const char* path, const char* type, const std::string& content) {
+    return request(server, std::string("POST ") + path + " HTTP/1.1\r\nContent-Type: " + type +
+                   "\r\nContent-Length: " + std::to_string(content.size()) + "\r\n\r\n" + content);
+}
+
+// Every argument as name=value;
+static void listArgs(WebServer& server) {
+    server.on("/args", [&server]() {
+        String list;
+        for (int i = 0; i < server.args(); i++)
+            list += server.argName(i) + "=" + server.arg(i) + ";";
+        server.send(200, "text/plain", list);
+    });
+}
+
+
+int test_parsing_query() {
+    IT("splits and decodes the query string");
+    WebServer server(80);
+    listArgs(server);
+    server.on("/find", [&server]() {
+        server.send(200, "text/plain", server.arg("a") + "|" + server.arg("b") + "|" + String(server.hasArg("c") ? 1 : 0));
+    });
+    server.begin();
+
+    IS_TRUE(body(request(server, "GET /args?a=1%262&b=hello+w%20d&bare&c= HTTP/1.1\r\n\r\n")) == "a=1&2;b=hello w d;c=;");
+    // the first of a repeated name is the one found
+    IS_TRUE(body(request(server, "GET /find?a=x&a=y&b=%zz HTTP/1.1\r\n\r\n")) == "x|%zz|0");
+
+    END_IT
+}
+
+int test_parsing_headers() {
+    IT("collects the headers asked for, by any case");
+    WebServer server(80);
+    const char* keys[] = { "X-Test", "Accept" };
+    server.collectHeaders(keys, 2);
+    server.on("/h", [&server]() {
+        server.send(200, "text/plain", "[" + server.header("x-test") + "][" + server.header("Accept") + "][" +
+                    server.hostHeader() + "][" + String(server.hasHeader("Accept") ? 1 : 0) + "]");
+    });
+    server.begin();
+
+    IS_TRUE(body(request(server, "GET /h HTTP/1.1\r\nhost: box\r\nX-TEST: \t v1 \r\nOther: no\r\n\r\n")) == "[v1][][box][0]");
+    // values are cleared between requests
+    IS_TRUE(body(request(server, "GET /h HTTP/1.1\r\nAccept: */*\r\n\r\n")) == "[][*/*][][1]");
+
+    END_IT
+}
+
+int test_parsing_bodies() {
+    IT("takes arguments from form and plain bodies");
+    WebServer server(80);
+    listArgs(server);
+    server.begin();
+
+    IS_TRUE(body(post(server, "/args?q=1", "application/x-www-form-urlencoded", "a=1&b=two+words")) == "q=1;a=1;b=two words;");
+    IS_TRUE(body(post(server, "/args", "application/json", "{\"k\":1}")) == "plain={\"k\":1};");
+
+    std::string form = "--XX\r\nContent-Disposition: form-data; name=\"f1\"\r\n\r\nval1\r\n"
+                       "--XX\r\nContent-Disposition: form-data; name=\"f2\"\r\n\r\nline1\r\nline2\r\n--XX--\r\n";
+    IS_TRUE(body(post(server, "/args?q=2", "multipart/form-data; boundary=XX", form)) == "q=2;f1=val1;f2=line1\nline2;");
+
+    END_IT
+}
+
+int test_parsing_argument_limit() {
+    IT("keeps the first HTTP_MAX_ARGS arguments");
+    WebServer server(80);
+    server.on("/n", [&server]() {
+        server.send(200, "text/plain", String(server.args()) + " " + server.arg("a0") + " " + server.arg("a" + String(HTTP_MAX_ARGS)));
+    });
+    server.begin();
+
+    std::string query;
+    for (int i = 0; i <= HTTP_MAX_ARGS; i++)
+        query += "a" + std::to_string(i) + "=" + std::to_string(i) + "&";
+    IS_TRUE(body(request(server, "GET /n?" + query + " HTTP/1.1\r\n\r\n")) == std::to_string(HTTP_MAX_ARGS) + " 0 ");
+
+    END_IT
+}
+
+int test_parsing_authenticate() {
+    IT("checks basic authentication");
+    WebServer server(80);
+    server.on("/admin", [&server]() {
+        if (!server.authenticate("admin", "secret"))
+            return server.requestAuthentication();
+        server.send(200, "text/plain", "welcome");
+    });
+    server.begin();
+
+    std::string response = request(server, "GET /admin HTTP/1.1\r\n\r\n");
+    IS_TRUE(response.find("HTTP/1.1 401 Unauthorized\r\n") == 0);
+    IS_TRUE(response.find("WWW-Authenticate: Basic realm=\"Login Required\"\r\n") != std::string::npos);
+    IS_TRUE(body(request(server, "GET /admin HTTP/1.1\r\nAuthorization: Basic YWRtaW46c2VjcmV0\r\n\r\n")) == "welcome");
+    IS_TRUE(request(server, "GET /admin HTTP/1.1\r\nAuthorization: Basic YWRtaW46c2VjcmVU\r\n\r\n").find("401") != std::string::npos);
+
+    END_IT
+}
+
+int test_parsing_body_too_large() {
+    IT("answers 413 to a body larger than the arena");
+    WebServer server(80);
+    listArgs(server);
+    server.begin();
+
+    std::string response = post(server, "/args", "application/json", std::string(HTTP_ARENA_SIZE, 'z'));
+    IS_TRUE(response.find("HTTP/1.1 413 Request Entity Too Large\r\n") == 0);
+    IS_TRUE(response.find("Connection: close\r\n") != std::string::npos);
+    // one byte less still fits, with its terminator
+    IS_TRUE(body(post(server, "/args", "application/json", std::string(HTTP_ARENA_SIZE - 1, 'z'))).size() == HTTP_ARENA_SIZE - 1 + 7);
+
+    END_IT
+}
+
+int test_parsing_bad_content_length() {
+    IT("refuses a Content-Length that is not a length the arena can hold");
+    WebServer server(80);
+    bool called = false;
+    server.on("/args", [&server, &called]() {
+        called = true;
+        server.send(200, "text/plain", "ok");
+    });
+    server.begin();
+
+    std::string negative = request(server, "POST /args HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: -1\r\n\r\n" +
+                                   std::string(4096, 'z'));
+    IS_TRUE(negative.find("HTTP/1.1 400 Bad Request\r\n") == 0);
+    IS_TRUE(negative.find("Connection: close\r\n") != std::string::npos);
+    IS_TRUE(request(server, "POST /args HTTP/1.1\r\nContent-Length: 12ab\r\n\r\n").find("HTTP/1.1 400 Bad Request\r\n") == 0);
+    std::string huge = request(server, "POST /args HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: 4294967295\r\n\r\n" +
+                               std::string(4096, 'z'));
+    IS_TRUE(huge.find("HTTP/1.1 413 Request Entity Too Large\r\n") == 0);
+    IS_FALSE(called);
+
+    END_IT
+}
+
+int test_parsing_form_field_too_large() {
+    IT("answers 413 to a form field larger than the arena");
+    WebServer server(80);
+    listArgs(server);
+    server.begin();
+
+    std::string form = "--XX\r\nContent-Disposition: form-data; name=\"f1\"\r\n\r\nval1\r\n"
+                       "--XX\r\nContent-Disposition: form-data; name=\"f2\"\r\n\r\n" + std::string(HTTP_ARENA_SIZE, 'v') + "\r\n--XX--\r\n";
+    std::string response = post(server, "/args", "multipart/form-data; boundary=XX", form);
+    IS_TRUE(response.find("HTTP/1.1 413 Request Entity Too Large\r\n") == 0);
+    IS_TRUE(response.find("f1=val1") == std::string::npos);
+
+    END_IT
+}
+
+int test_parsing_invalid() {
+    IT("answers 400 to a request line that is not HTTP");
+    WebServer server(80);
+    listArgs(server);
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = connectClient("HELLO\r\n\r\nGET /args?a=1 HTTP/1.1\r\n\r\n");
+    server.handleClient();
+    server.handleClient();
+    IS_TRUE(c->output.find("HTTP/1.1 400 Bad Request\r\n") == 0);
+    IS_TRUE(c->output.find("Connection: close\r\n") != std::string::npos);
+    IS_TRUE(c->output.find("a=1") == std::string::npos);
+
+    END_IT
+}
+
+class ParsingServer : public WebServer {
+public:
+    using WebServer::_parseRequest;
+};
+
+int test_parsing_no_allocation() {
+    IT("parses a request without allocating");
+    ParsingServer server;
+    const char* keys[] = { "X-Test" };
+    server.collectHeaders(keys, 1);
+    server.on("/s/{id}", []() { });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> connection = std::make_shared<ShimConnection>();
+    connection->input = "a=1&b=two+words";
+    WiFiClient client(connection);
+    // The path is kept in a String, so it is short enough to stay in the
+    // String's own storage
+    char get[] = "GET /s/42?a=1&b=%41 HTTP/1.1\r\nHost: box\r\nX-Test: v\r\nConnection: keep-alive\r\n\r\n";
+    char post[] = "POST /s/42?q=1 HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 15\r\n\r\n";
+
+    AllocationCounter allocations;
+    IS_TRUE(server._parseRequest(client, get));
+    IS_TRUE(allocations.count() == 0);
+    IS_TRUE(server.arg("b") == "A");
+    IS_TRUE(server.header("X-Test") == "v");
+    IS_TRUE(server.pathArgs() == 1);
+
+    allocations.reset();
+    IS_TRUE(server._parseRequest(client, post));
+    IS_TRUE(allocations.count() == 0);
+    IS_TRUE(server.args() == 3);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Parsing");
+    test_parsing_query();
+    test_parsing_headers();
+    test_parsing_bodies();
+    test_parsing_argument_limit();
+    test_parsing_authenticate();
+    test_parsing_body_too_large();
+    test_parsing_bad_content_length();
+    test_parsing_form_field_too_large();
+    test_parsing_invalid();
+    test_parsing_no_allocation();
+
+    FINISH
+}
@@ -0,0 +1,211 @@
+#include "WebServer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+static std::string body(const std::string& response) {
+    size_t end = response.find("\r\n\r\n");
+    return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+// The body of a chunked response, or "!" if the chunks are malformed or the
+// terminating zero length chunk is missing
+static std::string dechunk(const std::string& response) {
+    std::string content;
+    size_t pos = response.find("\r\n\r\n");
+    if (pos == std::string::npos)
+        return "!";
+    pos += 4;
+    while (pos < response.size()) {
+        size_t lineEnd = response.find("\r\n", pos);
+        if (lineEnd == std::string::npos)
+            return "!";
+        size_t size = strtoul(response.substr(pos, lineEnd - pos).c_str(), NULL, 16);
+        pos = lineEnd + 2;
+        if (size == 0)
+            return response.substr(pos) == "\r\n" ? content : "!";
+        if (response.compare(pos + size, 2, "\r\n") != 0)
+            return "!";
+        content += response.substr(pos, size);
+        pos += size + 2;
+    }
+    return "!";
+}
+
+static std::shared_ptr<ShimConnection> get(WebServer& server, const char* path, const char* version = "1.1") {
+    std::shared_ptr<ShimConnection> c = connectClient(std::string("GET ") + path + " HTTP/" + version + "\r\n\r\n");
+    server.handleClient();
+    return c;
+}
+
+
+int test_response_one_write() {
+    IT("sends the headers and a small body in one write");
+    WebServer server(80);
+    server.on("/redir", [&server]() {
+        server.sendHeader("X-A", "1");
+        server.sendHeader("Location", "/there", true);
+        server.send(302, "text/plain", "moved");
+    });
+    server.on("/pg", [&server]() { server.send_P(200, PSTR("text/html"), PSTR("<p>pg</p>")); });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/redir");
+    IS_TRUE(c->writes == 1);
+    IS_TRUE(c->output == "HTTP/1.1 302 Found\r\nContent-Type: text/plain\r\nLocation: /there\r\nX-A: 1\r\n"
+                         "Content-Length: 5\r\nConnection: keep-alive\r\n\r\nmoved");
+    c = get(server, "/pg");
+    IS_TRUE(c->writes == 1);
+    IS_TRUE(body(c->output) == "<p>pg</p>");
+
+    END_IT
+}
+
+int test_response_large_body() {
+    IT("sends a body larger than the buffer after the headers");
+    WebServer server(80);
+    std::string big(HTTP_RESPONSE_BUFLEN * 2, 'b');
+    server.on("/big", [&server, &big]() { server.send(200, "text/plain", big.c_str()); });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/big");
+    IS_TRUE(c->writes == 2);
+    IS_TRUE(c->output.find("Content-Length: " + std::to_string(big.size()) + "\r\n") != std::string::npos);
+    IS_TRUE(body(c->output) == big);
+
+    END_IT
+}
+
+int test_response_chunked() {
+    IT("gathers chunked content into few writes");
+    WebServer server(80);
+    server.on("/many", [&server]() {
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "text/plain", "start");
+        for (int i = 0; i < 1000; i++)
+            server.sendContent("0123456789");
+        server.sendContent_P(PSTR("tail"));
+        server.sendContent("");
+    });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/many");
+    IS_TRUE(c->output.find("Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n\r\n") != std::string::npos);
+    std::string content = dechunk(c->output);
+    IS_TRUE(content.size() == 5 + 10000 + 4);
+    IS_TRUE(content.compare(0, 5, "start") == 0);
+    IS_TRUE(content.compare(content.size() - 4, 4, "tail") == 0);
+    IS_TRUE(c->writes <= 10005 / (HTTP_RESPONSE_BUFLEN - HTTP_RESPONSE_RESERVE - 2 * HTTP_CHUNK_HEADER_SIZE) + 2);
+
+    END_IT
+}
+
+int test_response_chunked_unterminated() {
+    IT("ends a chunked response the handler leaves open");
+    WebServer server(80);
+    server.on("/open", [&server]() {
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "text/plain", "");
+        server.sendContent("abc");
+        server.sendContent("def");
+    });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/open");
+    IS_TRUE(c->writes == 1);
+    IS_TRUE(c->output.find("keep-alive\r\n\r\n0006\r\nabcdef\r\n0\r\n\r\n") != std::string::npos);
+    IS_TRUE(dechunk(c->output) == "abcdef");
+    IS_TRUE(c->open);
+
+    END_IT
+}
+
+int test_response_flush() {
+    IT("sends buffered chunked content on flushContent()");
+    WebServer server(80);
+    int writes = -1;
+    std::shared_ptr<ShimConnection> c;
+    server.on("/flush", [&server, &writes, &c]() {
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "text/plain", "");
+        server.sendContent("early");
+        server.flushContent();
+        writes = c->writes;
+        server.sendContent("late");
+    });
+    server.begin();
+
+    c = connectClient("GET /flush HTTP/1.1\r\n\r\n");
+    server.handleClient();
+    IS_TRUE(writes == 1);
+    IS_TRUE(c->writes == 2);
+    IS_TRUE(dechunk(c->output) == "earlylate");
+
+    END_IT
+}
+
+int test_response_unknown_length_http10() {
+    IT("closes an HTTP/1.0 response of unknown length instead of chunking it");
+    WebServer server(80);
+    server.on("/stream", [&server]() {
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "text/plain", "");
+        server.sendContent("raw");
+    });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/stream", "1.0");
+    IS_TRUE(c->output.find("Transfer-Encoding") == std::string::npos);
+    IS_TRUE(c->output.find("Connection: close\r\n") != std::string::npos);
+    IS_TRUE(body(c->output) == "raw");
+
+    END_IT
+}
+
+int test_response_header_overflow() {
+    IT("keeps the framing headers when sendHeader() overfills the buffer");
+    WebServer server(80);
+    server.on("/long", [&server]() {
+        server.sendHeader("X-A", std::string(1340, 'a').c_str());
+        server.send(200, "text/plain", "c=zz");
+    });
+    server.on("/many", [&server]() {
+        for (int i = 0; i < 100; i++)
+            server.sendHeader("X-Many", "0123456789012345", i % 2);
+        server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server.send(200, "text/plain", "");
+        server.sendContent("chunk");
+    });
+    server.begin();
+
+    std::shared_ptr<ShimConnection> c = get(server, "/long");
+    IS_TRUE(c->output.find("HTTP/1.1 200 OK\r\n") == 0);
+    IS_TRUE(c->output.find("X-A") == std::string::npos);
+    IS_TRUE(c->output.find("Content-Length: 4\r\nConnection: keep-alive\r\n\r\nc=zz") != std::string::npos);
+    c->output.clear();
+    c->input += "GET /long HTTP/1.1\r\n\r\n";
+    server.handleClient();
+    IS_TRUE(body(c->output) == "c=zz");
+
+    c = get(server, "/many");
+    IS_TRUE(c->output.find("HTTP/1.1 200 OK\r\n") == 0);
+    IS_TRUE(c->output.find("Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n\r\n") != std::string::npos);
+    IS_TRUE(dechunk(c->output) == "chunk");
+    IS_TRUE(body(c->output) == "0005\r\nchunk\r\n0\r\n\r\n");
+    IS_TRUE(c->output.find("X-Many") != std::string::npos);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Responses");
+    test_response_one_write();
+    test_response_large_body();
+    test_response_chunked();
+    test_response_chunked_unterminated();
+    test_response_flush();
+    test_response_unknown_length_http10();
+    test_response_header_overflow();
+
+    FINISH
+}
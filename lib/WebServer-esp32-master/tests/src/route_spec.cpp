@@ -0,0 +1,159 @@
+#include "WebServer.h"
+#include "FS.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+static std::string body(const std::string& response) {
+    size_t end = response.find("\r\n\r\n");
+    return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+static std::string get(WebServer& server, const char* method, const char* path) {
+    std::string request = std::string(method) + " " + path + " HTTP/1.1\r\nContent-Length: 0\r\n\r\n";
+    std::shared_ptr<ShimConnection> c = connectClient(request);
+    server.handleClient();
+    return c->output;
+}
+
+static void text(WebServer& server, const String& content) {
+    server.send(200, "text/plain", content);
+}
+
+
+int test_route_exact() {
+    IT("dispatches exact paths by method");
+    WebServer server(80);
+    server.on("/", [&server]() { text(server, "root"); });
+    server.on("/a/b", HTTP_GET, [&server]() { text(server, "get ab"); });
+    server.on("/a/b", HTTP_POST, [&server]() { text(server, "post ab"); });
+    server.begin();
+
+    IS_TRUE(body(get(server, "GET", "/")) == "root");
+    IS_TRUE(body(get(server, "GET", "/a/b")) == "get ab");
+    IS_TRUE(body(get(server, "POST", "/a/b")) == "post ab");
+    IS_TRUE(get(server, "DELETE", "/a/b").find("HTTP/1.1 404 Not Found") == 0);
+    IS_TRUE(get(server, "GET", "/a").find("HTTP/1.1 404 Not Found") == 0);
+    IS_TRUE(get(server, "GET", "/a/b/c").find("HTTP/1.1 404 Not Found") == 0);
+
+    END_IT
+}
+
+int test_route_parameter() {
+    IT("captures a {parameter} segment");
+    WebServer server(80);
+    server.on("/sensor/{id}", HTTP_GET, [&server]() { text(server, server.pathArg(0) + "/" + String(server.pathArgs())); });
+    server.begin();
+
+    IS_TRUE(body(get(server, "GET", "/sensor/42")) == "42/1");
+    IS_TRUE(body(get(server, "GET", "/sensor/42?x=1")) == "42/1");
+    IS_TRUE(get(server, "GET", "/sensor/").find("HTTP/1.1 404 Not Found") == 0);
+    IS_TRUE(get(server, "GET", "/sensor/1/2").find("HTTP/1.1 404 Not Found") == 0);
+
+    END_IT
+}
+
+int test_route_two_parameters() {
+    IT("captures two parameters around a literal segment");
+    WebServer server(80);
+    server.on("/user/{id}/post/{post}", [&server]() {
+        text(server, server.pathArg(0) + "," + server.pathArg(1) + "," + server.pathArg(2));
+    });
+    server.begin();
+
+    IS_TRUE(body(get(server, "GET", "/user/7/post/abc")) == "7,abc,");
+    IS_TRUE(get(server, "GET", "/user/7/comment/abc").find("HTTP/1.1 404 Not Found") == 0);
+
+    END_IT
+}
+
+int test_route_literal_first() {
+    IT("prefers a literal segment to a parameter");
+    WebServer server(80);
+    server.on("/sensor/{id}", [&server]() { text(server, "id " + server.pathArg(0)); });
+    server.on("/sensor/all", [&server]() { text(server, "all " + String(server.pathArgs())); });
+    server.begin();
+
+    IS_TRUE(body(get(server, "GET", "/sensor/all")) == "all 0");
+    IS_TRUE(body(get(server, "GET", "/sensor/al")) == "id al");
+
+    END_IT
+}
+
+int test_route_parameter_limit() {
+    IT("does not match a route with more than HTTP_MAX_PATH_ARGS parameters");
+    WebServer server(80);
+    std::string pattern;
+    std::string path;
+    for (int i = 0; i <= HTTP_MAX_PATH_ARGS; i++) {
+        pattern += "/{p}";
+        path += "/" + std::to_string(i);
+    }
+    bool called = false;
+    server.on(pattern.c_str(), [&called]() { called = true; });
+    server.begin();
+
+    IS_TRUE(get(server, "GET", path.c_str()).find("HTTP/1.1 404 Not Found") == 0);
+    IS_FALSE(called);
+
+    END_IT
+}
+
+int test_route_static() {
+    IT("serves files below a static prefix");
+    FS fs;
+    fs.addFile("/www/index.htm", "<p>index</p>");
+    fs.addFile("/www/app.js", "var a;");
+    fs.addFile("/logo.png", "PNG");
+    WebServer server(80);
+    server.serveStatic("/static/", fs, "/www/");
+    server.serveStatic("/logo", fs, "/logo.png");
+    server.begin();
+
+    std::string response = get(server, "GET", "/static/app.js");
+    IS_TRUE(response.find("Content-Type: application/javascript\r\n") != std::string::npos);
+    IS_TRUE(body(response) == "var a;");
+    IS_TRUE(body(get(server, "GET", "/static/")) == "<p>index</p>");
+    IS_TRUE(body(get(server, "GET", "/logo")) == "PNG");
+    IS_TRUE(get(server, "GET", "/logo/x").find("HTTP/1.1 404 Not Found") == 0);
+    IS_TRUE(get(server, "GET", "/static/none.js").find("HTTP/1.1 404 Not Found") == 0);
+
+    END_IT
+}
+
+class PrefixHandler : public RequestHandler {
+public:
+    bool canHandle(HTTPMethod, String uri) override { return uri.startsWith("/legacy"); }
+    bool handle(WebServer& server, HTTPMethod, String) override {
+        server.send(200, "text/plain", "legacy");
+        return true;
+    }
+};
+
+int test_route_added_handler() {
+    IT("falls back to handlers added with addHandler()");
+    WebServer server(80);
+    server.on("/legacy/new", [&server]() { text(server, "new"); });
+    server.addHandler(new PrefixHandler());
+    server.onNotFound([&server]() { server.send(404, "text/plain", "nope " + server.uri()); });
+    server.begin();
+
+    IS_TRUE(body(get(server, "GET", "/legacy/new")) == "new");
+    IS_TRUE(body(get(server, "GET", "/legacy/old")) == "legacy");
+    IS_TRUE(body(get(server, "GET", "/other")) == "nope /other");
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Routes");
+    test_route_exact();
+    test_route_parameter();
+    test_route_two_parameters();
+    test_route_literal_first();
+    test_route_parameter_limit();
+    test_route_static();
+    test_route_added_handler();
+
+    FINISH
+}
@@ -0,0 +1,297 @@
+/*
+ MQTTCodec.h - Transport independent MQTT 3.1/3.1.1 packet encoding and
+  decoding. Every function works on a caller-provided buffer and does no I/O
+  or allocation, so it can be shared by the client, test brokers and gateways.
+*/
+
+#ifndef MQTTCodec_h
+#define MQTTCodec_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define MQTT_VERSION_3_1      3
+#define MQTT_VERSION_3_1_1    4
+
+// MQTT_VERSION : Pick the version
+//#define MQTT_VERSION MQTT_VERSION_3_1
+#ifndef MQTT_VERSION
+#define MQTT_VERSION MQTT_VERSION_3_1_1
+#endif
+
+#define MQTTCONNECT     1 << 4  // Client request to connect to Server
+#define MQTTCONNACK     2 << 4  // Connect Acknowledgment
+#define MQTTPUBLISH     3 << 4  // Publish message
+#define MQTTPUBACK      4 << 4  // Publish Acknowledgment
+#define MQTTPUBREC      5 << 4  // Publish Received (assured delivery part 1)
+#define MQTTPUBREL      6 << 4  // Publish Release (assured delivery part 2)
+#define MQTTPUBCOMP     7 << 4  // Publish Complete (assured delivery part 3)
+#define MQTTSUBSCRIBE   8 << 4  // Client Subscribe request
+#define MQTTSUBACK      9 << 4  // Subscribe Acknowledgment
+#define MQTTUNSUBSCRIBE 10 << 4 // Client Unsubscribe request
+#define MQTTUNSUBACK    11 << 4 // Unsubscribe Acknowledgment
+#define MQTTPINGREQ     12 << 4 // PING Request
+#define MQTTPINGRESP    13 << 4 // PING Response
+#define MQTTDISCONNECT  14 << 4 // Client is Disconnecting
+#define MQTTReserved    15 << 4 // Reserved
+
+#define MQTTQOS0        (0 << 1)
+#define MQTTQOS1        (1 << 1)
+#define MQTTQOS2        (2 << 1)
+
+// Maximum size of fixed header and variable length size header
+#define MQTT_MAX_HEADER_SIZE 5
+
+// Largest value the remaining length field can hold
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
+// A decoded PUBLISH. The topic is not NUL terminated; offsets are from the
+// start of the packet.
+struct MQTTPublishView {
+   uint8_t qos;
+   bool retained;
+   bool dup;
+   uint16_t topicOffset;
+   uint16_t topicLength;
+   uint16_t msgId;          // 0 at QoS 0
+   uint32_t payloadOffset;
+   uint32_t payloadLength;
+};
+
+class MQTTCodec {
+public:
+   // Bytes the remaining length field takes for `length` (1-4)
+   static constexpr uint8_t lengthSize(uint32_t length) {
+      return 1 + (length > 127) + (length > 16383) + (length > 2097151);
+   }
+
+   // Total size of a packet with `length` bytes after the fixed header
+   static constexpr uint32_t packetSize(uint32_t length) {
+      return 1 + lengthSize(length) + length;
+   }
+
+   // Writes the remaining length field and returns its size
+   static uint8_t encodeLength(uint8_t* out, uint32_t length) {
+      uint8_t n = lengthSize(length);
+      for (uint8_t i = 0; i < n-1; i++) {
+         out[i] = (uint8_t)length | 0x80;
+         length >>= 7;
+      }
+      out[n-1] = (uint8_t)length;
+      return n;
+   }
+
+   // Reads a remaining length field from the first `size` bytes of `in`.
+   // Returns the bytes it took, 0 if more are needed, or -1 if it is invalid.
+   static int8_t decodeLength(const uint8_t* in, uint32_t size, uint32_t* length) {
+      uint32_t value = 0;
+      for (uint8_t i = 0; i < 4; i++) {
+         if (i >= size) {
+            return 0;
+         }
+         value |= (uint32_t)(in[i] & 0x7F) << (7*i);
+         if ((in[i] & 0x80) == 0) {
+            *length = value;
+            return i+1;
+         }
+      }
+      return -1;
+   }
+
+   // Writes the fixed header and returns its size, or 0 if the whole packet
+   // would not fit in `size` bytes
+   static uint8_t encodeHeader(uint8_t* out, uint32_t size, uint8_t header, uint32_t length) {
+      if (length > MQTT_MAX_REMAINING_LENGTH || packetSize(length) > size) {
+         return 0;
+      }
+      out[0] = header;
+      return 1 + encodeLength(out+1, length);
+   }
+
+   // The packet encoders below write a complete packet to out and return its
+   // length, or 0 if it does not fit in `size` bytes.
+
+   static uint32_t encodeConnect(uint8_t* out, uint32_t size, const char* id, const char* user, const char* pass,
+                                 const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage,
+                                 bool cleanSession, uint16_t keepAlive) {
+#if MQTT_VERSION == MQTT_VERSION_3_1
+      static const uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
+#elif MQTT_VERSION == MQTT_VERSION_3_1_1
+      static const uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
+#endif
+      uint32_t length = sizeof(d) + 1 + 2 + stringSize(id);
+      uint8_t flags = cleanSession ? 0x02 : 0x00;
+      if (willTopic) {
+         flags |= 0x04|(willQos<<3)|(willRetain<<5);
+         length += stringSize(willTopic) + stringSize(willMessage);
+      }
+      if (user != NULL) {
+         flags |= 0x80;
+         length += stringSize(user);
+         if (pass != NULL) {
+            flags |= 0x40;
+            length += stringSize(pass);
+         }
+      }
+      uint32_t pos = encodeHeader(out, size, MQTTCONNECT, length);
+      if (pos == 0) {
+         return 0;
+      }
+      memcpy(out+pos, d, sizeof(d));
+      pos += sizeof(d);
+      out[pos++] = flags;
+      out[pos++] = keepAlive >> 8;
+      out[pos++] = keepAlive & 0xFF;
+      pos = encodeString(out, pos, id);
+      if (willTopic) {
+         pos = encodeString(out, pos, willTopic);
+         pos = encodeString(out, pos, willMessage);
+      }
+      if (user != NULL) {
+         pos = encodeString(out, pos, user);
+         if (pass != NULL) {
+            pos = encodeString(out, pos, pass);
+         }
+      }
+      return pos;
+   }
+
+   // Encodes a QoS 0 PUBLISH. With a NULL payload only the header and topic
+   // are written, for a payload the caller sends separately.
+   static uint32_t encodePublish(uint8_t* out, uint32_t size, const char* topic, const uint8_t* payload,
+                                 uint32_t plength, bool retained) {
+      uint32_t tlen = strlen(topic);
+      if (tlen > 0xFFFF) {
+         return 0;
+      }
+      uint32_t length = 2 + tlen + plength;
+      uint32_t used = payload ? length : 2 + tlen;
+      uint8_t hlen = encodeHeader(out, size + (payload ? 0 : plength), MQTTPUBLISH | (retained ? 1 : 0), length);
+      if (hlen == 0 || hlen + used > size) {
+         return 0;
+      }
+      uint32_t pos = hlen;
+      out[pos++] = tlen >> 8;
+      out[pos++] = tlen & 0xFF;
+      memcpy(out+pos, topic, tlen);
+      pos += tlen;
+      if (payload) {
+         memcpy(out+pos, payload, plength);
+         pos += plength;
+      }
+      return pos;
+   }
+
+   // Encodes a SUBSCRIBE or UNSUBSCRIBE for a single topic filter
+   static uint32_t encodeSubscribe(uint8_t* out, uint32_t size, uint16_t msgId, const char* topic, uint8_t qos) {
+      return encodeTopicRequest(out, size, MQTTSUBSCRIBE|MQTTQOS1, msgId, topic, qos);
+   }
+   static uint32_t encodeUnsubscribe(uint8_t* out, uint32_t size, uint16_t msgId, const char* topic) {
+      return encodeTopicRequest(out, size, MQTTUNSUBSCRIBE|MQTTQOS1, msgId, topic, 0xFF);
+   }
+
+   // Encodes a packet that carries only a packet id, e.g. PUBACK
+   static uint32_t encodeAck(uint8_t* out, uint32_t size, uint8_t header, uint16_t msgId) {
+      if (size < 4) {
+         return 0;
+      }
+      out[0] = header;
+      out[1] = 2;
+      out[2] = msgId >> 8;
+      out[3] = msgId & 0xFF;
+      return 4;
+   }
+
+   // Encodes a packet with no body: PINGREQ, PINGRESP or DISCONNECT
+   static uint32_t encodeEmpty(uint8_t* out, uint32_t size, uint8_t header) {
+      if (size < 2) {
+         return 0;
+      }
+      out[0] = header;
+      out[1] = 0;
+      return 2;
+   }
+
+   // The decoders below take a complete packet of `length` bytes whose
+   // remaining length field is `llen` bytes long, and return false if it is
+   // malformed.
+
+   static bool decodePublish(const uint8_t* in, uint32_t length, uint8_t llen, MQTTPublishView* publish) {
+      uint32_t pos = 1 + llen;
+      if (pos + 2 > length) {
+         return false;
+      }
+      publish->qos = (in[0] & 0x06) >> 1;
+      publish->retained = in[0] & 0x01;
+      publish->dup = in[0] & 0x08;
+      publish->topicLength = (in[pos] << 8) + in[pos+1];
+      publish->topicOffset = pos + 2;
+      pos += 2 + publish->topicLength;
+      publish->msgId = 0;
+      if (publish->qos > 0) {
+         if (pos + 2 > length) {
+            return false;
+         }
+         publish->msgId = (in[pos] << 8) + in[pos+1];
+         pos += 2;
+      }
+      if (pos > length) {
+         return false;
+      }
+      publish->payloadOffset = pos;
+      publish->payloadLength = length - pos;
+      return true;
+   }
+
+   // PUBACK, SUBACK, UNSUBACK and the like: reads the packet id
+   static bool decodeAck(const uint8_t* in, uint32_t length, uint8_t llen, uint16_t* msgId) {
+      if (length < 3u + llen) {
+         return false;
+      }
+      *msgId = (in[1+llen] << 8) + in[2+llen];
+      return true;
+   }
+
+   static bool decodeConnack(const uint8_t* in, uint32_t length, bool* sessionPresent, uint8_t* returnCode) {
+      if (length != 4 || (in[0] & 0xF0) != MQTTCONNACK) {
+         return false;
+      }
+      *sessionPresent = in[2] & 0x01;
+      *returnCode = in[3];
+      return true;
+   }
+
+private:
+   static uint32_t stringSize(const char* string) {
+      return 2 + strlen(string);
+   }
+
+   static uint32_t encodeString(uint8_t* out, uint32_t pos, const char* string) {
+      uint16_t len = strlen(string);
+      out[pos++] = len >> 8;
+      out[pos++] = len & 0xFF;
+      memcpy(out+pos, string, len);
+      return pos + len;
+   }
+
+   // qos 0xFF leaves out the options byte, as UNSUBSCRIBE has none
+   static uint32_t encodeTopicRequest(uint8_t* out, uint32_t size, uint8_t header, uint16_t msgId, const char* topic, uint8_t qos) {
+      uint32_t tlen = strlen(topic);
+      if (tlen > 0xFFFF) {
+         return 0;
+      }
+      uint32_t pos = encodeHeader(out, size, header, 2 + 2 + tlen + (qos != 0xFF ? 1 : 0));
+      if (pos == 0) {
+         return 0;
+      }
+      out[pos++] = msgId >> 8;
+      out[pos++] = msgId & 0xFF;
+      pos = encodeString(out, pos, topic);
+      if (qos != 0xFF) {
+         out[pos++] = qos;
+      }
+      return pos;
+   }
+};
+
+#endif
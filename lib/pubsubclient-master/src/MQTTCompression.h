@@ -0,0 +1,146 @@
+/*
+ MQTTCompression.h - A small LZ77 payload compressor for repetitive text such
+  as CSV and JSON. It needs no memory beyond the input and output buffers: the
+  window is the part of the input already compressed, and the output already
+  decompressed.
+
+  A compressed payload is framed as:
+    0x00 'Z' (marker), original length (2 bytes, big-endian), then groups of a
+    flag byte followed by up to 8 items. Flag bit n (from the least
+    significant) is 0 for a literal byte and 1 for a 2 byte match: 12 bits of
+    distance - 1 then 4 bits of length - 3.
+*/
+
+#ifndef MQTTCompression_h
+#define MQTTCompression_h
+
+#include <stdint.h>
+
+// MQTT_COMPRESS_WINDOW : How far back, in bytes, the compressor looks for a
+//  match (at most 4096). Larger finds more matches but takes longer.
+#ifndef MQTT_COMPRESS_WINDOW
+#define MQTT_COMPRESS_WINDOW 256
+#endif
+
+#define MQTT_COMPRESS_HEADER_SIZE 4
+#define MQTT_COMPRESS_MIN_MATCH 3
+#define MQTT_COMPRESS_MAX_MATCH 18
+
+class MQTTCompression {
+   static_assert(MQTT_COMPRESS_WINDOW >= 1 && MQTT_COMPRESS_WINDOW <= 4096, "MQTT_COMPRESS_WINDOW must be 1-4096");
+public:
+   // Largest output compress() can produce for `length` bytes of input
+   static constexpr uint32_t maxSize(uint32_t length) {
+      return MQTT_COMPRESS_HEADER_SIZE + length + (length+7)/8;
+   }
+
+   // True if the payload starts with the frame marker
+   static bool isFramed(const uint8_t* in, uint32_t length) {
+      return length >= MQTT_COMPRESS_HEADER_SIZE && in[0] == 0x00 && in[1] == 'Z';
+   }
+
+   // Compresses length bytes into out. Returns the compressed length, or 0 if
+   // it does not fit in `size` bytes or the input is over 65535 bytes.
+   static uint32_t compress(const uint8_t* in, uint32_t length, uint8_t* out, uint32_t size) {
+      if (length > 0xFFFF || size < MQTT_COMPRESS_HEADER_SIZE) {
+         return 0;
+      }
+      out[0] = 0x00;
+      out[1] = 'Z';
+      out[2] = length >> 8;
+      out[3] = length & 0xFF;
+      uint32_t pos = MQTT_COMPRESS_HEADER_SIZE;
+      uint32_t flags = 0;
+      uint8_t items = 0;
+      uint32_t i = 0;
+      while (i < length) {
+         if (items == 0) {
+            if (pos >= size) {
+               return 0;
+            }
+            flags = pos++;
+            out[flags] = 0;
+         }
+         uint32_t bestLength = 0;
+         uint32_t bestDistance = 0;
+         uint32_t start = i > MQTT_COMPRESS_WINDOW ? i - MQTT_COMPRESS_WINDOW : 0;
+         uint32_t limit = length - i < MQTT_COMPRESS_MAX_MATCH ? length - i : MQTT_COMPRESS_MAX_MATCH;
+         // Nearest first, so equal matches take the shortest distance
+         for (uint32_t j = i; j-- > start && bestLength < limit; ) {
+            uint32_t l = 0;
+            while (l < limit && in[j+l] == in[i+l]) {
+               l++;
+            }
+            if (l > bestLength) {
+               bestLength = l;
+               bestDistance = i - j;
+            }
+         }
+         if (bestLength >= MQTT_COMPRESS_MIN_MATCH) {
+            if (pos + 2 > size) {
+               return 0;
+            }
+            out[flags] |= 1 << items;
+            out[pos++] = (bestDistance-1) >> 4;
+            out[pos++] = ((bestDistance-1) << 4) | (bestLength - MQTT_COMPRESS_MIN_MATCH);
+            i += bestLength;
+         } else {
+            if (pos >= size) {
+               return 0;
+            }
+            out[pos++] = in[i++];
+         }
+         items = (items+1) & 7;
+      }
+      return pos;
+   }
+
+   // Decompresses a framed payload into out. Returns the original length, or
+   // -1 if it is malformed or would not fit in `size` bytes.
+   static int32_t decompress(const uint8_t* in, uint32_t length, uint8_t* out, uint32_t size) {
+      if (!isFramed(in, length)) {
+         return -1;
+      }
+      uint32_t total = (in[2] << 8) + in[3];
+      if (total > size) {
+         return -1;
+      }
+      uint32_t pos = MQTT_COMPRESS_HEADER_SIZE;
+      uint32_t o = 0;
+      uint8_t flags = 0;
+      uint8_t items = 0;
+      while (o < total) {
+         if (items == 0) {
+            if (pos >= length) {
+               return -1;
+            }
+            flags = in[pos++];
+         }
+         if (flags & (1 << items)) {
+            if (pos + 2 > length) {
+               return -1;
+            }
+            uint32_t distance = ((in[pos] << 4) | (in[pos+1] >> 4)) + 1;
+            uint32_t l = (in[pos+1] & 0x0F) + MQTT_COMPRESS_MIN_MATCH;
+            pos += 2;
+            if (distance > o || o + l > total) {
+               return -1;
+            }
+            // May overlap what it is writing, so byte by byte
+            for (uint32_t k = 0; k < l; k++, o++) {
+               out[o] = out[o-distance];
+            }
+         } else {
+            if (pos >= length) {
+               return -1;
+            }
+            out[o++] = in[pos++];
+         }
+         items = (items+1) & 7;
+      }
+      // Trailing bytes mean the length field is wrong
+      return pos == length ? (int32_t)total : -1;
+   }
+};
+
+#endif
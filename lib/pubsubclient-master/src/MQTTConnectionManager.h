@@ -0,0 +1,64 @@
+/*
+ MQTTConnectionManager.h - Runs several PubSubClients from one loop(), with
+  their packet buffers lent from a shared MQTTBufferPool.
+*/
+
+#ifndef MQTTConnectionManager_h
+#define MQTTConnectionManager_h
+
+#include "PubSubClient.h"
+
+// MQTT_MAX_CONNECTIONS : Number of clients a connection manager can hold
+#ifndef MQTT_MAX_CONNECTIONS
+#define MQTT_MAX_CONNECTIONS 4
+#endif
+
+class MQTTConnectionManager {
+private:
+   MQTTBufferPool* pool;
+   PubSubClientBase* clients[MQTT_MAX_CONNECTIONS];
+   uint8_t count;
+   uint8_t next;
+public:
+   MQTTConnectionManager(MQTTBufferPool& pool) : pool(&pool), count(0), next(0) {
+   }
+
+   // Hand a client to the manager. It is switched to the shared pool; it is
+   // still connected, subscribed and published to through its own methods.
+   // Returns false when the manager is full.
+   boolean add(PubSubClientBase& client) {
+      if (this->count == MQTT_MAX_CONNECTIONS) {
+         return false;
+      }
+      client.setBufferPool(this->pool);
+      this->clients[this->count++] = &client;
+      return true;
+   }
+
+   uint8_t size() {
+      return this->count;
+   }
+
+   PubSubClientBase& get(uint8_t index) {
+      return *this->clients[index];
+   }
+
+   // Service every client once. Each loop() handles at most one inbound
+   // packet, and the first client serviced moves along each call, so a busy
+   // connection cannot starve the others of time or of pool buffers.
+   // Returns the number of clients connected.
+   uint8_t loop() {
+      uint8_t connected = 0;
+      for (uint8_t i = 0; i < this->count; i++) {
+         if (this->clients[(this->next + i) % this->count]->loop()) {
+            connected++;
+         }
+      }
+      if (this->count > 0) {
+         this->next = (this->next + 1) % this->count;
+      }
+      return connected;
+   }
+};
+
+#endif
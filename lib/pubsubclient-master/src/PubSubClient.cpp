@@ -6,192 +6,301 @@
 
 #include "PubSubClient.h"
 #include "Arduino.h"
-
-PubSubClient::PubSubClient() {
-    this->_state = MQTT_DISCONNECTED;
-    this->_client = NULL;
-    this->stream = NULL;
-    setCallback(NULL);
+#include <stdio.h>
+
+// Holds a pool buffer for the client while it is in scope. Nested leases on
+// one client share the buffer; without a pool the client's own is used.
+class MQTTBufferLease {
+private:
+    PubSubClientBase* client;
+    boolean held;
+public:
+    MQTTBufferLease(PubSubClientBase* client) : client(client) {
+        held = client->borrowBuffer();
+    }
+    ~MQTTBufferLease() {
+        if (held) {
+            client->returnBuffer();
+        }
+    }
+    operator bool() const {
+        return held;
+    }
+};
+
+MQTTBufferPool::MQTTBufferPool(uint8_t* storage, uint16_t bufferSize, uint8_t count) {
+    this->storage = storage;
+    this->bufferSize = bufferSize;
+    this->count = count;
+    this->inUse = 0;
+    this->highWater = 0;
+    this->misses = 0;
 }
 
-PubSubClient::PubSubClient(Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setClient(client);
-    this->stream = NULL;
+uint8_t* MQTTBufferPool::acquire() {
+    for (uint8_t i = 0; i < this->count; i++) {
+        if ((this->inUse & (1UL << i)) == 0) {
+            this->inUse |= 1UL << i;
+            uint8_t used = this->count - available();
+            if (used > this->highWater) {
+                this->highWater = used;
+            }
+            return this->storage + (uint32_t)i*this->bufferSize;
+        }
+    }
+    this->misses++;
+    return NULL;
 }
 
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr, port);
-    setClient(client);
-    this->stream = NULL;
-}
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr,port);
-    setClient(client);
-    setStream(stream);
-}
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr, port);
-    setCallback(callback);
-    setClient(client);
-    this->stream = NULL;
-}
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
+void MQTTBufferPool::release(uint8_t* buffer) {
+    uint8_t i = (buffer - this->storage) / this->bufferSize;
+    this->inUse &= ~(1UL << i);
 }
 
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip, port);
-    setClient(client);
-    this->stream = NULL;
+uint16_t MQTTBufferPool::getBufferSize() {
+    return this->bufferSize;
 }
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip,port);
-    setClient(client);
-    setStream(stream);
-}
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip, port);
-    setCallback(callback);
-    setClient(client);
-    this->stream = NULL;
-}
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
+
+uint8_t MQTTBufferPool::available() {
+    uint8_t free = 0;
+    for (uint8_t i = 0; i < this->count; i++) {
+        if ((this->inUse & (1UL << i)) == 0) {
+            free++;
+        }
+    }
+    return free;
 }
 
-PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setClient(client);
-    this->stream = NULL;
+uint8_t MQTTBufferPool::getHighWater() {
+    return this->highWater;
 }
-PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setClient(client);
-    setStream(stream);
+
+uint32_t MQTTBufferPool::getMisses() {
+    return this->misses;
 }
-PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
+
+PubSubClientBase::PubSubClientBase(uint8_t* buffer, uint16_t bufferSize, MQTTInflight* inflight, MQTTInflight* received, uint8_t maxInflight) {
     this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setCallback(callback);
-    setClient(client);
+    this->_client = NULL;
     this->stream = NULL;
-}
-PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
+    this->domain = NULL;
+    this->port = 0;
+    this->endpoints = NULL;
+    this->endpointCount = 0;
+    this->currentEndpoint = 0;
+    this->failbackInterval = 0;
+    this->probeClient = NULL;
+    this->lastProbe = 0;
+    this->failingBack = false;
+    this->latencyProbe = NULL;
+    this->compression = false;
+    this->decompressBuffer = NULL;
+    this->decompressSize = 0;
+    this->sessionStore = NULL;
+    this->session = NULL;
+    this->sessionSize = 0;
+    this->sessionUsed = 0;
+    this->sessionDirty = false;
+    this->_sessionPresent = false;
+    this->lastCheckpoint = 0;
+    this->buffer = buffer;
+    this->bufferSize = bufferSize;
+    this->ownBuffer = buffer;
+    this->ownBufferSize = bufferSize;
+    this->pool = NULL;
+    this->leaseDepth = 0;
+    this->inflight = inflight;
+    this->received = received;
+    this->maxInflight = maxInflight;
+    memset(this->inflight,0,sizeof(MQTTInflight)*maxInflight);
+    memset(this->received,0,sizeof(MQTTInflight)*maxInflight);
+    this->dedupWindow = MQTT_DEDUP_WINDOW;
+    memset(&this->publishLimit,0,sizeof(MQTTTokenBucket));
+    memset(&this->byteLimit,0,sizeof(MQTTTokenBucket));
+    memset(&this->limitStats,0,sizeof(MQTTRateLimitStats));
+    this->queue = NULL;
+    this->queueSize = 0;
+    this->queueHead = 0;
+    this->queueUsed = 0;
+    this->recording = NULL;
+    this->recordingSize = 0;
+    this->recordingHead = 0;
+    this->recordingUsed = 0;
+    this->recordingDropped = 0;
+    this->nextMsgId = 0;
+    this->keepAlive = MQTT_KEEPALIVE;
+    this->socketTimeout = MQTT_SOCKET_TIMEOUT;
+    this->pingOutstanding = false;
+    this->pingSent = 0;
+    resetMetrics();
 }
 
-boolean PubSubClient::connect(const char *id) {
+boolean PubSubClientBase::connect(const char *id) {
     return connect(id,NULL,NULL,0,0,0,0,1);
 }
 
-boolean PubSubClient::connect(const char *id, const char *user, const char *pass) {
+boolean PubSubClientBase::connect(const char *id, const char *user, const char *pass) {
     return connect(id,user,pass,0,0,0,0,1);
 }
 
-boolean PubSubClient::connect(const char *id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+boolean PubSubClientBase::connect(const char *id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
     return connect(id,NULL,NULL,willTopic,willQos,willRetain,willMessage,1);
 }
 
-boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+boolean PubSubClientBase::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
     return connect(id,user,pass,willTopic,willQos,willRetain,willMessage,1);
 }
 
-boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+boolean PubSubClientBase::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        return false;
+    }
+    if (this->endpoints == NULL || connected()) {
+        return connectServer(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession);
+    }
+    // Try each endpoint once, lowest score first. The score is the smoothed
+    // connect latency plus a penalty for position and recent failures;
+    // endpoints still backing off are only tried when nothing else is left.
+    // After a failback the primary goes first whatever its score, or the
+    // endpoint we just left would win again.
+    boolean primaryFirst = this->failingBack;
+    this->failingBack = false;
+    uint32_t tried = 0;
+    for (uint8_t attempt = 0;attempt<this->endpointCount;attempt++) {
+        unsigned long now = millis();
+        uint8_t best = 0;
+        uint32_t bestScore = 0xFFFFFFFFUL;
+        for (uint8_t i = 0;i<this->endpointCount;i++) {
+            if (tried & (1UL<<i)) {
+                continue;
+            }
+            MQTTEndpoint* e = &this->endpoints[i];
+            uint32_t score = e->latency + (uint32_t)(i+e->failures)*MQTT_FAILOVER_PREFERENCE;
+            if (inBackoff(e,now)) {
+                score += 0x40000000UL;
+            }
+            if (score < bestScore) {
+                best = i;
+                bestScore = score;
+            }
+        }
+        if (primaryFirst && attempt == 0) {
+            best = 0;
+        }
+        tried |= (1UL<<best);
+
+        MQTTEndpoint* e = &this->endpoints[best];
+        this->currentEndpoint = best;
+        this->domain = e->domain;
+        this->ip = e->ip;
+        this->port = e->port;
+        unsigned long start = millis();
+        if (connectServer(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+            uint16_t sample = millis()-start;
+            e->latency = (e->connects == 0)?sample:(uint16_t)(((uint32_t)e->latency*3+sample)/4);
+            e->connects++;
+            e->failures = 0;
+            this->lastProbe = millis();
+            return true;
+        }
+        if (_state > 0 && _state != MQTT_CONNECT_UNAVAILABLE) {
+            // The broker answered and refused us; another one will not do better
+            e->failures = 0;
+            return false;
+        }
+        if (e->failures < 0xFFFF) {
+            e->failures++;
+        }
+        e->lastFailure = millis();
+    }
+    return false;
+}
+
+boolean PubSubClientBase::inBackoff(MQTTEndpoint* endpoint, unsigned long now) {
+    if (endpoint->failures == 0) {
+        return false;
+    }
+    uint8_t shift = (endpoint->failures > 7)?6:endpoint->failures-1;
+    unsigned long backoff = (MQTT_FAILOVER_BACKOFF*1000UL) << shift;
+    if (backoff > 300000UL) {
+        backoff = 300000UL;
+    }
+    return now - endpoint->lastFailure < backoff;
+}
+
+// Checks whether the first endpoint is usable again. Returns true when the
+// current session should be dropped in favour of it.
+boolean PubSubClientBase::probePrimary(unsigned long now) {
+    MQTTEndpoint* primary = &this->endpoints[0];
+    if (this->probeClient == NULL) {
+        // Failing back costs the session whether or not the primary is up,
+        // so try less often the more often it has failed
+        uint8_t stretch = (primary->failures > 16)?16:primary->failures;
+        return !inBackoff(primary,now) && now - primary->lastFailure >= this->failbackInterval*1000UL*stretch;
+    }
+    int result;
+    if (primary->domain != NULL) {
+        result = this->probeClient->connect(primary->domain, primary->port);
+    } else {
+        result = this->probeClient->connect(primary->ip, primary->port);
+    }
+    this->probeClient->stop();
+    if (result == 1) {
+        primary->failures = 0;
+        return true;
+    }
+    if (primary->failures < 0xFFFF) {
+        primary->failures++;
+    }
+    primary->lastFailure = millis();
+    return false;
+}
+
+boolean PubSubClientBase::connectServer(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
     if (!connected()) {
         int result = 0;
 
+        unsigned long start = millis();
         if (domain != NULL) {
             result = _client->connect(this->domain, this->port);
         } else {
             result = _client->connect(this->ip, this->port);
         }
+        this->metrics.tcpConnectTime = millis()-start;
+        this->metrics.handshakeTime = 0;
         if (result == 1) {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = MQTT_MAX_HEADER_SIZE;
-            unsigned int j;
-
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                buffer[length++] = d[j];
-            }
-
-            uint8_t v;
-            if (willTopic) {
-                v = 0x04|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x00;
+            if (cleanSession || this->sessionStore == NULL) {
+                nextMsgId = 1;
+                memset(this->inflight,0,sizeof(MQTTInflight)*this->maxInflight);
             }
             if (cleanSession) {
-                v = v|0x02;
-            }
-
-            if(user != NULL) {
-                v = v|0x80;
-
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
+                // Without a stored session the broker will not redeliver
+                memset(this->received,0,sizeof(MQTTInflight)*this->maxInflight);
+                if (this->sessionStore != NULL) {
+                    resetSession();
+                    checkpoint();
                 }
             }
-
-            buffer[length++] = v;
-
-            buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
-            buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
-
-            CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,buffer,length);
-            if (willTopic) {
-                CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,buffer,length);
-                CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,buffer,length);
-            }
-
-            if(user != NULL) {
-                CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,buffer,length);
-                if(pass != NULL) {
-                    CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,buffer,length);
-                }
+            uint16_t length = MQTTCodec::encodeConnect(buffer,this->bufferSize,id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession,this->keepAlive);
+            if (length == 0) {
+                // Too long for the buffer
+                _state = MQTT_CONNECT_FAILED;
+                this->metrics.connectFailures++;
+                _client->stop();
+                return false;
             }
-
-            write(MQTTCONNECT,buffer,length-MQTT_MAX_HEADER_SIZE);
+            sendPacket(buffer,length);
 
             lastInActivity = lastOutActivity = millis();
 
             while (!_client->available()) {
+                yield();
                 unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) MQTT_SOCKET_TIMEOUT*1000UL)) {
+                if (t-lastInActivity >= (this->socketTimeout*1000UL)) {
                     _state = MQTT_CONNECTION_TIMEOUT;
+                    this->metrics.timeouts++;
+                    this->metrics.connectFailures++;
                     _client->stop();
                     return false;
                 }
@@ -199,32 +308,52 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
             uint8_t llen;
             uint16_t len = readPacket(&llen);
 
-            if (len == 4) {
-                if (buffer[3] == 0) {
+            this->metrics.handshakeTime = millis()-lastOutActivity;
+            bool present;
+            uint8_t returnCode;
+            if (MQTTCodec::decodeConnack(buffer,len,&present,&returnCode)) {
+                if (returnCode == 0) {
                     lastInActivity = millis();
                     pingOutstanding = false;
                     _state = MQTT_CONNECTED;
+                    if (this->latencyProbe != NULL) {
+                        this->latencyProbe->subscribed = false;
+                    }
+                    this->_sessionPresent = present;
+                    if (this->sessionStore != NULL && !cleanSession && !present) {
+                        // The broker has lost what we subscribed to, and will
+                        // not ack what was in flight
+                        memset(this->inflight,0,sizeof(MQTTInflight)*this->maxInflight);
+                        resubscribe();
+                    }
+                    if (this->metrics.connects++ > 0) {
+                        this->metrics.reconnects++;
+                    }
                     return true;
                 } else {
-                    _state = buffer[3];
+                    _state = returnCode;
                 }
+            } else {
+                _state = MQTT_CONNECTION_LOST;
             }
             _client->stop();
         } else {
             _state = MQTT_CONNECT_FAILED;
         }
+        this->metrics.connectFailures++;
         return false;
     }
     return true;
 }
 
 // reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
+boolean PubSubClientBase::readByte(uint8_t * result) {
    uint32_t previousMillis = millis();
    while(!_client->available()) {
      yield();
      uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000)){
+     if(currentMillis - previousMillis >= (this->socketTimeout*1000UL)){
+       this->metrics.timeouts++;
        return false;
      }
    }
@@ -233,7 +362,7 @@ boolean PubSubClient::readByte(uint8_t * result) {
 }
 
 // reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
+boolean PubSubClientBase::readByte(uint8_t * result, uint16_t * index){
   uint16_t current_index = *index;
   uint8_t * write_address = &(result[current_index]);
   if(readByte(write_address)){
@@ -243,31 +372,35 @@ boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
   return false;
 }
 
-uint16_t PubSubClient::readPacket(uint8_t* lengthLength) {
+uint16_t PubSubClientBase::readPacket(uint8_t* lengthLength) {
     uint16_t len = 0;
     if(!readByte(buffer, &len)) return 0;
     bool isPublish = (buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint16_t length = 0;
+    uint32_t length = 0;
     uint8_t digit = 0;
-    uint16_t skip = 0;
+    uint32_t skip = 0;
     uint8_t start = 0;
+    int8_t llen;
 
     do {
-        if (len == 5) {
+        if(!readByte(buffer, &len)) return 0;
+        llen = MQTTCodec::decodeLength(buffer+1,len-1,&length);
+        if (llen < 0) {
             // Invalid remaining length encoding - kill the connection
             _state = MQTT_DISCONNECTED;
             _client->stop();
             return 0;
         }
-        if(!readByte(&digit)) return 0;
-        buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier *= 128;
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
+    } while (llen == 0);
+    *lengthLength = llen;
 
     if (isPublish) {
+        if (length < 2) {
+            // No room for the topic length - kill the connection
+            _state = MQTT_DISCONNECTED;
+            _client->stop();
+            return 0;
+        }
         // Read in topic length to calculate bytes to skip over for Stream writing
         if(!readByte(buffer, &len)) return 0;
         if(!readByte(buffer, &len)) return 0;
@@ -279,41 +412,92 @@ uint16_t PubSubClient::readPacket(uint8_t* lengthLength) {
         }
     }
 
-    for (uint16_t i = start;i<length;i++) {
+    // Wire lengths go up to 256MB; count in 32 bits and only buffer what fits
+    uint32_t total = len;
+    for (uint32_t i = start;i<length;i++) {
         if(!readByte(&digit)) return 0;
         if (this->stream) {
-            if (isPublish && len-*lengthLength-2>skip) {
+            if (isPublish && i-1>skip) {
                 this->stream->write(digit);
             }
         }
-        if (len < MQTT_MAX_PACKET_SIZE) {
-            buffer[len] = digit;
+        if (total < this->bufferSize) {
+            buffer[total] = digit;
+        }
+        total++;
+    }
+
+    this->metrics.packetsReceived[buffer[0]>>4]++;
+    this->metrics.bytesReceived[buffer[0]>>4] += total;
+    if (this->recording != NULL) {
+        if (total > this->bufferSize) {
+            recordPacket(MQTT_RECORD_INBOUND|MQTT_RECORD_TRUNCATED,buffer,this->bufferSize);
+        } else {
+            recordPacket(MQTT_RECORD_INBOUND,buffer,total);
         }
-        len++;
     }
 
-    if (!this->stream && len > MQTT_MAX_PACKET_SIZE) {
-        len = 0; // This will cause the packet to be ignored.
+    if (total > this->bufferSize) {
+        if (!this->stream) {
+            this->metrics.oversizeDrops++;
+            return 0; // This will cause the packet to be ignored.
+        }
+        if (total > 0xFFFF) {
+            total = 0xFFFF;
+        }
     }
 
-    return len;
+    return total;
+}
+
+boolean PubSubClientBase::loop() {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        // Nothing can be read or sent without a buffer; try again next time
+        return connected();
+    }
+    unsigned long start = micros();
+    boolean rc = processLoop();
+    unsigned long elapsed = micros()-start;
+    if (elapsed > this->metrics.maxLoopTime) {
+        this->metrics.maxLoopTime = elapsed;
+    }
+    return rc;
 }
 
-boolean PubSubClient::loop() {
+boolean PubSubClientBase::processLoop() {
     if (connected()) {
         unsigned long t = millis();
-        if ((t - lastInActivity > MQTT_KEEPALIVE*1000UL) || (t - lastOutActivity > MQTT_KEEPALIVE*1000UL)) {
+        if (this->endpoints != NULL && this->currentEndpoint != 0 && this->failbackInterval != 0 &&
+            t - this->lastProbe >= this->failbackInterval*1000UL) {
+            this->lastProbe = t;
+            if (probePrimary(t)) {
+                disconnect();
+                this->failingBack = true;
+                return false;
+            }
+        }
+        drainQueue();
+        if (this->latencyProbe != NULL) {
+            runProbe(t);
+        }
+        if (this->sessionDirty && t - this->lastCheckpoint >= MQTT_SESSION_CHECKPOINT*1000UL) {
+            checkpoint();
+        }
+        if (this->keepAlive != 0 && ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL))) {
             if (pingOutstanding) {
                 this->_state = MQTT_CONNECTION_TIMEOUT;
+                this->metrics.timeouts++;
                 _client->stop();
                 return false;
             } else {
-                buffer[0] = MQTTPINGREQ;
-                buffer[1] = 0;
-                _client->write(buffer,2);
+                uint16_t length = MQTTCodec::encodeEmpty(buffer,this->bufferSize,MQTTPINGREQ);
+                _client->write(buffer,length);
+                noteSent(buffer,length,length,true);
                 lastOutActivity = t;
                 lastInActivity = t;
                 pingOutstanding = true;
+                pingSent = t;
             }
         }
         if (_client->available()) {
@@ -325,35 +509,61 @@ boolean PubSubClient::loop() {
                 lastInActivity = t;
                 uint8_t type = buffer[0]&0xF0;
                 if (type == MQTTPUBLISH) {
-                    if (callback) {
-                        uint16_t tl = (buffer[llen+1]<<8)+buffer[llen+2]; /* topic length in bytes */
-                        memmove(buffer+llen+2,buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+                    MQTTPublishView publish;
+                    // The topic (and msgId) must lie within both the packet and the buffer
+                    if (!MQTTCodec::decodePublish(buffer,len,llen,&publish) || publish.payloadOffset > this->bufferSize) {
+                        _state = MQTT_DISCONNECTED;
+                        _client->stop();
+                        return false;
+                    }
+                    boolean probe = this->latencyProbe != NULL && receiveProbe(publish,millis());
+                    // Our own probes are not for the application
+                    if (!probe && hasCallback()) {
+                        uint16_t tl = publish.topicLength;
+                        memmove(buffer+llen+2,buffer+publish.topicOffset,tl); /* move topic inside buffer 1 byte to front */
                         buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
                         char *topic = (char*) buffer+llen+2;
+                        payload = buffer+publish.payloadOffset;
                         // msgId only present for QOS>0
-                        if ((buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (buffer[llen+3+tl]<<8)+buffer[llen+3+tl+1];
-                            payload = buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
-
-                            buffer[0] = MQTTPUBACK;
-                            buffer[1] = 2;
-                            buffer[2] = (msgId >> 8);
-                            buffer[3] = (msgId & 0xFF);
-                            _client->write(buffer,4);
-                            lastOutActivity = t;
-
+                        if (publish.qos == 1) {
+                            msgId = publish.msgId;
+                            if (!isDuplicate(msgId,publish.dup)) {
+                                deliver(topic,payload,publish.payloadLength);
+                            } else {
+                                this->metrics.duplicates++;
+                            }
                         } else {
-                            payload = buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
+                            deliver(topic,payload,publish.payloadLength);
                         }
                     }
+                    if (publish.qos == 1) {
+                        // Acked whoever it was for, or the broker sends it again
+                        uint16_t length = MQTTCodec::encodeAck(buffer,this->bufferSize,MQTTPUBACK,publish.msgId);
+                        _client->write(buffer,length);
+                        noteSent(buffer,length,length,true);
+                        lastOutActivity = t;
+                    }
                 } else if (type == MQTTPINGREQ) {
-                    buffer[0] = MQTTPINGRESP;
-                    buffer[1] = 0;
-                    _client->write(buffer,2);
+                    uint16_t length = MQTTCodec::encodeEmpty(buffer,this->bufferSize,MQTTPINGRESP);
+                    _client->write(buffer,length);
+                    noteSent(buffer,length,length,true);
                 } else if (type == MQTTPINGRESP) {
+                    if (pingOutstanding) {
+                        uint16_t rtt = millis()-pingSent;
+                        if (this->metrics.pings == 0 || rtt < this->metrics.pingRttMin) {
+                            this->metrics.pingRttMin = rtt;
+                        }
+                        if (rtt > this->metrics.pingRttMax) {
+                            this->metrics.pingRttMax = rtt;
+                        }
+                        this->metrics.pingRttTotal += rtt;
+                        this->metrics.pings++;
+                    }
                     pingOutstanding = false;
+                } else if (type == MQTTSUBACK || type == MQTTUNSUBACK) {
+                    if (MQTTCodec::decodeAck(buffer,len,llen,&msgId)) {
+                        releaseMsgId(msgId);
+                    }
                 }
             } else if (!connected()) {
                 // readPacket has closed the connection
@@ -365,150 +575,422 @@ boolean PubSubClient::loop() {
     return false;
 }
 
-boolean PubSubClient::publish(const char* topic, const char* payload) {
+void PubSubClientBase::runProbe(unsigned long now) {
+    MQTTLatencyProbe* probe = this->latencyProbe;
+    if (!probe->subscribed) {
+        probe->subscribed = subscribe(probe->topic);
+        if (!probe->subscribed) {
+            return;
+        }
+    }
+    if (now - probe->lastSent >= probe->interval) {
+        uint8_t payload[8];
+        payload[0] = 'L';
+        payload[1] = 'P';
+        payload[2] = probe->nextSeq >> 8;
+        payload[3] = probe->nextSeq & 0xFF;
+        payload[4] = now >> 24;
+        payload[5] = (now >> 16) & 0xFF;
+        payload[6] = (now >> 8) & 0xFF;
+        payload[7] = now & 0xFF;
+        // A probe that is refused never had a sequence number
+        if (publish(probe->topic,payload,sizeof(payload))) {
+            probe->nextSeq++;
+            this->metrics.probesSent++;
+        }
+        probe->lastSent = now;
+    }
+    if (probe->reportTopic != NULL && probe->reportInterval != 0 &&
+        now - probe->lastReport >= probe->reportInterval*1000UL) {
+        publishProbeReport();
+        probe->lastReport = now;
+    }
+}
+
+boolean PubSubClientBase::receiveProbe(const MQTTPublishView& publish, unsigned long now) {
+    MQTTLatencyProbe* probe = this->latencyProbe;
+    const uint8_t* payload = buffer+publish.payloadOffset;
+    if (publish.payloadLength != 8 || publish.topicLength != strlen(probe->topic) ||
+        memcmp(buffer+publish.topicOffset,probe->topic,publish.topicLength) != 0 ||
+        payload[0] != 'L' || payload[1] != 'P') {
+        return false;
+    }
+    uint16_t seq = (payload[2] << 8) + payload[3];
+    unsigned long sent = ((unsigned long)payload[4] << 24) + ((unsigned long)payload[5] << 16) + (payload[6] << 8) + payload[7];
+    int16_t ahead = (int16_t)(seq - probe->expectedSeq);
+    if (ahead >= 0) {
+        // Everything between the last probe and this one is missing
+        this->metrics.probesLost += ahead;
+        probe->window = (ahead < 31 ? probe->window << (ahead+1) : 0) | 1;
+        probe->expectedSeq = seq+1;
+    } else {
+        uint16_t back = -ahead-1;
+        if (back >= 32 || (probe->window & (1UL << back))) {
+            // A duplicate, or too old to tell
+            return true;
+        }
+        // An earlier probe counted as lost has turned up after all
+        probe->window |= 1UL << back;
+        if (this->metrics.probesLost > 0) {
+            this->metrics.probesLost--;
+        }
+        this->metrics.probesReordered++;
+    }
+    this->metrics.probesReceived++;
+    uint32_t rtt = now - sent;
+    probe->samples[probe->sampleHead] = rtt > 0xFFFF ? 0xFFFF : rtt;
+    probe->sampleHead = (probe->sampleHead+1) % MQTT_PROBE_SAMPLES;
+    if (probe->sampleCount < MQTT_PROBE_SAMPLES) {
+        probe->sampleCount++;
+    }
+    return true;
+}
+
+boolean PubSubClientBase::publishProbeReport() {
+    // Room for the longest report: 70 characters of names and punctuation,
+    // four 32 bit counters and four 16 bit percentiles
+    char report[136];
+    int length = snprintf(report,sizeof(report),
+             "{\"sent\":%lu,\"received\":%lu,\"lost\":%lu,\"reordered\":%lu,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u}",
+             (unsigned long)this->metrics.probesSent,(unsigned long)this->metrics.probesReceived,
+             (unsigned long)this->metrics.probesLost,(unsigned long)this->metrics.probesReordered,
+             getProbeRtt(50),getProbeRtt(90),getProbeRtt(99),getProbeRtt(100));
+    if (length < 0 || (size_t)length >= sizeof(report)) {
+        return false;
+    }
+    return publish(this->latencyProbe->reportTopic,report);
+}
+
+void PubSubClientBase::deliver(char* topic, uint8_t* payload, unsigned int length) {
+    if (this->compression && MQTTCompression::isFramed(payload,length)) {
+        int32_t original = MQTTCompression::decompress(payload,length,this->decompressBuffer,this->decompressSize);
+        if (original < 0) {
+            this->metrics.decompressFailures++;
+            return;
+        }
+        dispatch(topic,this->decompressBuffer,original);
+        return;
+    }
+    dispatch(topic,payload,length);
+}
+
+boolean PubSubClientBase::publish(const char* topic, const char* payload) {
     return publish(topic,(const uint8_t*)payload,strlen(payload),false);
 }
 
-boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
+boolean PubSubClientBase::publish(const char* topic, const char* payload, boolean retained) {
     return publish(topic,(const uint8_t*)payload,strlen(payload),retained);
 }
 
-boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
+boolean PubSubClientBase::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
     return publish(topic, payload, plength, false);
 }
 
-boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+boolean PubSubClientBase::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        this->metrics.publishFailures++;
+        return false;
+    }
     if (connected()) {
-        if (MQTT_MAX_PACKET_SIZE < MQTT_MAX_HEADER_SIZE + 2+strlen(topic) + plength) {
+        if (this->compression && plength > 0) {
+            // Send what is already queued first; this uses the buffer
+            drainQueue();
+            // Compress into the buffer behind the longest possible header and
+            // the topic, then move it down against the real header
+            uint32_t offset = MQTT_MAX_HEADER_SIZE+2+strlen(topic);
+            uint32_t clen = 0;
+            if (offset < this->bufferSize) {
+                clen = MQTTCompression::compress(payload,plength,buffer+offset,this->bufferSize-offset);
+            }
+            // A payload that looks framed must go framed, or it would be
+            // decompressed at the other end
+            if (clen != 0 && (clen < plength || MQTTCompression::isFramed(payload,plength))) {
+                uint16_t length = MQTTCodec::encodePublish(buffer,this->bufferSize,topic,NULL,clen,retained);
+                memmove(buffer+length,buffer+offset,clen);
+                if (clen < plength) {
+                    this->metrics.compressionSaved += plength-clen;
+                }
+                return publishPacket(length+clen);
+            }
+            if (MQTTCompression::isFramed(payload,plength)) {
+                this->metrics.publishFailures++;
+                return false;
+            }
+        }
+        if (MQTTCodec::packetSize(2+strlen(topic)+plength) > this->bufferSize) {
             // Too long
+            this->metrics.publishFailures++;
             return false;
         }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,buffer,length);
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            buffer[length++] = payload[i];
-        }
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
+        // Send what is already queued first; this uses the buffer
+        drainQueue();
+        uint16_t length = MQTTCodec::encodePublish(buffer,this->bufferSize,topic,payload,plength,retained);
+        return publishPacket(length);
+    }
+    return false;
+}
+
+// Sends the publish built in buffer if the rate limits allow it, otherwise
+// moves it to the outbound queue. While anything is queued new publishes
+// queue behind it so messages keep their order.
+boolean PubSubClientBase::publishPacket(uint16_t length) {
+    if (this->queueUsed == 0 && takeTokens(length,false)) {
+        if (sendPacket(buffer,length)) {
+            this->limitStats.sent++;
+            return true;
         }
-        return write(header,buffer,length-MQTT_MAX_HEADER_SIZE);
+        this->metrics.publishFailures++;
+        return false;
+    }
+    if (enqueue(buffer,length)) {
+        this->limitStats.deferred++;
+        return true;
     }
+    this->limitStats.dropped++;
+    this->metrics.publishFailures++;
     return false;
 }
 
-boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
+void PubSubClientBase::refill(MQTTTokenBucket* bucket, unsigned long now) {
+    int32_t full = (int32_t)bucket->burst*1000;
+    unsigned long elapsed = now - bucket->last;
+    bucket->last = now;
+    if (bucket->level >= full) {
+        return;
+    }
+    // Cap elapsed so the product cannot overflow after a long idle period
+    unsigned long fillTime = (unsigned long)(full - bucket->level)/bucket->rate + 1;
+    if (elapsed > fillTime) {
+        elapsed = fillTime;
+    }
+    bucket->level += (int32_t)(elapsed*bucket->rate);
+    if (bucket->level > full) {
+        bucket->level = full;
+    }
+}
+
+// Debt is capped at half the int32 range below a full bucket, so neither
+// the level nor the arithmetic in refill() can overflow
+static void charge(MQTTTokenBucket* bucket, uint32_t tokens) {
+    int32_t floor = (int32_t)bucket->burst*1000-0x3FFFFFFF;
+    int64_t level = (int64_t)bucket->level-(int64_t)tokens*1000;
+    bucket->level = (level < floor)?floor:(int32_t)level;
+}
+
+// Takes one publish token and `bytes` byte tokens. A packet larger than the
+// byte burst is let through once the bucket is full, leaving it in debt.
+// With force set the tokens are taken even if that means going into debt.
+boolean PubSubClientBase::takeTokens(uint32_t bytes, boolean force) {
+    unsigned long now = millis();
+    if (this->publishLimit.rate) {
+        refill(&this->publishLimit,now);
+        if (!force && this->publishLimit.level < 1000) {
+            return false;
+        }
+    }
+    if (this->byteLimit.rate) {
+        refill(&this->byteLimit,now);
+        uint32_t need = (bytes < this->byteLimit.burst)?bytes:this->byteLimit.burst;
+        if (!force && this->byteLimit.level < (int32_t)need*1000) {
+            return false;
+        }
+    }
+    if (this->publishLimit.rate) {
+        charge(&this->publishLimit,1);
+    }
+    if (this->byteLimit.rate) {
+        charge(&this->byteLimit,bytes);
+    }
+    return true;
+}
+
+// The queue is a byte ring holding each packet as a 2 byte length followed
+// by the encoded packet.
+boolean PubSubClientBase::enqueue(const uint8_t* packet, uint16_t length) {
+    if (this->queue == NULL || (uint32_t)this->queueUsed+length+2 > this->queueSize) {
+        return false;
+    }
+    uint16_t pos = (this->queueHead+this->queueUsed)%this->queueSize;
+    for (int32_t i = -2;i<length;i++) {
+        uint8_t b;
+        if (i == -2) {
+            b = length >> 8;
+        } else if (i == -1) {
+            b = length & 0xFF;
+        } else {
+            b = packet[i];
+        }
+        this->queue[pos] = b;
+        pos = (pos+1 == this->queueSize)?0:pos+1;
+    }
+    this->queueUsed += length+2;
+    this->limitStats.queued++;
+    if (this->queueUsed > this->limitStats.queueHighWater) {
+        this->limitStats.queueHighWater = this->queueUsed;
+    }
+    return true;
+}
+
+void PubSubClientBase::drainQueue() {
+    while (this->queueUsed > 0 && connected()) {
+        uint16_t pos = this->queueHead;
+        uint16_t length = this->queue[pos] << 8;
+        pos = (pos+1 == this->queueSize)?0:pos+1;
+        length |= this->queue[pos];
+        pos = (pos+1 == this->queueSize)?0:pos+1;
+        if (!takeTokens(length,false)) {
+            return;
+        }
+        for (uint16_t i = 0;i<length;i++) {
+            buffer[i] = this->queue[pos];
+            pos = (pos+1 == this->queueSize)?0:pos+1;
+        }
+        this->queueHead = pos;
+        this->queueUsed -= length+2;
+        this->limitStats.queued--;
+        if (!sendPacket(buffer,length)) {
+            // Anything written after a short write would be misread
+            this->metrics.publishFailures++;
+            return;
+        }
+        this->limitStats.drained++;
+        lastOutActivity = millis();
+    }
+}
+
+boolean PubSubClientBase::publish_P(const char* topic, const char* payload, boolean retained) {
     return publish_P(topic, (const uint8_t*)payload, strlen(payload), retained);
 }
 
-boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
+boolean PubSubClientBase::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        this->metrics.publishFailures++;
+        return false;
+    }
     unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
     unsigned int i;
-    uint8_t header;
-    unsigned int len;
 
     if (!connected()) {
         return false;
     }
 
-    tlen = strlen(topic);
-
-    header = MQTTPUBLISH;
-    if (retained) {
-        header |= 1;
+    // The payload is not held in RAM so it cannot be queued, only charged
+    uint16_t length = MQTTCodec::encodePublish(buffer,this->bufferSize,topic,NULL,plength,retained);
+    if (length == 0) {
+        this->metrics.publishFailures++;
+        return false;
     }
-    buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
-        digit = len % 128;
-        len = len / 128;
-        if (len > 0) {
-            digit |= 0x80;
-        }
-        buffer[pos++] = digit;
-        llen++;
-    } while(len>0);
-
-    pos = writeString(topic,buffer,pos);
+    takeTokens(length+plength,true);
 
-    rc += _client->write(buffer,pos);
+    rc += _client->write(buffer,length);
 
     for (i=0;i<plength;i++) {
         rc += _client->write((char)pgm_read_byte_near(payload + i));
     }
 
     lastOutActivity = millis();
+    noteSent(buffer,length,rc,plength == 0);
 
-    return rc == tlen + 4 + plength;
+    if (rc != length + plength) {
+        this->metrics.publishFailures++;
+        return false;
+    }
+    return true;
 }
 
-boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
+boolean PubSubClientBase::beginPublish(const char* topic, unsigned int plength, boolean retained) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        this->metrics.publishFailures++;
+        return false;
+    }
     if (connected()) {
         // Send the header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,buffer,length);
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
-        }
-        size_t hlen = buildHeader(header, buffer, plength+length-MQTT_MAX_HEADER_SIZE);
-        uint16_t rc = _client->write(buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
+        uint16_t length = MQTTCodec::encodePublish(buffer,this->bufferSize,topic,NULL,plength,retained);
+        if (length == 0) {
+            this->metrics.publishFailures++;
+            return false;
+        }
+        takeTokens(length+plength,true);
+        uint16_t rc = _client->write(buffer,length);
         lastOutActivity = millis();
-        return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
+        noteSent(buffer,length,rc,plength == 0);
+        if (rc != length) {
+            this->metrics.publishFailures++;
+            return false;
+        }
+        return true;
     }
     return false;
 }
 
-int PubSubClient::endPublish() {
+int PubSubClientBase::endPublish() {
  return 1;
 }
 
-size_t PubSubClient::write(uint8_t data) {
+size_t PubSubClientBase::write(uint8_t data) {
     lastOutActivity = millis();
-    return _client->write(data);
+    size_t rc = _client->write(data);
+    this->metrics.bytesSent[MQTTPUBLISH>>4] += rc;
+    return rc;
 }
 
-size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
+size_t PubSubClientBase::write(const uint8_t *buffer, size_t size) {
     lastOutActivity = millis();
-    return _client->write(buffer,size);
+    size_t rc = _client->write(buffer,size);
+    this->metrics.bytesSent[MQTTPUBLISH>>4] += rc;
+    return rc;
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
-    uint8_t lenBuf[4];
-    uint8_t llen = 0;
-    uint8_t digit;
-    uint8_t pos = 0;
-    uint16_t len = length;
-    do {
-        digit = len % 128;
-        len = len / 128;
-        if (len > 0) {
-            digit |= 0x80;
-        }
-        lenBuf[pos++] = digit;
-        llen++;
-    } while(len>0);
+// Counts and records a packet handed to the client. The first `length` bytes
+// are in memory at `packet` and `bytes` were written; `complete` is false
+// when part of the payload was streamed from elsewhere. Payload written
+// later with write() is added to the PUBLISH byte count as it goes.
+void PubSubClientBase::noteSent(const uint8_t* packet, uint16_t length, uint32_t bytes, boolean complete) {
+    this->metrics.packetsSent[packet[0]>>4]++;
+    this->metrics.bytesSent[packet[0]>>4] += bytes;
+    if (this->recording != NULL) {
+        recordPacket(MQTT_RECORD_OUTBOUND|(complete?0:MQTT_RECORD_TRUNCATED),packet,length);
+    }
+}
 
-    buf[4-llen] = header;
-    for (int i=0;i<llen;i++) {
-        buf[MQTT_MAX_HEADER_SIZE-llen+i] = lenBuf[i];
+// Appends a record to the capture ring, evicting the oldest records to make
+// room. Each record is a flags byte, a 4 byte timestamp and a 2 byte length,
+// all big-endian, followed by the packet bytes.
+void PubSubClientBase::recordPacket(uint8_t flags, const uint8_t* packet, uint16_t length) {
+    uint32_t needed = (uint32_t)length+MQTT_RECORD_HEADER_SIZE;
+    if (needed > this->recordingSize) {
+        this->recordingDropped++;
+        return;
+    }
+    while ((uint32_t)(this->recordingSize-this->recordingUsed) < needed) {
+        // Offsets past the head can exceed 16 bits before they are wrapped
+        uint32_t pos = (uint32_t)this->recordingHead+5;
+        uint16_t oldest = this->recording[pos%this->recordingSize] << 8;
+        oldest |= this->recording[(pos+1)%this->recordingSize];
+        this->recordingHead = (this->recordingHead+MQTT_RECORD_HEADER_SIZE+oldest)%this->recordingSize;
+        this->recordingUsed -= MQTT_RECORD_HEADER_SIZE+oldest;
+        this->recordingDropped++;
+    }
+    uint32_t now = millis();
+    uint8_t header[MQTT_RECORD_HEADER_SIZE] = { flags, (uint8_t)(now>>24), (uint8_t)(now>>16), (uint8_t)(now>>8), (uint8_t)now, (uint8_t)(length>>8), (uint8_t)length };
+    uint16_t pos = (this->recordingHead+this->recordingUsed)%this->recordingSize;
+    for (uint32_t i = 0;i<needed;i++) {
+        this->recording[pos] = (i < MQTT_RECORD_HEADER_SIZE)?header[i]:packet[i-MQTT_RECORD_HEADER_SIZE];
+        pos = (pos+1 == this->recordingSize)?0:pos+1;
     }
-    return llen+1; // Full header size is variable length bit plus the 1-byte fixed header
+    this->recordingUsed += needed;
 }
 
-boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
+boolean PubSubClientBase::sendPacket(const uint8_t* packet, uint16_t length) {
     uint16_t rc;
-    uint8_t hlen = buildHeader(header, buf, length);
+    noteSent(packet,length,length,true);
 
 #ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf+(MQTT_MAX_HEADER_SIZE-hlen);
-    uint16_t bytesRemaining = length+hlen;  //Match the length type
+    const uint8_t* writeBuf = packet;
+    uint16_t bytesRemaining = length;  //Match the length type
     uint8_t bytesToWrite;
     boolean result = true;
     while((bytesRemaining > 0) && result) {
@@ -520,84 +1002,270 @@ boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
     }
     return result;
 #else
-    rc = _client->write(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
+    rc = _client->write(packet,length);
     lastOutActivity = millis();
-    return (rc == hlen+length);
+    return (rc == length);
 #endif
 }
 
-boolean PubSubClient::subscribe(const char* topic) {
+boolean PubSubClientBase::subscribe(const char* topic) {
     return subscribe(topic, 0);
 }
 
-boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
+boolean PubSubClientBase::subscribe(const char* topic, uint8_t qos) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        return false;
+    }
     if (qos > 1) {
         return false;
     }
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic)) {
+    if (this->bufferSize < 9 + strlen(topic)) {
         // Too long
         return false;
     }
     if (connected()) {
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString((char*)topic, buffer,length);
-        buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE|MQTTQOS1,buffer,length-MQTT_MAX_HEADER_SIZE);
+        if (this->sessionStore != NULL) {
+            uint16_t pos = findSubscription(topic);
+            if (pos != 0 && this->session[pos] == qos) {
+                // Already part of the session the broker holds
+                return true;
+            }
+        }
+        uint16_t msgId = takeMsgId(MQTTSUBSCRIBE);
+        uint16_t length = MQTTCodec::encodeSubscribe(buffer,this->bufferSize,msgId,topic,qos);
+        if (!sendPacket(buffer,length)) {
+            return false;
+        }
+        if (this->sessionStore != NULL) {
+            rememberSubscription(topic,qos);
+        }
+        return true;
     }
     return false;
 }
 
-boolean PubSubClient::unsubscribe(const char* topic) {
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic)) {
+boolean PubSubClientBase::unsubscribe(const char* topic) {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        return false;
+    }
+    if (this->bufferSize < 9 + strlen(topic)) {
         // Too long
         return false;
     }
     if (connected()) {
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = takeMsgId(MQTTUNSUBSCRIBE);
+        uint16_t length = MQTTCodec::encodeUnsubscribe(buffer,this->bufferSize,msgId,topic);
+        if (!sendPacket(buffer,length)) {
+            return false;
+        }
+        if (this->sessionStore != NULL) {
+            forgetSubscription(topic);
         }
-        buffer[length++] = (nextMsgId >> 8);
-        buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, buffer,length);
-        return write(MQTTUNSUBSCRIBE|MQTTQOS1,buffer,length-MQTT_MAX_HEADER_SIZE);
+        return true;
     }
     return false;
 }
 
-void PubSubClient::disconnect() {
-    buffer[0] = MQTTDISCONNECT;
-    buffer[1] = 0;
-    _client->write(buffer,2);
+void PubSubClientBase::disconnect() {
+    MQTTBufferLease lease(this);
+    if (!lease) {
+        // DISCONNECT cannot be built; just drop the connection
+        _state = MQTT_DISCONNECTED;
+        _client->stop();
+        return;
+    }
+    uint16_t length = MQTTCodec::encodeEmpty(buffer,this->bufferSize,MQTTDISCONNECT);
+    _client->write(buffer,length);
+    noteSent(buffer,length,length,true);
     _state = MQTT_DISCONNECTED;
     _client->flush();
     _client->stop();
     lastInActivity = lastOutActivity = millis();
+    if (this->sessionDirty) {
+        checkpoint();
+    }
+}
+
+// Allocates the next packet id and records it as waiting for an ack. When
+// the table is full the oldest entry is dropped; it is only bookkeeping, so
+// this never blocks a send.
+uint16_t PubSubClientBase::takeMsgId(uint8_t type) {
+    nextMsgId++;
+    if (nextMsgId == 0) {
+        nextMsgId = 1;
+    }
+    uint8_t slot = 0;
+    for (uint8_t i = 0;i<this->maxInflight;i++) {
+        if (this->inflight[i].msgId == 0) {
+            slot = i;
+            break;
+        }
+        if (this->inflight[i].sent - this->inflight[slot].sent > 0x7FFFFFFFUL) {
+            slot = i;
+        }
+    }
+    this->inflight[slot].msgId = nextMsgId;
+    this->inflight[slot].type = type;
+    this->inflight[slot].sent = millis();
+    this->sessionDirty = this->sessionStore != NULL;
+    return nextMsgId;
+}
+
+void PubSubClientBase::releaseMsgId(uint16_t msgId) {
+    for (uint8_t i = 0;i<this->maxInflight;i++) {
+        if (this->inflight[i].msgId == msgId) {
+            this->inflight[i].msgId = 0;
+            this->sessionDirty = this->sessionStore != NULL;
+            return;
+        }
+    }
+}
+
+// Records an inbound QoS 1 packet id and reports whether it is a redelivery
+// of one already dispatched. Only packets with the DUP flag are treated as
+// duplicates; the broker may reuse an id for a new message once acked.
+boolean PubSubClientBase::isDuplicate(uint16_t msgId, boolean dup) {
+    if (this->dedupWindow == 0) {
+        return false;
+    }
+    unsigned long now = millis();
+    unsigned long window = this->dedupWindow*1000UL;
+    uint8_t slot = 0;
+    for (uint8_t i = 0;i<this->maxInflight;i++) {
+        if (this->received[i].msgId == msgId && now - this->received[i].sent < window) {
+            this->received[i].sent = now;
+            return dup;
+        }
+        if (this->received[slot].msgId != 0) {
+            if (this->received[i].msgId == 0 || now - this->received[i].sent > now - this->received[slot].sent) {
+                slot = i;
+            }
+        }
+    }
+    this->received[slot].msgId = msgId;
+    this->received[slot].type = MQTTPUBLISH;
+    this->received[slot].sent = now;
+    this->sessionDirty = this->sessionStore != NULL;
+    return false;
+}
+
+// A session is kept as:
+//   'S', version, next packet id (2 bytes), number of slots n,
+//   n in-flight entries (packet id (2 bytes), type), n received packet ids
+//   (2 bytes each), then a record per subscription: qos, topic, NUL
+// with multi-byte fields big-endian.
+uint16_t PubSubClientBase::sessionHeaderSize() {
+    return 5 + this->maxInflight*5;
+}
+
+void PubSubClientBase::resetSession() {
+    this->session[0] = 'S';
+    this->session[1] = 1;
+    this->session[4] = this->maxInflight;
+    this->sessionUsed = sessionHeaderSize();
+    this->sessionDirty = true;
+}
+
+boolean PubSubClientBase::loadSession() {
+    uint16_t length = this->sessionStore->load(this->session,this->sessionSize);
+    uint16_t header = sessionHeaderSize();
+    if (length < header || length > this->sessionSize || this->session[0] != 'S' || this->session[1] != 1 ||
+        this->session[4] != this->maxInflight) {
+        return false;
+    }
+    // Every subscription record needs a topic ended within what was loaded;
+    // findSubscription and resubscribe go by strlen from here on
+    uint16_t pos = header;
+    while (pos < length) {
+        const uint8_t* end = (const uint8_t*)memchr(this->session+pos+1,0,length-pos-1);
+        if (end == NULL || end == this->session+pos+1) {
+            return false;
+        }
+        pos = end-this->session+1;
+    }
+    unsigned long now = millis();
+    this->nextMsgId = (this->session[2] << 8) + this->session[3];
+    uint8_t* entry = this->session+5;
+    for (uint8_t i = 0; i < this->maxInflight; i++, entry += 3) {
+        this->inflight[i].msgId = (entry[0] << 8) + entry[1];
+        this->inflight[i].type = entry[2];
+        this->inflight[i].sent = now;
+    }
+    for (uint8_t i = 0; i < this->maxInflight; i++, entry += 2) {
+        this->received[i].msgId = (entry[0] << 8) + entry[1];
+        this->received[i].type = MQTTPUBLISH;
+        this->received[i].sent = now;
+    }
+    this->sessionUsed = length;
+    return true;
+}
+
+// Offset of the subscription record for topic, 0 if there is none
+uint16_t PubSubClientBase::findSubscription(const char* topic) {
+    uint16_t pos = sessionHeaderSize();
+    while (pos < this->sessionUsed) {
+        const char* t = (const char*)this->session+pos+1;
+        uint16_t len = strlen(t);
+        if (strcmp(t,topic) == 0) {
+            return pos;
+        }
+        pos += len+2;
+    }
+    return 0;
+}
+
+void PubSubClientBase::rememberSubscription(const char* topic, uint8_t qos) {
+    uint16_t pos = findSubscription(topic);
+    if (pos == 0) {
+        uint16_t len = strlen(topic);
+        if (this->sessionUsed+len+2 > this->sessionSize) {
+            // No room; it will not be resumed
+            return;
+        }
+        pos = this->sessionUsed;
+        memcpy(this->session+pos+1,topic,len+1);
+        this->sessionUsed += len+2;
+    }
+    this->session[pos] = qos;
+    checkpoint();
+}
+
+void PubSubClientBase::forgetSubscription(const char* topic) {
+    uint16_t pos = findSubscription(topic);
+    if (pos != 0) {
+        uint16_t len = strlen(topic)+2;
+        memmove(this->session+pos,this->session+pos+len,this->sessionUsed-pos-len);
+        this->sessionUsed -= len;
+        checkpoint();
+    }
 }
 
-uint16_t PubSubClient::writeString(const char* string, uint8_t* buf, uint16_t pos) {
-    const char* idp = string;
-    uint16_t i = 0;
-    pos += 2;
-    while (*idp) {
-        buf[pos++] = *idp++;
-        i++;
+void PubSubClientBase::resubscribe() {
+    uint16_t pos = sessionHeaderSize();
+    while (pos < this->sessionUsed) {
+        const char* topic = (const char*)this->session+pos+1;
+        uint16_t msgId = takeMsgId(MQTTSUBSCRIBE);
+        uint16_t length = MQTTCodec::encodeSubscribe(buffer,this->bufferSize,msgId,topic,this->session[pos]);
+        if (length != 0) {
+            sendPacket(buffer,length);
+        }
+        pos += strlen(topic)+2;
     }
-    buf[pos-i-2] = (i >> 8);
-    buf[pos-i-1] = (i & 0xFF);
-    return pos;
 }
 
+uint8_t PubSubClientBase::pendingAcks() {
+    uint8_t count = 0;
+    for (uint8_t i = 0;i<this->maxInflight;i++) {
+        if (this->inflight[i].msgId != 0) {
+            count++;
+        }
+    }
+    return count;
+}
 
-boolean PubSubClient::connected() {
+boolean PubSubClientBase::connected() {
     boolean rc;
     if (_client == NULL ) {
         rc = false;
@@ -614,39 +1282,293 @@ boolean PubSubClient::connected() {
     return rc;
 }
 
-PubSubClient& PubSubClient::setServer(uint8_t * ip, uint16_t port) {
+PubSubClientBase& PubSubClientBase::setServer(uint8_t * ip, uint16_t port) {
     IPAddress addr(ip[0],ip[1],ip[2],ip[3]);
     return setServer(addr,port);
 }
 
-PubSubClient& PubSubClient::setServer(IPAddress ip, uint16_t port) {
+PubSubClientBase& PubSubClientBase::setServer(IPAddress ip, uint16_t port) {
     this->ip = ip;
     this->port = port;
     this->domain = NULL;
+    this->endpoints = NULL;
     return *this;
 }
 
-PubSubClient& PubSubClient::setServer(const char * domain, uint16_t port) {
+PubSubClientBase& PubSubClientBase::setServer(const char * domain, uint16_t port) {
     this->domain = domain;
     this->port = port;
+    this->endpoints = NULL;
     return *this;
 }
 
-PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
-    this->callback = callback;
+PubSubClientBase& PubSubClientBase::setServers(MQTTEndpoint* endpoints, uint8_t count) {
+    if (count > 32) {
+        count = 32;
+    }
+    this->endpoints = (count > 0)?endpoints:NULL;
+    this->endpointCount = count;
+    this->currentEndpoint = 0;
     return *this;
 }
 
-PubSubClient& PubSubClient::setClient(Client& client){
+PubSubClientBase& PubSubClientBase::setFailback(uint16_t seconds, Client* probe) {
+    this->failbackInterval = seconds;
+    this->probeClient = probe;
+    return *this;
+}
+
+uint8_t PubSubClientBase::currentServer() {
+    return this->currentEndpoint;
+}
+
+PubSubClientBase& PubSubClientBase::setClient(Client& client){
     this->_client = &client;
     return *this;
 }
 
-PubSubClient& PubSubClient::setStream(Stream& stream){
+PubSubClientBase& PubSubClientBase::setStream(Stream& stream){
     this->stream = &stream;
     return *this;
 }
 
-int PubSubClient::state() {
+PubSubClientBase& PubSubClientBase::setKeepAlive(uint16_t keepAlive) {
+    this->keepAlive = keepAlive;
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setSocketTimeout(uint16_t timeout) {
+    this->socketTimeout = timeout;
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setDuplicateWindow(uint16_t seconds) {
+    this->dedupWindow = seconds;
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setPublishRate(uint16_t perSecond, uint16_t burst) {
+    this->publishLimit.rate = perSecond;
+    this->publishLimit.burst = burst;
+    this->publishLimit.level = (int32_t)burst*1000;
+    this->publishLimit.last = millis();
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setByteRate(uint32_t bytesPerSecond, uint32_t burst) {
+    this->byteLimit.rate = bytesPerSecond;
+    this->byteLimit.burst = burst;
+    this->byteLimit.level = (int32_t)burst*1000;
+    this->byteLimit.last = millis();
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setOutboundQueue(uint8_t* storage, uint16_t size) {
+    this->queue = storage;
+    this->queueSize = size;
+    this->queueHead = 0;
+    this->queueUsed = 0;
+    this->limitStats.queued = 0;
+    return *this;
+}
+
+uint16_t PubSubClientBase::queuedMessages() {
+    return this->limitStats.queued;
+}
+
+const MQTTRateLimitStats& PubSubClientBase::getRateLimitStats() {
+    return this->limitStats;
+}
+
+PubSubClientBase& PubSubClientBase::setRecorder(uint8_t* storage, uint16_t size) {
+    this->recording = (size > 0)?storage:NULL;
+    this->recordingSize = size;
+    clearRecording();
+    return *this;
+}
+
+uint16_t PubSubClientBase::readRecording(uint8_t* out, uint16_t size) {
+    uint16_t length = (this->recordingUsed < size)?this->recordingUsed:size;
+    // Only hand out whole records
+    uint16_t complete = 0;
+    while (complete < length) {
+        uint32_t pos = (uint32_t)this->recordingHead+complete+5;
+        uint16_t record = MQTT_RECORD_HEADER_SIZE+((this->recording[pos%this->recordingSize] << 8)|this->recording[(pos+1)%this->recordingSize]);
+        if (complete+record > length) {
+            break;
+        }
+        complete += record;
+    }
+    for (uint16_t i = 0;i<complete;i++) {
+        out[i] = this->recording[(this->recordingHead+i)%this->recordingSize];
+    }
+    return complete;
+}
+
+uint16_t PubSubClientBase::recordingLength() {
+    return this->recordingUsed;
+}
+
+uint32_t PubSubClientBase::recordsDropped() {
+    return this->recordingDropped;
+}
+
+void PubSubClientBase::clearRecording() {
+    this->recordingHead = 0;
+    this->recordingUsed = 0;
+    this->recordingDropped = 0;
+}
+
+PubSubClientBase& PubSubClientBase::setCompression(uint8_t* scratch, uint16_t size) {
+    this->compression = scratch != NULL;
+    this->decompressBuffer = scratch;
+    this->decompressSize = scratch != NULL ? size : 0;
+    return *this;
+}
+
+PubSubClientBase& PubSubClientBase::setSession(MQTTSessionStore* store, uint8_t* storage, uint16_t size) {
+    this->session = storage;
+    this->sessionSize = size;
+    this->sessionDirty = false;
+    this->sessionStore = store;
+    if (store == NULL || storage == NULL || size < sessionHeaderSize()) {
+        this->sessionStore = NULL;
+        return *this;
+    }
+    if (!loadSession()) {
+        resetSession();
+    }
+    this->lastCheckpoint = millis();
+    return *this;
+}
+
+boolean PubSubClientBase::checkpoint() {
+    if (this->sessionStore == NULL) {
+        return false;
+    }
+    this->session[2] = this->nextMsgId >> 8;
+    this->session[3] = this->nextMsgId & 0xFF;
+    uint8_t* entry = this->session+5;
+    for (uint8_t i = 0; i < this->maxInflight; i++, entry += 3) {
+        entry[0] = this->inflight[i].msgId >> 8;
+        entry[1] = this->inflight[i].msgId & 0xFF;
+        entry[2] = this->inflight[i].type;
+    }
+    for (uint8_t i = 0; i < this->maxInflight; i++, entry += 2) {
+        entry[0] = this->received[i].msgId >> 8;
+        entry[1] = this->received[i].msgId & 0xFF;
+    }
+    this->lastCheckpoint = millis();
+    if (!this->sessionStore->save(this->session,this->sessionUsed)) {
+        return false;
+    }
+    this->sessionDirty = false;
+    return true;
+}
+
+boolean PubSubClientBase::sessionPresent() {
+    return this->_sessionPresent;
+}
+
+const MQTTMetrics& PubSubClientBase::getMetrics() {
+    return this->metrics;
+}
+
+uint16_t PubSubClientBase::getPingRttAvg() {
+    if (this->metrics.pings == 0) {
+        return 0;
+    }
+    return this->metrics.pingRttTotal/this->metrics.pings;
+}
+
+void PubSubClientBase::resetMetrics() {
+    memset(&this->metrics,0,sizeof(MQTTMetrics));
+}
+
+PubSubClientBase& PubSubClientBase::setLatencyProbe(MQTTLatencyProbe* probe) {
+    if (this->latencyProbe != NULL && this->latencyProbe->subscribed && connected()) {
+        unsubscribe(this->latencyProbe->topic);
+    }
+    this->latencyProbe = probe;
+    if (probe != NULL) {
+        unsigned long t = millis();
+        probe->nextSeq = 0;
+        probe->expectedSeq = 0;
+        probe->window = 0;
+        probe->subscribed = false;
+        probe->lastSent = t-probe->interval;
+        probe->lastReport = t;
+        probe->sampleHead = 0;
+        probe->sampleCount = 0;
+    }
+    return *this;
+}
+
+uint16_t PubSubClientBase::getProbeRtt(uint8_t percentile) {
+    if (this->latencyProbe == NULL || this->latencyProbe->sampleCount == 0) {
+        return 0;
+    }
+    uint8_t count = this->latencyProbe->sampleCount;
+    uint16_t sorted[MQTT_PROBE_SAMPLES];
+    for (uint8_t i = 0; i < count; i++) {
+        uint16_t rtt = this->latencyProbe->samples[i];
+        uint8_t j = i;
+        for (; j > 0 && sorted[j-1] > rtt; j--) {
+            sorted[j] = sorted[j-1];
+        }
+        sorted[j] = rtt;
+    }
+    // Nearest rank
+    uint16_t rank = (percentile*count+99)/100;
+    if (rank == 0) {
+        rank = 1;
+    } else if (rank > count) {
+        rank = count;
+    }
+    return sorted[rank-1];
+}
+
+boolean PubSubClientBase::borrowBuffer() {
+    if (this->pool == NULL) {
+        return this->buffer != NULL;
+    }
+    if (this->leaseDepth == 0) {
+        this->buffer = this->pool->acquire();
+        if (this->buffer == NULL) {
+            return false;
+        }
+    }
+    this->leaseDepth++;
+    return true;
+}
+
+void PubSubClientBase::returnBuffer() {
+    if (this->pool != NULL && --this->leaseDepth == 0) {
+        this->pool->release(this->buffer);
+        this->buffer = NULL;
+    }
+}
+
+PubSubClientBase& PubSubClientBase::setBufferPool(MQTTBufferPool* pool) {
+    if (this->leaseDepth != 0) {
+        // Not while a call holds a buffer from the current pool
+        return *this;
+    }
+    this->pool = pool;
+    if (pool != NULL) {
+        this->buffer = NULL;
+        this->bufferSize = pool->getBufferSize();
+    } else {
+        this->buffer = this->ownBuffer;
+        this->bufferSize = this->ownBufferSize;
+    }
+    return *this;
+}
+
+uint16_t PubSubClientBase::getBufferSize() {
+    return this->bufferSize;
+}
+
+int PubSubClientBase::state() {
     return this->_state;
 }
@@ -11,15 +11,8 @@
 #include "IPAddress.h"
 #include "Client.h"
 #include "Stream.h"
-
-#define MQTT_VERSION_3_1      3
-#define MQTT_VERSION_3_1_1    4
-
-// MQTT_VERSION : Pick the version
-//#define MQTT_VERSION MQTT_VERSION_3_1
-#ifndef MQTT_VERSION
-#define MQTT_VERSION MQTT_VERSION_3_1_1
-#endif
+#include "MQTTCodec.h"
+#include "MQTTCompression.h"
 
 // MQTT_MAX_PACKET_SIZE : Maximum packet size
 #ifndef MQTT_MAX_PACKET_SIZE
@@ -53,84 +46,382 @@
 #define MQTT_CONNECT_BAD_CREDENTIALS 4
 #define MQTT_CONNECT_UNAUTHORIZED    5
 
-#define MQTTCONNECT     1 << 4  // Client request to connect to Server
-#define MQTTCONNACK     2 << 4  // Connect Acknowledgment
-#define MQTTPUBLISH     3 << 4  // Publish message
-#define MQTTPUBACK      4 << 4  // Publish Acknowledgment
-#define MQTTPUBREC      5 << 4  // Publish Received (assured delivery part 1)
-#define MQTTPUBREL      6 << 4  // Publish Release (assured delivery part 2)
-#define MQTTPUBCOMP     7 << 4  // Publish Complete (assured delivery part 3)
-#define MQTTSUBSCRIBE   8 << 4  // Client Subscribe request
-#define MQTTSUBACK      9 << 4  // Subscribe Acknowledgment
-#define MQTTUNSUBSCRIBE 10 << 4 // Client Unsubscribe request
-#define MQTTUNSUBACK    11 << 4 // Unsubscribe Acknowledgment
-#define MQTTPINGREQ     12 << 4 // PING Request
-#define MQTTPINGRESP    13 << 4 // PING Response
-#define MQTTDISCONNECT  14 << 4 // Client is Disconnecting
-#define MQTTReserved    15 << 4 // Reserved
-
-#define MQTTQOS0        (0 << 1)
-#define MQTTQOS1        (1 << 1)
-#define MQTTQOS2        (2 << 1)
-
-// Maximum size of fixed header and variable length size header
-#define MQTT_MAX_HEADER_SIZE 5
+// MQTT_MAX_INFLIGHT : Number of outstanding packet ids tracked per client
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_DEDUP_WINDOW : Seconds an inbound QoS 1 packet id is remembered for
+//  duplicate suppression
+#ifndef MQTT_DEDUP_WINDOW
+#define MQTT_DEDUP_WINDOW 30
+#endif
+
+// MQTT_FAILOVER_BACKOFF : Seconds a broker endpoint is avoided after its first
+//  failure. Doubles with each further consecutive failure, up to 5 minutes.
+#ifndef MQTT_FAILOVER_BACKOFF
+#define MQTT_FAILOVER_BACKOFF 5
+#endif
+
+// MQTT_FAILOVER_PREFERENCE : Connect latency in ms that moving one place down
+//  the endpoint list is worth when choosing where to connect
+#ifndef MQTT_FAILOVER_PREFERENCE
+#define MQTT_FAILOVER_PREFERENCE 1000
+#endif
+
+// MQTT_PROBE_SAMPLES : Number of recent latency probe round trips kept for
+//  the percentiles (at most 255)
+#ifndef MQTT_PROBE_SAMPLES
+#define MQTT_PROBE_SAMPLES 32
+#endif
+
+// MQTT_SESSION_CHECKPOINT : Seconds between saves of a changed persistent
+//  session from loop(). Subscription changes are saved straight away.
+#ifndef MQTT_SESSION_CHECKPOINT
+#define MQTT_SESSION_CHECKPOINT 10
+#endif
+
+// Packet capture record flags, see setRecorder
+#define MQTT_RECORD_INBOUND     0x00
+#define MQTT_RECORD_OUTBOUND    0x01
+#define MQTT_RECORD_TRUNCATED   0x02  // payload streamed, only the head was kept
+#define MQTT_RECORD_HEADER_SIZE 7
+
+// Smallest buffer that can hold a CONNECT with an empty client id
+#define MQTT_MIN_PACKET_SIZE (MQTT_MAX_HEADER_SIZE + 12)
+
+typedef void (*MQTTCallbackFunction)(char*, uint8_t*, unsigned int);
 
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
-#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+typedef std::function<void(char*, uint8_t*, unsigned int)> MQTTCallback;
 #else
-#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+typedef MQTTCallbackFunction MQTTCallback;
 #endif
 
-#define CHECK_STRING_LENGTH(l,s) if (l+2+strlen(s) > MQTT_MAX_PACKET_SIZE) {_client->stop();return false;}
+#define MQTT_CALLBACK_SIGNATURE MQTTCallback callback
+
+// A packet id waiting for its acknowledgement, or one recently received
+struct MQTTInflight {
+   uint16_t msgId;
+   uint8_t type;
+   unsigned long sent;
+};
+
+// Protocol counters, always maintained. Indexes of the per-type arrays are
+// the packet type (MQTTPUBLISH >> 4 and so on).
+struct MQTTMetrics {
+   uint32_t packetsSent[16];
+   uint32_t packetsReceived[16];
+   uint32_t bytesSent[16];
+   uint32_t bytesReceived[16];
+   uint32_t publishFailures;     // publishes refused or not fully written while connected
+   uint32_t connects;            // successful connects
+   uint32_t reconnects;          // successful connects after the first
+   uint32_t connectFailures;
+   uint16_t tcpConnectTime;      // ms spent in Client::connect by the last attempt
+   uint16_t handshakeTime;       // ms from CONNECT sent to CONNACK by the last attempt
+   uint32_t pings;               // PINGRESPs received for our PINGREQs
+   uint16_t pingRttMin;          // ms
+   uint16_t pingRttMax;          // ms
+   uint32_t pingRttTotal;        // ms, divide by pings for the average
+   uint32_t oversizeDrops;       // inbound packets larger than the buffer
+   uint32_t duplicates;          // redelivered QoS 1 publishes not dispatched
+   uint32_t timeouts;            // socket, connect and keepalive timeouts
+   uint32_t maxLoopTime;         // longest loop() call in microseconds
+   uint32_t probesSent;          // latency probes published
+   uint32_t probesReceived;      // latency probes that came back
+   uint32_t probesLost;          // probes skipped over by a later one
+   uint32_t probesReordered;     // probes that came back after a later one
+   uint32_t compressionSaved;    // payload bytes saved by compressing publishes
+   uint32_t decompressFailures;  // framed payloads that could not be decompressed
+};
+
+// A broker in a failover list. The application fills in the address; the
+// health fields are maintained by the client and may be inspected.
+struct MQTTEndpoint {
+   const char* domain;      // NULL to use ip
+   uint16_t port;
+   IPAddress ip;
+   uint16_t latency;        // smoothed connect-to-CONNACK time in ms
+   uint16_t failures;       // consecutive failed attempts
+   uint32_t connects;       // successful connections
+   unsigned long lastFailure;
+};
+
+// A latency probe, see setLatencyProbe. The application fills in the first
+// four fields; the rest are maintained by the client.
+struct MQTTLatencyProbe {
+   const char* topic;          // loopback topic no other client publishes to
+   uint16_t interval;          // ms between probes
+   const char* reportTopic;    // where to publish the results, NULL for none
+   uint16_t reportInterval;    // seconds between reports
+   uint16_t nextSeq;
+   uint16_t expectedSeq;
+   uint32_t window;            // bit n set: expectedSeq-1-n has come back
+   boolean subscribed;
+   unsigned long lastSent;
+   unsigned long lastReport;
+   uint16_t samples[MQTT_PROBE_SAMPLES];  // most recent round trips in ms
+   uint8_t sampleHead;
+   uint8_t sampleCount;
+};
+
+// Where a persistent session is kept across reboots, for example flash or
+// RTC memory. The session is an opaque block of at most the size given to
+// setSession.
+class MQTTSessionStore {
+public:
+   virtual ~MQTTSessionStore() {}
+   // Replace the stored session with `length` bytes. Returns false on failure.
+   virtual bool save(const uint8_t* data, uint16_t length) = 0;
+   // Copy the stored session into data and return its length, 0 if there is none
+   virtual uint16_t load(uint8_t* data, uint16_t size) = 0;
+};
+
+// A token bucket used to pace outbound publishes. Tokens are kept in
+// thousandths so slow rates still refill smoothly.
+struct MQTTTokenBucket {
+   uint32_t rate;   // tokens per second, 0 disables the limit
+   uint32_t burst;  // bucket capacity
+   int32_t level;   // current tokens x 1000, negative while in debt
+   unsigned long last;
+};
+
+struct MQTTRateLimitStats {
+   uint32_t sent;          // publishes sent straight away
+   uint32_t deferred;      // publishes placed in the outbound queue
+   uint32_t drained;       // queued publishes sent later by loop()
+   uint32_t dropped;       // over-limit publishes with no room to queue them
+   uint16_t queued;        // publishes currently waiting in the queue
+   uint16_t queueHighWater;// most bytes ever held in the queue
+};
+
+// Packet buffers shared by several clients, see setBufferPool. A client only
+// holds one for the duration of a call such as publish() or loop(), so the
+// pool needs as many as there can be calls in progress at once: one, plus one
+// for each other client a callback publishes to.
+class MQTTBufferPool {
+private:
+   uint8_t* storage;
+   uint16_t bufferSize;
+   uint8_t count;
+   uint32_t inUse;
+   uint8_t highWater;
+   uint32_t misses;
+public:
+   MQTTBufferPool(uint8_t* storage, uint16_t bufferSize, uint8_t count);
+   // A free buffer, or NULL if all are lent out
+   uint8_t* acquire();
+   void release(uint8_t* buffer);
+   uint16_t getBufferSize();
+   uint8_t available();
+   // Most buffers ever lent out at once
+   uint8_t getHighWater();
+   // Calls that failed because no buffer was free
+   uint32_t getMisses();
+};
 
-class PubSubClient : public Print {
+// A pool of Count buffers of BufferSize bytes held inside the object
+template<uint16_t BufferSize, uint8_t Count>
+class BasicMQTTBufferPool : public MQTTBufferPool {
+   static_assert(BufferSize >= MQTT_MIN_PACKET_SIZE, "BufferSize is too small to hold a CONNECT packet");
+   static_assert(Count > 0 && Count <= 32, "Count must be 1-32");
+private:
+   uint8_t buffers[BufferSize*Count];
+public:
+   BasicMQTTBufferPool() : MQTTBufferPool(buffers,BufferSize,Count) {
+   }
+};
+
+// PubSubClientBase holds the protocol logic. It works over storage owned by
+// the derived class, so it never allocates and is compiled only once however
+// many client sizes an application uses.
+class PubSubClientBase : public Print {
+   friend class MQTTBufferLease;
 private:
    Client* _client;
-   uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+   uint8_t* buffer;
+   uint16_t bufferSize;
+   uint8_t* ownBuffer;
+   uint16_t ownBufferSize;
+   MQTTBufferPool* pool;
+   uint8_t leaseDepth;
+   boolean borrowBuffer();
+   void returnBuffer();
+   MQTTInflight* inflight;
+   MQTTInflight* received;
+   uint8_t maxInflight;
+   uint16_t dedupWindow;
    uint16_t nextMsgId;
    unsigned long lastOutActivity;
    unsigned long lastInActivity;
    bool pingOutstanding;
-   MQTT_CALLBACK_SIGNATURE;
+   unsigned long pingSent;
+   MQTTMetrics metrics;
+   uint16_t keepAlive;
+   uint16_t socketTimeout;
    uint16_t readPacket(uint8_t*);
    boolean readByte(uint8_t * result);
    boolean readByte(uint8_t * result, uint16_t * index);
-   boolean write(uint8_t header, uint8_t* buf, uint16_t length);
-   uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
-   // Build up the header ready to send
-   // Returns the size of the header
-   // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
-   //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-   size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   boolean sendPacket(const uint8_t* packet, uint16_t length);
+   boolean processLoop();
+   void noteSent(const uint8_t* packet, uint16_t length, uint32_t bytes, boolean complete);
+   void recordPacket(uint8_t flags, const uint8_t* packet, uint16_t length);
+   boolean publishPacket(uint16_t length);
+   void refill(MQTTTokenBucket* bucket, unsigned long now);
+   boolean takeTokens(uint32_t bytes, boolean force);
+   boolean enqueue(const uint8_t* packet, uint16_t length);
+   void drainQueue();
+   boolean connectServer(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   boolean inBackoff(MQTTEndpoint* endpoint, unsigned long now);
+   boolean probePrimary(unsigned long now);
+   uint16_t takeMsgId(uint8_t type);
+   void releaseMsgId(uint16_t msgId);
+   boolean isDuplicate(uint16_t msgId, boolean dup);
+   void runProbe(unsigned long now);
+   boolean receiveProbe(const MQTTPublishView& publish, unsigned long now);
+   boolean publishProbeReport();
+   void deliver(char* topic, uint8_t* payload, unsigned int length);
+   uint16_t sessionHeaderSize();
+   void resetSession();
+   boolean loadSession();
+   uint16_t findSubscription(const char* topic);
+   void rememberSubscription(const char* topic, uint8_t qos);
+   void forgetSubscription(const char* topic);
+   void resubscribe();
+   MQTTTokenBucket publishLimit;
+   MQTTTokenBucket byteLimit;
+   uint8_t* queue;
+   uint16_t queueSize;
+   uint16_t queueHead;
+   uint16_t queueUsed;
+   MQTTRateLimitStats limitStats;
+   uint8_t* recording;
+   uint16_t recordingSize;
+   uint16_t recordingHead;
+   uint16_t recordingUsed;
+   uint32_t recordingDropped;
    IPAddress ip;
    const char* domain;
    uint16_t port;
+   MQTTEndpoint* endpoints;
+   uint8_t endpointCount;
+   uint8_t currentEndpoint;
+   uint16_t failbackInterval;
+   Client* probeClient;
+   unsigned long lastProbe;
+   boolean failingBack;
+   MQTTLatencyProbe* latencyProbe;
+   boolean compression;
+   uint8_t* decompressBuffer;
+   uint16_t decompressSize;
+   MQTTSessionStore* sessionStore;
+   uint8_t* session;
+   uint16_t sessionSize;
+   uint16_t sessionUsed;
+   boolean sessionDirty;
+   boolean _sessionPresent;
+   unsigned long lastCheckpoint;
    Stream* stream;
    int _state;
+protected:
+   PubSubClientBase(uint8_t* buffer, uint16_t bufferSize, MQTTInflight* inflight, MQTTInflight* received, uint8_t maxInflight);
+   virtual boolean hasCallback() = 0;
+   virtual void dispatch(char* topic, uint8_t* payload, unsigned int length) = 0;
 public:
-   PubSubClient();
-   PubSubClient(Client& client);
-   PubSubClient(IPAddress, uint16_t, Client& client);
-   PubSubClient(IPAddress, uint16_t, Client& client, Stream&);
-   PubSubClient(IPAddress, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(IPAddress, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
-   PubSubClient(uint8_t *, uint16_t, Client& client);
-   PubSubClient(uint8_t *, uint16_t, Client& client, Stream&);
-   PubSubClient(uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
-   PubSubClient(const char*, uint16_t, Client& client);
-   PubSubClient(const char*, uint16_t, Client& client, Stream&);
-   PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
-
-   PubSubClient& setServer(IPAddress ip, uint16_t port);
-   PubSubClient& setServer(uint8_t * ip, uint16_t port);
-   PubSubClient& setServer(const char * domain, uint16_t port);
-   PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
-   PubSubClient& setClient(Client& client);
-   PubSubClient& setStream(Stream& stream);
+   virtual ~PubSubClientBase() {}
+   PubSubClientBase& setServer(IPAddress ip, uint16_t port);
+   PubSubClientBase& setServer(uint8_t * ip, uint16_t port);
+   PubSubClientBase& setServer(const char * domain, uint16_t port);
+   // Use an ordered list of brokers, most preferred first (at most 32).
+   // connect() tries them healthiest first and fails over within one call.
+   PubSubClientBase& setServers(MQTTEndpoint* endpoints, uint8_t count);
+   // While connected to any endpoint but the first, check the first every
+   // `seconds` and fail back to it once it is reachable. With a probe client
+   // the check is a TCP connect on that client; without one the session is
+   // dropped and connect() retries the first endpoint, waiting one interval
+   // more between tries for each time the first endpoint has failed.
+   PubSubClientBase& setFailback(uint16_t seconds, Client* probe);
+   // Index of the endpoint in use, or of the last one tried
+   uint8_t currentServer();
+   PubSubClientBase& setClient(Client& client);
+   PubSubClientBase& setStream(Stream& stream);
+   // Keepalive interval in seconds, sent in the next CONNECT. 0 disables pings.
+   PubSubClientBase& setKeepAlive(uint16_t keepAlive);
+   // Time in seconds to wait for inbound data before giving up
+   PubSubClientBase& setSocketTimeout(uint16_t timeout);
+   // Seconds a received QoS 1 packet id is remembered. A redelivery (DUP set)
+   // of a remembered id is acknowledged but not passed to the callback.
+   // 0 disables the check.
+   PubSubClientBase& setDuplicateWindow(uint16_t seconds);
+   // Limit publishes to `perSecond` on average with bursts of up to `burst`.
+   // 0 removes the limit.
+   PubSubClientBase& setPublishRate(uint16_t perSecond, uint16_t burst);
+   // Limit publish traffic to `bytesPerSecond`, with bursts of up to `burst` bytes
+   // (at most 2000000). 0 removes the limit.
+   PubSubClientBase& setByteRate(uint32_t bytesPerSecond, uint32_t burst);
+   // Storage for publishes held back by the rate limits. They are sent, in
+   // order, from loop() as tokens become available. Without a queue an
+   // over-limit publish fails.
+   PubSubClientBase& setOutboundQueue(uint8_t* storage, uint16_t size);
+   uint16_t queuedMessages();
+   const MQTTRateLimitStats& getRateLimitStats();
+   // Capture every packet sent and received into a ring buffer, overwriting
+   // the oldest records when full. Each record is:
+   //   flags (1 byte, MQTT_RECORD_*), millis() (4 bytes), length (2 bytes), packet
+   // with multi-byte fields big-endian. Pass NULL to stop recording.
+   PubSubClientBase& setRecorder(uint8_t* storage, uint16_t size);
+   // Copy the whole records held, oldest first, into out. Returns the bytes copied.
+   uint16_t readRecording(uint8_t* out, uint16_t size);
+   uint16_t recordingLength();
+   // Records evicted or too large to keep since the recording was cleared
+   uint32_t recordsDropped();
+   void clearRecording();
+   // Measure the round trip through the broker. While connected the client
+   // subscribes to probe->topic and publishes an 8 byte sequence-numbered,
+   // timestamped probe to it every probe->interval ms. Returning probes are
+   // consumed, not passed to the callback, and counted in the metrics; a
+   // probe is counted lost once a later one comes back without it. With a
+   // reportTopic a JSON summary is published every reportInterval seconds;
+   // it is up to 128 bytes long, so needs more than the default buffer.
+   // Pass NULL to stop probing.
+   PubSubClientBase& setLatencyProbe(MQTTLatencyProbe* probe);
+   // Round trip in ms that `percentile` percent of the recent probes came
+   // back within, 0 before the first one returns
+   uint16_t getProbeRtt(uint8_t percentile);
+   // Compress the payloads of publish() with MQTTCompression when that makes
+   // them smaller, and decompress framed inbound payloads into `scratch`
+   // before passing them to the callback. Payloads that do not decompress
+   // into `size` bytes are dropped. beginPublish() and publish_P() payloads
+   // are sent as they are. Pass NULL to turn compression off.
+   PubSubClientBase& setCompression(uint8_t* scratch, uint16_t size);
+   // Keep the session in `storage` and checkpoint it to `store`: the next
+   // packet id, the in-flight and recently received packet ids and every
+   // subscription. It is loaded from the store here. A connect without
+   // cleanSession then carries on from it: if the broker still has the
+   // session, subscribe() calls for topics it holds send nothing; if not,
+   // the subscriptions are sent again. A clean session connect empties it.
+   // `storage` needs 5 bytes, 5 per in-flight slot, and each topic plus 2.
+   // Pass NULL to stop.
+   PubSubClientBase& setSession(MQTTSessionStore* store, uint8_t* storage, uint16_t size);
+   // Save the session now, e.g. before deep sleep. Returns false without a
+   // store or if it fails.
+   boolean checkpoint();
+   // Whether the broker resumed a stored session on the last connect
+   boolean sessionPresent();
+   const MQTTMetrics& getMetrics();
+   // Average ping round trip in ms, 0 before the first ping completes
+   uint16_t getPingRttAvg();
+   void resetMetrics();
+   // Borrow the packet buffer from `pool` for each call instead of using the
+   // client's own, so that several clients need fewer buffers between them.
+   // Calls that find the pool empty fail; loop() then does nothing. Pass
+   // NULL to go back to the client's own buffer.
+   PubSubClientBase& setBufferPool(MQTTBufferPool* pool);
+   uint16_t getBufferSize();
+   // Number of SUBSCRIBE/UNSUBSCRIBE packets still waiting for their ack
+   uint8_t pendingAcks();
 
    boolean connect(const char* id);
    boolean connect(const char* id, const char* user, const char* pass);
@@ -169,5 +460,183 @@ public:
    int state();
 };
 
+// BasicPubSubClient fixes the packet buffer size, the number of tracked
+// in-flight and recently received packet ids and the callback type at compile time. All of its
+// storage lives inside the object, so a statically allocated client never
+// touches the heap. CallbackT must be callable as (char*, uint8_t*, unsigned int)
+// and testable with `if (callback)`; use MQTTCallbackFunction to avoid the
+// std::function used by default on ESP8266/ESP32. A BufferSize of 0 leaves
+// the buffer out; such a client must be given a pool with setBufferPool.
+template<uint16_t BufferSize, uint8_t MaxInflight, typename CallbackT>
+class BasicPubSubClient : public PubSubClientBase {
+   static_assert(BufferSize == 0 || BufferSize >= MQTT_MIN_PACKET_SIZE, "BufferSize is too small to hold a CONNECT packet");
+   static_assert(MaxInflight > 0, "MaxInflight must be at least 1");
+private:
+   uint8_t storage[BufferSize ? BufferSize : 1];
+   MQTTInflight inflightTable[MaxInflight];
+   MQTTInflight receivedTable[MaxInflight];
+   CallbackT callback;
+protected:
+   virtual boolean hasCallback() {
+      return callback ? true : false;
+   }
+   virtual void dispatch(char* topic, uint8_t* payload, unsigned int length) {
+      callback(topic,payload,length);
+   }
+public:
+   BasicPubSubClient() : PubSubClientBase(BufferSize ? storage : NULL,BufferSize,inflightTable,receivedTable,MaxInflight), callback() {
+   }
+   BasicPubSubClient(Client& client) : BasicPubSubClient() {
+      setClient(client);
+   }
+   BasicPubSubClient(IPAddress addr, uint16_t port, Client& client) : BasicPubSubClient() {
+      setServer(addr,port);
+      setClient(client);
+   }
+   BasicPubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(addr,port);
+      setClient(client);
+      setStream(stream);
+   }
+   BasicPubSubClient(IPAddress addr, uint16_t port, CallbackT callback, Client& client) : BasicPubSubClient() {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   BasicPubSubClient(IPAddress addr, uint16_t port, CallbackT callback, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   BasicPubSubClient(uint8_t *ip, uint16_t port, Client& client) : BasicPubSubClient() {
+      setServer(ip,port);
+      setClient(client);
+   }
+   BasicPubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(ip,port);
+      setClient(client);
+      setStream(stream);
+   }
+   BasicPubSubClient(uint8_t *ip, uint16_t port, CallbackT callback, Client& client) : BasicPubSubClient() {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   BasicPubSubClient(uint8_t *ip, uint16_t port, CallbackT callback, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   BasicPubSubClient(const char* domain, uint16_t port, Client& client) : BasicPubSubClient() {
+      setServer(domain,port);
+      setClient(client);
+   }
+   BasicPubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(domain,port);
+      setClient(client);
+      setStream(stream);
+   }
+   BasicPubSubClient(const char* domain, uint16_t port, CallbackT callback, Client& client) : BasicPubSubClient() {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   BasicPubSubClient(const char* domain, uint16_t port, CallbackT callback, Client& client, Stream& stream) : BasicPubSubClient() {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+
+   // The setters are repeated here so that chained calls keep the derived type
+   BasicPubSubClient& setServer(IPAddress ip, uint16_t port) {
+      PubSubClientBase::setServer(ip,port);
+      return *this;
+   }
+   BasicPubSubClient& setServer(uint8_t * ip, uint16_t port) {
+      PubSubClientBase::setServer(ip,port);
+      return *this;
+   }
+   BasicPubSubClient& setServer(const char * domain, uint16_t port) {
+      PubSubClientBase::setServer(domain,port);
+      return *this;
+   }
+   BasicPubSubClient& setServers(MQTTEndpoint* endpoints, uint8_t count) {
+      PubSubClientBase::setServers(endpoints,count);
+      return *this;
+   }
+   BasicPubSubClient& setFailback(uint16_t seconds, Client* probe) {
+      PubSubClientBase::setFailback(seconds,probe);
+      return *this;
+   }
+   BasicPubSubClient& setRecorder(uint8_t* storage, uint16_t size) {
+      PubSubClientBase::setRecorder(storage,size);
+      return *this;
+   }
+   BasicPubSubClient& setLatencyProbe(MQTTLatencyProbe* probe) {
+      PubSubClientBase::setLatencyProbe(probe);
+      return *this;
+   }
+   BasicPubSubClient& setCompression(uint8_t* scratch, uint16_t size) {
+      PubSubClientBase::setCompression(scratch,size);
+      return *this;
+   }
+   BasicPubSubClient& setSession(MQTTSessionStore* store, uint8_t* storage, uint16_t size) {
+      PubSubClientBase::setSession(store,storage,size);
+      return *this;
+   }
+   BasicPubSubClient& setBufferPool(MQTTBufferPool* pool) {
+      PubSubClientBase::setBufferPool(pool);
+      return *this;
+   }
+   BasicPubSubClient& setCallback(CallbackT callback) {
+      this->callback = callback;
+      return *this;
+   }
+   BasicPubSubClient& setClient(Client& client) {
+      PubSubClientBase::setClient(client);
+      return *this;
+   }
+   BasicPubSubClient& setStream(Stream& stream) {
+      PubSubClientBase::setStream(stream);
+      return *this;
+   }
+   BasicPubSubClient& setKeepAlive(uint16_t keepAlive) {
+      PubSubClientBase::setKeepAlive(keepAlive);
+      return *this;
+   }
+   BasicPubSubClient& setSocketTimeout(uint16_t timeout) {
+      PubSubClientBase::setSocketTimeout(timeout);
+      return *this;
+   }
+   BasicPubSubClient& setDuplicateWindow(uint16_t seconds) {
+      PubSubClientBase::setDuplicateWindow(seconds);
+      return *this;
+   }
+   BasicPubSubClient& setPublishRate(uint16_t perSecond, uint16_t burst) {
+      PubSubClientBase::setPublishRate(perSecond,burst);
+      return *this;
+   }
+   BasicPubSubClient& setByteRate(uint32_t bytesPerSecond, uint32_t burst) {
+      PubSubClientBase::setByteRate(bytesPerSecond,burst);
+      return *this;
+   }
+   BasicPubSubClient& setOutboundQueue(uint8_t* storage, uint16_t size) {
+      PubSubClientBase::setOutboundQueue(storage,size);
+      return *this;
+   }
+};
+
+// The default client, sized by the MQTT_MAX_PACKET_SIZE and MQTT_MAX_INFLIGHT defines.
+// A class rather than a typedef, so `class PubSubClient;` still declares it.
+class PubSubClient : public BasicPubSubClient<MQTT_MAX_PACKET_SIZE, MQTT_MAX_INFLIGHT, MQTTCallback> {
+public:
+   using BasicPubSubClient<MQTT_MAX_PACKET_SIZE, MQTT_MAX_INFLIGHT, MQTTCallback>::BasicPubSubClient;
+};
+
+// A client without a buffer of its own, for use with an MQTTBufferPool
+typedef BasicPubSubClient<0, MQTT_MAX_INFLIGHT, MQTTCallback> PooledPubSubClient;
 
 #endif
@@ -0,0 +1,165 @@
+#include "PubSubClient.h"
+#include "Client.h"
+#include "Allocations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+// Micro-benchmarks for the PubSubClient encode and decode paths. Each result
+// is printed as one JSON object per line; allocs_per_op counts heap
+// allocations (see Allocations.h) and should stay at zero.
+
+// A Client that swallows writes and serves one packet at a time from memory
+class BenchClient : public Client {
+private:
+    const uint8_t* packet;
+    size_t length;
+    size_t pos;
+public:
+    unsigned long written;
+
+    BenchClient() : packet(NULL), length(0), pos(0), written(0) {}
+    void feed(const uint8_t* buf, size_t size) { packet = buf; length = size; pos = 0; }
+
+    virtual int connect(IPAddress ip, uint16_t port) { return 1; }
+    virtual int connect(const char *host, uint16_t port) { return 1; }
+    virtual size_t write(uint8_t) { written++; return 1; }
+    virtual size_t write(const uint8_t *buf, size_t size) { written += size; return size; }
+    virtual int available() { return length-pos; }
+    virtual int read() { return (pos < length)?packet[pos++]:-1; }
+    virtual int read(uint8_t *buf, size_t size) {
+        size_t i = 0;
+        for (;i<size && pos<length;i++) {
+            buf[i] = packet[pos++];
+        }
+        return i;
+    }
+    virtual int peek() { return (pos < length)?packet[pos]:-1; }
+    virtual void flush() {}
+    virtual void stop() {}
+    virtual uint8_t connected() { return 1; }
+    virtual operator bool() { return true; }
+};
+
+typedef BasicPubSubClient<2048, 4, MQTTCallbackFunction> BenchPubSubClient;
+
+static unsigned long dispatched = 0;
+
+void callback(char* topic, uint8_t* payload, unsigned int length) {
+    dispatched += length;
+}
+
+static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+
+static void connect(BenchPubSubClient& client, BenchClient& net) {
+    net.feed(connack,sizeof(connack));
+    client.connect("bench");
+}
+
+// Runs op for at least 200ms and prints the per-operation cost
+template<typename Op>
+static void measure(const char* name, unsigned topicLength, unsigned payloadLength, unsigned long bytesPerOp, Op op) {
+    typedef std::chrono::steady_clock clock;
+    unsigned long iterations = 0;
+    AllocationCounter allocations;
+    clock::time_point start = clock::now();
+    clock::time_point end;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            op();
+        }
+        iterations += 1000;
+        end = clock::now();
+    } while (end - start < std::chrono::milliseconds(200));
+
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    double nsPerOp = ns/iterations;
+    double mbPerSec = (bytesPerOp*iterations)/(ns/1e9)/1e6;
+    double allocsPerOp = (double)allocations.count()/iterations;
+    printf("{\"bench\":\"%s\",\"topic\":%u,\"payload\":%u,\"iterations\":%lu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f,\"allocs_per_op\":%.3f}\n",
+           name,topicLength,payloadLength,iterations,nsPerOp,mbPerSec,allocsPerOp);
+}
+
+static void makeTopic(char* topic, unsigned length) {
+    for (unsigned i = 0; i < length; i++) {
+        topic[i] = 'a'+(i%26);
+    }
+    topic[length] = 0;
+}
+
+// Builds an inbound PUBLISH into buf and returns its length
+static size_t makePublish(uint8_t* buf, const char* topic, unsigned payloadLength, uint8_t qos) {
+    size_t topicLength = strlen(topic);
+    size_t remaining = 2+topicLength+(qos?2:0)+payloadLength;
+    size_t pos = 0;
+    buf[pos++] = MQTTPUBLISH|(qos<<1);
+    size_t len = remaining;
+    do {
+        uint8_t digit = len % 128;
+        len = len / 128;
+        if (len > 0) {
+            digit |= 0x80;
+        }
+        buf[pos++] = digit;
+    } while (len > 0);
+    buf[pos++] = topicLength >> 8;
+    buf[pos++] = topicLength & 0xFF;
+    memcpy(buf+pos,topic,topicLength);
+    pos += topicLength;
+    if (qos) {
+        buf[pos++] = 0x12;
+        buf[pos++] = 0x34;
+    }
+    memset(buf+pos,'x',payloadLength);
+    return pos+payloadLength;
+}
+
+int main() {
+    static const unsigned topicLengths[] = { 8, 32, 96 };
+    static const unsigned payloadLengths[] = { 16, 128, 1024 };
+
+    static BenchClient net;
+    static BenchPubSubClient client(net);
+    client.setCallback(callback);
+    client.setDuplicateWindow(0);
+    connect(client,net);
+
+    char topic[128];
+    static uint8_t payload[1024];
+    memset(payload,'x',sizeof(payload));
+
+    for (unsigned t = 0; t < sizeof(topicLengths)/sizeof(topicLengths[0]); t++) {
+        makeTopic(topic,topicLengths[t]);
+        for (unsigned p = 0; p < sizeof(payloadLengths)/sizeof(payloadLengths[0]); p++) {
+            unsigned payloadLength = payloadLengths[p];
+            unsigned long packetBytes = 2+2+topicLengths[t]+payloadLength;
+            measure("publish",topicLengths[t],payloadLength,packetBytes,[&]() {
+                client.publish(topic,payload,payloadLength);
+            });
+        }
+    }
+
+    static uint8_t packet[2048];
+    for (unsigned t = 0; t < sizeof(topicLengths)/sizeof(topicLengths[0]); t++) {
+        makeTopic(topic,topicLengths[t]);
+        for (unsigned p = 0; p < sizeof(payloadLengths)/sizeof(payloadLengths[0]); p++) {
+            for (uint8_t qos = 0; qos < 2; qos++) {
+                unsigned payloadLength = payloadLengths[p];
+                size_t length = makePublish(packet,topic,payloadLength,qos);
+                measure(qos?"receive_qos1":"receive_qos0",topicLengths[t],payloadLength,length,[&]() {
+                    net.feed(packet,length);
+                    client.loop();
+                });
+            }
+        }
+    }
+
+    for (unsigned t = 0; t < sizeof(topicLengths)/sizeof(topicLengths[0]); t++) {
+        makeTopic(topic,topicLengths[t]);
+        measure("subscribe",topicLengths[t],0,2+2+2+topicLengths[t]+1,[&]() {
+            client.subscribe(topic,1);
+        });
+    }
+
+    return dispatched > 0 ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+#include "MQTTCodec.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+static_assert(MQTTCodec::lengthSize(0) == 1, "lengthSize is constexpr");
+static_assert(MQTTCodec::packetSize(127) == 129, "packetSize is constexpr");
+
+
+int test_codec_length() {
+    IT("encodes and decodes remaining lengths at every size boundary");
+    uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455 };
+    uint8_t sizes[] = { 1, 1, 1, 2, 2, 3, 3, 4, 4 };
+    for (int i = 0; i < 9; i++) {
+        uint8_t buf[4];
+        IS_TRUE(MQTTCodec::lengthSize(values[i]) == sizes[i]);
+        IS_TRUE(MQTTCodec::encodeLength(buf,values[i]) == sizes[i]);
+        uint32_t length = 0;
+        IS_TRUE(MQTTCodec::decodeLength(buf,4,&length) == sizes[i]);
+        IS_TRUE(length == values[i]);
+        if (sizes[i] > 1) {
+            // Not enough bytes yet
+            IS_TRUE(MQTTCodec::decodeLength(buf,sizes[i]-1,&length) == 0);
+        }
+    }
+    uint8_t encoded[] = { 0xC1, 0x02 };
+    uint32_t length = 0;
+    IS_TRUE(MQTTCodec::decodeLength(encoded,2,&length) == 2);
+    IS_TRUE(length == 321);
+
+    uint8_t invalid[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    IS_TRUE(MQTTCodec::decodeLength(invalid,5,&length) == -1);
+
+    END_IT
+}
+
+int test_codec_connect() {
+    IT("encodes a CONNECT");
+    uint8_t buf[64];
+    uint32_t length = MQTTCodec::encodeConnect(buf,sizeof(buf),"client_test1",NULL,NULL,NULL,0,false,NULL,true,15);
+    uint8_t connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    IS_TRUE(length == sizeof(connect));
+    IS_TRUE(memcmp(buf,connect,sizeof(connect)) == 0);
+
+    length = MQTTCodec::encodeConnect(buf,sizeof(buf),"client_test1","user","pass","will",1,true,"msg",false,15);
+    IS_TRUE(buf[9] == (0x80|0x40|0x20|0x08|0x04));
+
+    // Does not fit
+    IS_TRUE(MQTTCodec::encodeConnect(buf,25,"client_test1",NULL,NULL,NULL,0,false,NULL,true,15) == 0);
+
+    END_IT
+}
+
+int test_codec_publish_roundtrip() {
+    IT("decodes the PUBLISH it encodes");
+    uint8_t buf[300];
+    uint8_t payload[200];
+    memset(payload,'p',sizeof(payload));
+    uint32_t length = MQTTCodec::encodePublish(buf,sizeof(buf),"a/topic",payload,sizeof(payload),true);
+    IS_TRUE(length == MQTTCodec::packetSize(2+7+200));
+    IS_TRUE(buf[0] == (MQTTPUBLISH|1));
+
+    uint32_t remaining;
+    int8_t llen = MQTTCodec::decodeLength(buf+1,length-1,&remaining);
+    IS_TRUE(llen == 2);
+    MQTTPublishView publish;
+    IS_TRUE(MQTTCodec::decodePublish(buf,length,llen,&publish));
+    IS_TRUE(publish.retained);
+    IS_TRUE(publish.qos == 0);
+    IS_TRUE(publish.topicLength == 7);
+    IS_TRUE(memcmp(buf+publish.topicOffset,"a/topic",7) == 0);
+    IS_TRUE(publish.payloadLength == 200);
+    IS_TRUE(memcmp(buf+publish.payloadOffset,payload,200) == 0);
+
+    // Header and topic only, for a payload sent separately
+    length = MQTTCodec::encodePublish(buf,20,"a/topic",NULL,1000,false);
+    IS_TRUE(length == 1+2+2+7);
+
+    IS_TRUE(MQTTCodec::encodePublish(buf,100,"a/topic",payload,sizeof(payload),false) == 0);
+
+    END_IT
+}
+
+int test_codec_publish_malformed() {
+    IT("rejects a PUBLISH whose topic or packet id overruns the packet");
+    uint8_t topicOverrun[] = {0x30,0x7,0xff,0xff,0x74,0x6f,0x70,0x69,0x63};
+    MQTTPublishView publish;
+    IS_FALSE(MQTTCodec::decodePublish(topicOverrun,sizeof(topicOverrun),1,&publish));
+
+    uint8_t noMsgId[] = {0x32,0x7,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    IS_FALSE(MQTTCodec::decodePublish(noMsgId,sizeof(noMsgId),1,&publish));
+
+    uint8_t qos1[] = {0x3a,0x9,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34};
+    IS_TRUE(MQTTCodec::decodePublish(qos1,sizeof(qos1),1,&publish));
+    IS_TRUE(publish.qos == 1);
+    IS_TRUE(publish.dup);
+    IS_TRUE(publish.msgId == 0x1234);
+    IS_TRUE(publish.payloadLength == 0);
+
+    END_IT
+}
+
+int test_codec_subscribe_and_acks() {
+    IT("encodes SUBSCRIBE, UNSUBSCRIBE and acks");
+    uint8_t buf[32];
+    uint32_t length = MQTTCodec::encodeSubscribe(buf,sizeof(buf),2,"topic",1);
+    uint8_t subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1 };
+    IS_TRUE(length == sizeof(subscribe));
+    IS_TRUE(memcmp(buf,subscribe,sizeof(subscribe)) == 0);
+
+    length = MQTTCodec::encodeUnsubscribe(buf,sizeof(buf),2,"topic");
+    uint8_t unsubscribe[] = { 0xa2,0x9,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63 };
+    IS_TRUE(length == sizeof(unsubscribe));
+    IS_TRUE(memcmp(buf,unsubscribe,sizeof(unsubscribe)) == 0);
+
+    IS_TRUE(MQTTCodec::encodeAck(buf,sizeof(buf),MQTTPUBACK,0x1234) == 4);
+    uint16_t msgId = 0;
+    IS_TRUE(MQTTCodec::decodeAck(buf,4,1,&msgId));
+    IS_TRUE(msgId == 0x1234);
+    IS_FALSE(MQTTCodec::decodeAck(buf,2,1,&msgId));
+
+    IS_TRUE(MQTTCodec::encodeEmpty(buf,sizeof(buf),MQTTPINGREQ) == 2);
+    IS_TRUE(buf[0] == MQTTPINGREQ && buf[1] == 0);
+
+    uint8_t connack[] = { 0x20, 0x02, 0x01, 0x05 };
+    bool sessionPresent;
+    uint8_t returnCode;
+    IS_TRUE(MQTTCodec::decodeConnack(connack,4,&sessionPresent,&returnCode));
+    IS_TRUE(sessionPresent);
+    IS_TRUE(returnCode == 5);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Codec");
+    test_codec_length();
+    test_codec_connect();
+    test_codec_publish_roundtrip();
+    test_codec_publish_malformed();
+    test_codec_subscribe_and_acks();
+
+    FINISH
+}
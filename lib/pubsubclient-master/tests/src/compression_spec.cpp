@@ -0,0 +1,167 @@
+#include "PubSubClient.h"
+#include "LoopbackBroker.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+int callbackCount = 0;
+uint8_t lastPayload[1024];
+unsigned int lastLength = 0;
+
+void reset_callback() {
+    callbackCount = 0;
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+void drain(LoopbackClient& net, PubSubClientBase& client) {
+    while (net.available()) {
+        client.loop();
+    }
+}
+
+const char* csv = "23.5,41,0,1\n23.5,41,0,1\n23.6,41,0,1\n23.6,42,0,1\n23.6,42,1,1\n23.7,42,1,1\n";
+const char* json = "{\"temp\":23.5,\"hum\":41,\"sw1\":0,\"sw2\":1},{\"temp\":23.6,\"hum\":41,\"sw1\":0,\"sw2\":1}";
+
+int test_compression_round_trip() {
+    IT("restores what it compresses");
+    uint8_t compressed[512];
+    uint8_t restored[512];
+    const char* inputs[] = { csv, json, "", "a", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa" };
+    for (int i = 0; i < 5; i++) {
+        uint32_t length = strlen(inputs[i]);
+        uint32_t clen = MQTTCompression::compress((const uint8_t*)inputs[i],length,compressed,sizeof(compressed));
+        IS_TRUE(clen > 0);
+        IS_TRUE(clen <= MQTTCompression::maxSize(length));
+        IS_TRUE(MQTTCompression::isFramed(compressed,clen));
+        IS_TRUE(MQTTCompression::decompress(compressed,clen,restored,sizeof(restored)) == (int32_t)length);
+        IS_TRUE(memcmp(restored,inputs[i],length) == 0);
+    }
+
+    // Repetitive text shrinks
+    uint32_t clen = MQTTCompression::compress((const uint8_t*)csv,strlen(csv),compressed,sizeof(compressed));
+    IS_TRUE(clen < strlen(csv)*2/3);
+
+    // Random bytes grow by at most the header and a flag byte per 8
+    uint8_t noise[300];
+    uint32_t x = 1;
+    for (unsigned i = 0; i < sizeof(noise); i++) {
+        x = x*1103515245+12345;
+        noise[i] = x >> 16;
+    }
+    clen = MQTTCompression::compress(noise,sizeof(noise),compressed,sizeof(compressed));
+    IS_TRUE(clen > 0 && clen <= MQTTCompression::maxSize(sizeof(noise)));
+    IS_TRUE(MQTTCompression::decompress(compressed,clen,restored,sizeof(restored)) == (int32_t)sizeof(noise));
+    IS_TRUE(memcmp(restored,noise,sizeof(noise)) == 0);
+
+    END_IT
+}
+
+int test_compression_bounds() {
+    IT("stays within the buffers it is given");
+    uint8_t compressed[512];
+    uint8_t restored[512];
+    uint32_t length = strlen(json);
+    uint32_t clen = MQTTCompression::compress((const uint8_t*)json,length,compressed,sizeof(compressed));
+    // Output that does not fit
+    IS_TRUE(MQTTCompression::compress((const uint8_t*)json,length,compressed,clen-1) == 0);
+    IS_TRUE(MQTTCompression::decompress(compressed,clen,restored,length-1) == -1);
+    // Truncated input
+    IS_TRUE(MQTTCompression::decompress(compressed,clen-1,restored,sizeof(restored)) == -1);
+    // A match reaching back before the start
+    uint8_t bad[] = { 0x00, 'Z', 0x00, 0x04, 0x01, 0x00, 0x11 };
+    IS_TRUE(MQTTCompression::decompress(bad,sizeof(bad),restored,sizeof(restored)) == -1);
+    // Not framed
+    IS_TRUE(MQTTCompression::decompress((const uint8_t*)"plain",5,restored,sizeof(restored)) == -1);
+
+    END_IT
+}
+
+int test_compression_publish_subscribe() {
+    IT("compresses publishes and decompresses them for the callback");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net1(broker);
+    LoopbackClient net2(broker);
+    LoopbackClient net3(broker);
+
+    uint8_t scratch[256];
+    PubSubClient publisher(net1);
+    PubSubClient subscriber(net2);
+    PubSubClient plain(net3);
+    publisher.setServer("broker",1883).setCompression(scratch,sizeof(scratch));
+    subscriber.setServer("broker",1883).setCallback(callback).setCompression(scratch,sizeof(scratch));
+    plain.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(publisher.connect("publisher"));
+    IS_TRUE(subscriber.connect("subscriber"));
+    IS_TRUE(plain.connect("plain"));
+    IS_TRUE(subscriber.subscribe("data"));
+    IS_TRUE(plain.subscribe("data"));
+    drain(net2,subscriber);
+    drain(net3,plain);
+
+    // Too long for the 128 byte buffer uncompressed
+    uint32_t length = strlen(csv)*2;
+    uint8_t payload[256];
+    memcpy(payload,csv,strlen(csv));
+    memcpy(payload+strlen(csv),csv,strlen(csv));
+    IS_TRUE(MQTTCodec::packetSize(2+4+length) > publisher.getBufferSize());
+    IS_TRUE(publisher.publish("data",payload,length));
+    IS_TRUE(publisher.getMetrics().compressionSaved > length/2);
+
+    drain(net2,subscriber);
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(lastLength == length);
+    IS_TRUE(memcmp(lastPayload,payload,length) == 0);
+
+    // A client without compression sees the frame
+    drain(net3,plain);
+    IS_TRUE(callbackCount == 2);
+    IS_TRUE(MQTTCompression::isFramed(lastPayload,lastLength));
+
+    // Short payloads that do not shrink go as they are
+    IS_TRUE(publisher.publish("data","ok"));
+    drain(net3,plain);
+    IS_TRUE(callbackCount == 3);
+    IS_TRUE(lastLength == 2);
+
+    END_IT
+}
+
+int test_compression_scratch_too_small() {
+    IT("drops a payload that does not decompress into the scratch buffer");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+
+    uint8_t scratch[16];
+    PubSubClient client(net);
+    client.setServer("broker",1883).setCallback(callback).setCompression(scratch,sizeof(scratch));
+    IS_TRUE(client.connect("client"));
+    IS_TRUE(client.subscribe("data"));
+
+    uint8_t compressed[128];
+    uint32_t clen = MQTTCompression::compress((const uint8_t*)csv,strlen(csv),compressed,sizeof(compressed));
+    broker.publish("data",compressed,clen,0);
+    drain(net,client);
+    IS_TRUE(callbackCount == 0);
+    IS_TRUE(client.getMetrics().decompressFailures == 1);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Compression");
+    test_compression_round_trip();
+    test_compression_bounds();
+    test_compression_publish_subscribe();
+    test_compression_scratch_too_small();
+
+    FINISH
+}
@@ -0,0 +1,293 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+int test_failover_to_next_endpoint() {
+    IT("fails over to the next endpoint in the same connect call");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.refuseHost("primary");
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2).setCallback(callback);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+    IS_TRUE(endpoints[0].failures == 1);
+    IS_TRUE(endpoints[1].failures == 0);
+    IS_TRUE(endpoints[1].connects == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failover_skips_backing_off_endpoint() {
+    IT("prefers a healthy endpoint over one that recently failed");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.refuseHost("primary");
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    client.disconnect();
+
+    // The primary is no longer refused, but is still backing off
+    shimClient.refuseHost(NULL);
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+    IS_TRUE(endpoints[0].failures == 1);
+    IS_TRUE(endpoints[1].connects == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failover_all_endpoints_down() {
+    IT("fails when no endpoint accepts the connection");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(false);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+    IS_TRUE(endpoints[0].failures == 1);
+    IS_TRUE(endpoints[1].failures == 1);
+
+    END_IT
+}
+
+int test_failback_with_probe() {
+    IT("fails back to the primary once a probe reaches it");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.refuseHost("primary");
+    ShimClient probe;
+    probe.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2).setFailback(1,&probe);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+
+    // Once the failback interval has passed the next loop probes the primary
+    advanceMillis(1000);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_FALSE(client.connected());
+    IS_TRUE(endpoints[0].failures == 0);
+
+    shimClient.refuseHost(NULL);
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failback_slow_primary() {
+    IT("fails back to a primary that connects slower than the backup");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.refuseHost("primary");
+    ShimClient probe;
+    probe.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2).setFailback(1,&probe);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+
+    // By score alone the backup would win again
+    endpoints[0].latency = 5*MQTT_FAILOVER_PREFERENCE;
+    endpoints[0].connects = 1;
+    advanceMillis(1000);
+    rc = client.loop();
+    IS_FALSE(rc);
+
+    shimClient.refuseHost(NULL);
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 0);
+
+    // Later connects go back to scoring
+    client.disconnect();
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failback_without_probe() {
+    IT("waits longer between failbacks without a probe while the primary is down");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.refuseHost("primary");
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2).setFailback(10,NULL);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+
+    // One failure: fail back after one interval
+    advanceMillis(10000);
+    rc = client.loop();
+    IS_FALSE(rc);
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+    IS_TRUE(endpoints[0].failures == 2);
+
+    // Two failures: the session is kept for two intervals
+    advanceMillis(10000);
+    IS_TRUE(client.loop());
+    advanceMillis(10000);
+    IS_FALSE(client.loop());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failover_on_server_unavailable() {
+    IT("fails over when a broker answers server unavailable");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte unavailable[] = { 0x20, 0x02, 0x00, 0x03 };
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(unavailable,4);
+    shimClient.respond(connack,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.currentServer() == 1);
+    IS_TRUE(endpoints[0].failures == 1);
+    IS_TRUE(endpoints[1].connects == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_failover_stops_on_refusal() {
+    IT("does not fail over when a broker refuses the credentials");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte refused[] = { 0x20, 0x02, 0x00, 0x04 };
+    shimClient.respond(refused,4);
+
+    MQTTEndpoint endpoints[] = { { "primary", 1883 }, { "backup", 1883 } };
+    PubSubClient client(shimClient);
+    client.setServers(endpoints,2);
+
+    int rc = client.connect((char*)"client_test1",(char*)"user",(char*)"pass");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_BAD_CREDENTIALS);
+    IS_TRUE(client.currentServer() == 0);
+    IS_TRUE(endpoints[0].failures == 0);
+    IS_TRUE(endpoints[1].connects == 0);
+
+    END_IT
+}
+
+int test_failover_state_on_bad_connack() {
+    IT("sets the state when the CONNACK cannot be read");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte refused[] = { 0x20, 0x02, 0x00, 0x05 };
+    byte garbage[] = { 0x30, 0x02, 0x00, 0x00 };
+    shimClient.respond(refused,4);
+    shimClient.respond(garbage,4);
+
+    PubSubClient client(shimClient);
+    client.setServer("localhost",1883);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+    rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Failover");
+    test_failover_to_next_endpoint();
+    test_failover_skips_backing_off_endpoint();
+    test_failover_all_endpoints_down();
+    test_failback_with_probe();
+    test_failback_slow_primary();
+    test_failback_without_probe();
+    test_failover_on_server_unavailable();
+    test_failover_stops_on_refusal();
+    test_failover_state_on_bad_connack();
+
+    FINISH
+}
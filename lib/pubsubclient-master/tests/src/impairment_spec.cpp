@@ -0,0 +1,211 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+bool callback_called = false;
+char lastTopic[1024];
+unsigned int lastLength;
+
+void reset_callback() {
+    callback_called = false;
+    lastTopic[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callback_called = true;
+    strcpy(lastTopic,topic);
+    lastLength = length;
+}
+
+int test_impairment_latency() {
+    IT("waits out the round trip for CONNACK");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.setLatency(200);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getMetrics().handshakeTime == 200);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_impairment_latency_timeout() {
+    IT("times out when the round trip exceeds the socket timeout");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.setLatency(1500);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSocketTimeout(1);
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_TIMEOUT);
+
+    END_IT
+}
+
+int test_impairment_fragmented_read() {
+    IT("reassembles a message delivered in fragments with stalls");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.setSeed(7);
+    shimClient.setFragmentation(3,5);
+    shimClient.setStalls(100,50);
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    uint32_t start = millis();
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic") == 0);
+    IS_TRUE(lastLength == 7);
+    // At least one gap between fragments
+    IS_TRUE(millis() - start >= 5);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_impairment_bandwidth() {
+    IT("receives at the capped bandwidth");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.setBandwidth(1000);
+    byte publish[100];
+    memset(publish,'A',sizeof(publish));
+    byte header[] = {0x30,0x62,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    memcpy(publish,header,sizeof(header));
+    shimClient.respond(publish,sizeof(publish));
+
+    // Nothing is readable until the first byte's worth of time has passed
+    uint32_t start = millis();
+    while (!callback_called && millis() - start < 1000) {
+        advanceMillis(1);
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_TRUE(callback_called);
+    IS_TRUE(lastLength == 91);
+    // 100 bytes at 1000 bytes per second
+    IS_TRUE(millis() - start >= 99);
+    IS_TRUE(millis() - start <= 101);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_impairment_short_write() {
+    IT("fails a publish that is only partly written");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.setShortWrites(1000);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+
+    END_IT
+}
+
+// Publishes count messages over a link that drops at random, reconnecting
+// whenever it does. Returns the virtual time it took.
+uint32_t publish_through_disconnects(uint32_t seed, int count, uint32_t* drops) {
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.setSeed(seed);
+    shimClient.setLatency(200);
+    shimClient.setDisconnects(20);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSocketTimeout(1);
+
+    uint32_t start = millis();
+    int sent = 0;
+    while (sent < count) {
+        if (!client.connected()) {
+            shimClient.respond(connack,4);
+            client.connect((char*)"client_test1");
+            continue;
+        }
+        if (client.publish((char*)"topic",(char*)"payload")) {
+            sent++;
+        }
+        advanceMillis(10);
+    }
+    *drops = shimClient.disconnectCount();
+    return millis() - start;
+}
+
+int test_impairment_recovers_deterministically() {
+    IT("recovers from random disconnects the same way for the same seed");
+    uint32_t drops1, drops2, drops3;
+    uint32_t time1 = publish_through_disconnects(42,200,&drops1);
+    uint32_t time2 = publish_through_disconnects(42,200,&drops2);
+    uint32_t time3 = publish_through_disconnects(43,200,&drops3);
+
+    IS_TRUE(drops1 > 0);
+    IS_TRUE(drops1 == drops2);
+    IS_TRUE(time1 == time2);
+    // Each drop costs at least one 200ms handshake on top of 200 publishes
+    IS_TRUE(time1 >= 200*10 + drops1*200);
+    IS_TRUE(drops3 > 0);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Impairment");
+    test_impairment_latency();
+    test_impairment_latency_timeout();
+    test_impairment_fragmented_read();
+    test_impairment_bandwidth();
+    test_impairment_short_write();
+    test_impairment_recovers_deterministically();
+
+    FINISH
+}
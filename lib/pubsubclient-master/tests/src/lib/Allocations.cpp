@@ -0,0 +1,50 @@
+#include "Allocations.h"
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ALLOCATIONS_UNTRACKED
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define ALLOCATIONS_UNTRACKED
+#endif
+
+static unsigned long allocations = 0;
+
+unsigned long allocationCount() {
+    return allocations;
+}
+
+#if !defined(ALLOCATIONS_UNTRACKED) && defined(__linux__)
+// glibc's own entry points; everything else, operator new included, comes through these
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+
+    void* malloc(size_t size) {
+        allocations++;
+        return __libc_malloc(size);
+    }
+    void* calloc(size_t count, size_t size) {
+        allocations++;
+        return __libc_calloc(count,size);
+    }
+    void* realloc(void* p, size_t size) {
+        allocations++;
+        return __libc_realloc(p,size);
+    }
+}
+#endif
+
+AllocationCounter::AllocationCounter() {
+    reset();
+}
+
+unsigned long AllocationCounter::count() {
+    return allocations-this->start;
+}
+
+void AllocationCounter::reset() {
+    this->start = allocations;
+}
@@ -0,0 +1,27 @@
+#include "Arduino.h"
+
+static uint64_t clockMicros = 0;
+
+extern "C" {
+    uint32_t millis(void) {
+       return clockMicros/1000;
+    }
+    uint32_t micros(void) {
+       return clockMicros++;
+    }
+    void yield(void) {
+       clockMicros += 1000;
+    }
+}
+
+void advanceMillis(uint32_t ms) {
+    clockMicros += (uint64_t)ms*1000;
+}
+
+void advanceMicros(uint32_t us) {
+    clockMicros += us;
+}
+
+void resetClock() {
+    clockMicros = 0;
+}
@@ -16,11 +16,19 @@ extern "C"{
     extern void setup( void ) ;
     extern void loop( void ) ;
     uint32_t millis( void );
+    uint32_t micros( void );
+    void yield( void );
 }
 
+// The shim runs on a virtual clock that starts at zero and only moves when
+// a test advances it, so timeouts can be exercised without waiting for them.
+// yield() - called by the library while it waits for data - advances it by
+// 1ms, and each call to micros() by 1us so elapsed times are never zero.
+void advanceMillis(uint32_t ms);
+void advanceMicros(uint32_t us);
+void resetClock();
+
 #define PROGMEM
 #define pgm_read_byte_near(x) *(x)
 
-#define yield(x) {}
-
 #endif // Arduino_h
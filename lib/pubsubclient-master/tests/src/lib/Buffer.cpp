@@ -3,16 +3,14 @@
 
 Buffer::Buffer() {
     this->pos = 0;
-    this->length = 0;
 }
 
 Buffer::Buffer(uint8_t* buf, size_t size) {
     this->pos = 0;
-    this->length = 0;
     this->add(buf,size);
 }
 bool Buffer::available() {
-    return this->pos < this->length;
+    return this->pos < this->buffer.size();
 }
 
 uint8_t Buffer::next() {
@@ -26,9 +24,20 @@ void Buffer::reset() {
     this->pos = 0;
 }
 
+// Bytes added but not yet consumed
+size_t Buffer::size() {
+    return this->buffer.size()-this->pos;
+}
+
 void Buffer::add(uint8_t* buf, size_t size) {
-    uint16_t i = 0;
-    for (;i<size;i++) {
-        this->buffer[this->length++] = buf[i];
+    if (this->pos == this->buffer.size()) {
+        // Everything added so far has been consumed; reuse the space
+        this->pos = 0;
+        this->buffer.clear();
+    } else if (this->pos > 4096 && this->pos > this->buffer.size()/2) {
+        // Drop the consumed front so long sessions stay bounded
+        this->buffer.erase(this->buffer.begin(),this->buffer.begin()+this->pos);
+        this->pos = 0;
     }
+    this->buffer.insert(this->buffer.end(),buf,buf+size);
 }
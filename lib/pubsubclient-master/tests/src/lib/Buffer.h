@@ -2,12 +2,13 @@
 #define buffer_h
 
 #include "Arduino.h"
+#include <vector>
 
+// A byte FIFO that grows as needed; consumed bytes are reclaimed as it goes
 class Buffer {
 private:
-    uint8_t buffer[1024];
-    uint16_t pos;
-    uint16_t length;
+    std::vector<uint8_t> buffer;
+    size_t pos;
     
 public:
     Buffer();
@@ -16,6 +17,7 @@ public:
     virtual bool available();
     virtual uint8_t next();
     virtual void reset();
+    virtual size_t size();
     
     virtual void add(uint8_t* buf, size_t size);
 };
@@ -0,0 +1,239 @@
+#include "LoopbackBroker.h"
+#include "PubSubClient.h"
+#include "trace.h"
+#include <algorithm>
+
+LoopbackClient::LoopbackClient(LoopbackBroker& broker) {
+    this->broker = &broker;
+    this->inbound = new Buffer();
+    this->_connected = false;
+}
+
+LoopbackClient::~LoopbackClient() {
+    stop();
+    delete this->inbound;
+}
+
+int LoopbackClient::connect(IPAddress ip, uint16_t port) {
+    return connect("loopback",port);
+}
+int LoopbackClient::connect(const char *host, uint16_t port) {
+    stop();
+    this->_connected = true;
+    this->broker->attach(this);
+    return 1;
+}
+size_t LoopbackClient::write(uint8_t b) {
+    return write(&b,1);
+}
+size_t LoopbackClient::write(const uint8_t *buf, size_t size) {
+    if (!this->_connected) {
+        return 0;
+    }
+    this->outbound.insert(this->outbound.end(),buf,buf+size);
+    this->broker->receive(this);
+    return size;
+}
+int LoopbackClient::available() {
+    return this->inbound->size();
+}
+int LoopbackClient::read() {
+    if (!this->inbound->available()) {
+        return -1;
+    }
+    return this->inbound->next();
+}
+int LoopbackClient::read(uint8_t *buf, size_t size) {
+    size_t i = 0;
+    for (;i<size && this->inbound->available();i++) {
+        buf[i] = this->inbound->next();
+    }
+    return i;
+}
+int LoopbackClient::peek() { return 0; }
+void LoopbackClient::flush() {}
+void LoopbackClient::stop() {
+    if (this->_connected) {
+        this->_connected = false;
+        this->broker->detach(this);
+    }
+    this->outbound.clear();
+}
+uint8_t LoopbackClient::connected() { return this->_connected; }
+LoopbackClient::operator bool() { return true; }
+
+
+LoopbackBroker::LoopbackBroker() {
+    this->nextMsgId = 0;
+    this->received = 0;
+    this->delivered = 0;
+    this->acked = 0;
+    this->errors = 0;
+}
+
+size_t LoopbackBroker::connections() {
+    return this->clients.size();
+}
+
+void LoopbackBroker::attach(LoopbackClient* client) {
+    this->clients.push_back(client);
+}
+
+void LoopbackBroker::detach(LoopbackClient* client) {
+    this->clients.erase(std::remove(this->clients.begin(),this->clients.end(),client),this->clients.end());
+    for (size_t i = 0; i < this->subscriptions.size();) {
+        if (this->subscriptions[i].client == client) {
+            this->subscriptions.erase(this->subscriptions.begin()+i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Handles every complete packet the client has written so far
+void LoopbackBroker::receive(LoopbackClient* client) {
+    std::vector<uint8_t>& out = client->outbound;
+    while (client->_connected && out.size() >= 2) {
+        uint32_t length = 0;
+        int8_t llen = MQTTCodec::decodeLength(out.data()+1,out.size()-1,&length);
+        if (llen < 0) {
+            this->errors++;
+            client->stop();
+            return;
+        }
+        size_t pos = 1+llen;
+        if (llen == 0 || out.size() < pos+length) {
+            return;
+        }
+        std::vector<uint8_t> packet(out.begin(),out.begin()+pos+length);
+        out.erase(out.begin(),out.begin()+pos+length);
+        handle(client,packet.data(),pos,length);
+    }
+}
+
+void LoopbackBroker::handle(LoopbackClient* client, uint8_t* packet, size_t headerLength, size_t length) {
+    uint8_t type = packet[0]&0xF0;
+    uint8_t* body = packet+headerLength;
+    TRACE("broker <- " << std::hex << (unsigned int)type << std::dec << " [" << length << "]\n");
+
+    if (type == MQTTCONNECT) {
+        uint8_t connack[] = { 0x00, 0x00 };
+        send(client,MQTTCONNACK,connack,2);
+    } else if (type == MQTTPUBLISH) {
+        MQTTPublishView publish;
+        if (!MQTTCodec::decodePublish(packet,headerLength+length,headerLength-1,&publish) || publish.qos > 1) {
+            this->errors++;
+            client->stop();
+            return;
+        }
+        this->received++;
+        if (publish.qos == 1) {
+            uint8_t puback[4];
+            MQTTCodec::encodeAck(puback,sizeof(puback),MQTTPUBACK,publish.msgId);
+            client->inbound->add(puback,4);
+        }
+        deliver(std::string((char*)packet+publish.topicOffset,publish.topicLength),packet+publish.payloadOffset,publish.payloadLength,publish.qos);
+    } else if (type == MQTTPUBACK) {
+        this->acked++;
+    } else if (type == MQTTSUBSCRIBE || type == MQTTUNSUBSCRIBE) {
+        if (length < 2) {
+            this->errors++;
+            client->stop();
+            return;
+        }
+        std::vector<uint8_t> ack(body,body+2);
+        size_t pos = 2;
+        while (pos+2 <= length) {
+            size_t filterLength = (body[pos]<<8)+body[pos+1];
+            pos += 2;
+            if (pos+filterLength+(type == MQTTSUBSCRIBE?1:0) > length) {
+                this->errors++;
+                client->stop();
+                return;
+            }
+            std::string filter((char*)body+pos,filterLength);
+            pos += filterLength;
+            for (size_t i = 0; i < this->subscriptions.size();) {
+                if (this->subscriptions[i].client == client && this->subscriptions[i].filter == filter) {
+                    this->subscriptions.erase(this->subscriptions.begin()+i);
+                } else {
+                    i++;
+                }
+            }
+            if (type == MQTTSUBSCRIBE) {
+                uint8_t qos = body[pos++] > 0 ? 1 : 0;
+                Subscription s = { client, filter, qos };
+                this->subscriptions.push_back(s);
+                ack.push_back(qos);
+            }
+        }
+        send(client,type == MQTTSUBSCRIBE ? MQTTSUBACK : MQTTUNSUBACK,ack.data(),ack.size());
+    } else if (type == MQTTPINGREQ) {
+        send(client,MQTTPINGRESP,NULL,0);
+    } else if (type == MQTTDISCONNECT) {
+        client->stop();
+    }
+}
+
+void LoopbackBroker::send(LoopbackClient* client, uint8_t header, const uint8_t* body, size_t length) {
+    uint8_t fixed[MQTT_MAX_HEADER_SIZE];
+    fixed[0] = header;
+    uint8_t llen = MQTTCodec::encodeLength(fixed+1,length);
+    client->inbound->add(fixed,1+llen);
+    if (length > 0) {
+        client->inbound->add((uint8_t*)body,length);
+    }
+}
+
+void LoopbackBroker::deliver(const std::string& topic, const uint8_t* payload, size_t length, uint8_t qos) {
+    for (size_t i = 0; i < this->subscriptions.size(); i++) {
+        Subscription& s = this->subscriptions[i];
+        if (!matches(s.filter,topic)) {
+            continue;
+        }
+        uint8_t q = std::min(qos,s.qos);
+        std::vector<uint8_t> body;
+        body.push_back(topic.size() >> 8);
+        body.push_back(topic.size() & 0xFF);
+        body.insert(body.end(),topic.begin(),topic.end());
+        if (q == 1) {
+            if (++this->nextMsgId == 0) {
+                this->nextMsgId = 1;
+            }
+            body.push_back(this->nextMsgId >> 8);
+            body.push_back(this->nextMsgId & 0xFF);
+        }
+        body.insert(body.end(),payload,payload+length);
+        send(s.client,MQTTPUBLISH|(q<<1),body.data(),body.size());
+        this->delivered++;
+    }
+}
+
+void LoopbackBroker::publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos) {
+    deliver(std::string(topic),payload,length,qos);
+}
+
+// MQTT topic matching: '+' matches one level, a trailing '#' any number
+bool LoopbackBroker::matches(const std::string& filter, const std::string& topic) {
+    size_t f = 0;
+    size_t t = 0;
+    while (f < filter.size()) {
+        if (filter[f] == '#') {
+            return true;
+        }
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') {
+                t++;
+            }
+            f++;
+        } else {
+            if (t >= topic.size() || filter[f] != topic[t]) {
+                // "a/#" also matches "a"
+                return t == topic.size() && filter.compare(f,2,"/#") == 0;
+            }
+            f++;
+            t++;
+        }
+    }
+    return t == topic.size();
+}
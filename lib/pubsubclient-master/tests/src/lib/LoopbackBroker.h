@@ -0,0 +1,81 @@
+#ifndef loopbackbroker_h
+#define loopbackbroker_h
+
+#include "Arduino.h"
+#include "Client.h"
+#include "Buffer.h"
+#include <string>
+#include <vector>
+
+class LoopbackBroker;
+
+// A Client connected to a LoopbackBroker in the same process. Whatever the
+// client writes is handled by the broker straight away; the broker's
+// responses wait in an inbound buffer until the client reads them.
+class LoopbackClient : public Client {
+private:
+    LoopbackBroker* broker;
+    Buffer* inbound;
+    std::vector<uint8_t> outbound;
+    bool _connected;
+
+    friend class LoopbackBroker;
+
+public:
+    LoopbackClient(LoopbackBroker& broker);
+    virtual ~LoopbackClient();
+
+    virtual int connect(IPAddress ip, uint16_t port);
+    virtual int connect(const char *host, uint16_t port);
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush();
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool();
+};
+
+// A minimal MQTT 3.1.1 broker for driving many clients without a network:
+// CONNECT, SUBSCRIBE/UNSUBSCRIBE with + and # wildcards, PUBLISH fan-out at
+// QoS 0 and 1 (downgraded to the subscription's QoS), PUBACK and PINGREQ.
+// No retained messages, wills or persistent sessions.
+class LoopbackBroker {
+private:
+    struct Subscription {
+        LoopbackClient* client;
+        std::string filter;
+        uint8_t qos;
+    };
+    std::vector<LoopbackClient*> clients;
+    std::vector<Subscription> subscriptions;
+    uint16_t nextMsgId;
+
+    void attach(LoopbackClient* client);
+    void detach(LoopbackClient* client);
+    void receive(LoopbackClient* client);
+    void handle(LoopbackClient* client, uint8_t* packet, size_t headerLength, size_t length);
+    void send(LoopbackClient* client, uint8_t header, const uint8_t* body, size_t length);
+    void deliver(const std::string& topic, const uint8_t* payload, size_t length, uint8_t qos);
+
+    friend class LoopbackClient;
+
+public:
+    LoopbackBroker();
+
+    // Publishes as if another client had, e.g. to deliver at QoS 1
+    void publish(const char* topic, const uint8_t* payload, size_t length, uint8_t qos);
+
+    size_t connections();
+    static bool matches(const std::string& filter, const std::string& topic);
+
+    uint32_t received;    // PUBLISH packets from clients
+    uint32_t delivered;   // PUBLISH packets sent to subscribers
+    uint32_t acked;       // PUBACKs for QoS 1 deliveries
+    uint32_t errors;      // malformed packets; the connection is closed
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "Replayer.h"
+#include "trace.h"
+#include <time.h>
+
+// loop() is timed against the host clock; the shim's millis()/micros() are virtual
+static uint32_t hostMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+Replayer::Replayer(const uint8_t* capture, size_t length) {
+    this->capture = capture;
+    this->length = length;
+    this->realTime = false;
+    this->packets = 0;
+    this->bytes = 0;
+    this->totalMicros = 0;
+    this->maxMicros = 0;
+}
+
+void Replayer::setRealTime(bool b) {
+    this->realTime = b;
+}
+
+bool Replayer::run(ShimClient* shimClient, PubSubClientBase* client) {
+    size_t pos = 0;
+    bool first = true;
+    uint32_t firstRecorded = 0;
+    uint32_t started = micros();
+
+    while (pos < this->length) {
+        if (pos+MQTT_RECORD_HEADER_SIZE > this->length) {
+            return false;
+        }
+        const uint8_t* record = this->capture+pos;
+        uint8_t flags = record[0];
+        uint32_t recorded = ((uint32_t)record[1]<<24)|((uint32_t)record[2]<<16)|((uint32_t)record[3]<<8)|record[4];
+        uint16_t packetLength = (record[5]<<8)|record[6];
+        const uint8_t* packet = record+MQTT_RECORD_HEADER_SIZE;
+        pos += MQTT_RECORD_HEADER_SIZE+packetLength;
+        if (pos > this->length) {
+            return false;
+        }
+        if (first) {
+            firstRecorded = recorded;
+            first = false;
+        }
+        if ((flags & MQTT_RECORD_OUTBOUND) || (flags & MQTT_RECORD_TRUNCATED) || packetLength == 0 ||
+            (packet[0]&0xF0) == MQTTCONNACK) {
+            continue;
+        }
+
+        if (this->realTime) {
+            uint32_t due = (recorded-firstRecorded)*1000;
+            uint32_t now = micros()-started;
+            if (due > now) {
+                advanceMicros(due-now);
+            }
+        }
+
+        TRACE("replay [" << packetLength << "]\n");
+        shimClient->respond((uint8_t*)packet,packetLength);
+        while (shimClient->available()) {
+            uint32_t start = hostMicros();
+            bool rc = client->loop();
+            uint32_t elapsed = hostMicros()-start;
+            this->totalMicros += elapsed;
+            if (elapsed > this->maxMicros) {
+                this->maxMicros = elapsed;
+            }
+            if (!rc) {
+                return false;
+            }
+        }
+        this->packets++;
+        this->bytes += packetLength;
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef replayer_h
+#define replayer_h
+
+#include "Arduino.h"
+#include "ShimClient.h"
+#include "PubSubClient.h"
+
+// Feeds a capture made with PubSubClient::setRecorder back through a client.
+// Inbound records are handed to the ShimClient and consumed with loop(),
+// either back to back or with the virtual clock advanced to keep the
+// recorded spacing between them. Outbound records and CONNACKs are skipped;
+// the client is expected to be connected before the replay starts.
+class Replayer {
+private:
+    const uint8_t* capture;
+    size_t length;
+    bool realTime;
+
+public:
+    Replayer(const uint8_t* capture, size_t length);
+
+    void setRealTime(bool b);
+
+    // Replays every inbound record. Returns false if the capture is
+    // malformed or the client drops the connection part way through.
+    bool run(ShimClient* shimClient, PubSubClientBase* client);
+
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t totalMicros;   // host time spent inside loop()
+    uint32_t maxMicros;     // slowest single loop()
+};
+
+#endif
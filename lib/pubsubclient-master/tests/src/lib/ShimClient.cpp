@@ -2,13 +2,6 @@
 #include "trace.h"
 #include <iostream>
 #include <Arduino.h>
-#include <ctime>
-
-extern "C" {
-    uint32_t millis(void) {
-       return time(0)*1000;
-    }
-}
 
 ShimClient::ShimClient() {
     this->responseBuffer = new Buffer();
@@ -19,6 +12,27 @@ ShimClient::ShimClient() {
     this->expectAnything = true;
     this->_received = 0;
     this->_expectedPort = 0;
+    this->_refusedHost = NULL;
+    this->seed = 1;
+    this->latency = 0;
+    this->bandwidth = 0;
+    this->bandwidthLevel = 0;
+    this->bandwidthLast = 0;
+    this->fragmentMax = 0;
+    this->fragmentGap = 0;
+    this->fragmentLeft = 0;
+    this->fragmentAt = 0;
+    this->shortWrites = 0;
+    this->disconnects = 0;
+    this->stalls = 0;
+    this->stallTime = 0;
+    this->stalledUntil = 0;
+    this->_dropped = 0;
+}
+
+ShimClient::~ShimClient() {
+    delete this->responseBuffer;
+    delete this->expectBuffer;
 }
 
 int ShimClient::connect(IPAddress ip, uint16_t port) {
@@ -38,6 +52,9 @@ int ShimClient::connect(IPAddress ip, uint16_t port) {
     return this->_connected;
 }
 int ShimClient::connect(const char *host, uint16_t port)  {
+    if (this->_refusedHost != NULL && strcmp(host,this->_refusedHost) == 0) {
+        return 0;
+    }
     if (this->_allowConnect) {
         this->_connected = true;
     }
@@ -55,6 +72,9 @@ int ShimClient::connect(const char *host, uint16_t port)  {
     return this->_connected;
 }
 size_t ShimClient::write(uint8_t b)  {
+    if (dropped()) {
+        return 0;
+    }
     this->_received += 1;
     TRACE(std::hex << (unsigned int)b);
     if (!this->expectAnything) {
@@ -72,6 +92,12 @@ size_t ShimClient::write(uint8_t b)  {
     return 1;
 }
 size_t ShimClient::write(const uint8_t *buf, size_t size)  {
+    if (dropped()) {
+        return 0;
+    }
+    if (size > 0 && chance(this->shortWrites)) {
+        size = random() % size;
+    }
     this->_received += size;
     TRACE( "[" << std::dec << (unsigned int)(size) << "] ");
     uint16_t i=0;
@@ -97,15 +123,22 @@ size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     return size;
 }
 int ShimClient::available()  {
-    return this->responseBuffer->available();
+    return readable();
+}
+int ShimClient::read()  {
+    if (dropped() || !readable()) {
+        return -1;
+    }
+    uint8_t b = this->responseBuffer->next();
+    consumed();
+    return b;
 }
-int ShimClient::read()  { return this->responseBuffer->next(); }
 int ShimClient::read(uint8_t *buf, size_t size) {
     uint16_t i = 0;
-    for (;i<size;i++) {
+    for (;i<size && readable();i++) {
         buf[i] = this->read();
     }
-    return size;
+    return i;
 }
 int ShimClient::peek()  { return 0; }
 void ShimClient::flush() {}
@@ -117,7 +150,14 @@ ShimClient::operator bool() { return true; }
 
 
 ShimClient* ShimClient::respond(uint8_t *buf, size_t size) {
-    this->responseBuffer->add(buf,size);
+    if (this->latency == 0 && this->pending.empty()) {
+        this->responseBuffer->add(buf,size);
+    } else {
+        Pending p;
+        p.due = millis()+this->latency;
+        p.data.assign(buf,buf+size);
+        this->pending.push_back(p);
+    }
     return this;
 }
 
@@ -133,6 +173,9 @@ void ShimClient::setConnected(bool b) {
 void ShimClient::setAllowConnect(bool b) {
     this->_allowConnect = b;
 }
+void ShimClient::refuseHost(const char *host) {
+    this->_refusedHost = host;
+}
 
 bool ShimClient::error() {
     return this->_error;
@@ -151,3 +194,118 @@ void ShimClient::expectConnect(const char *host, uint16_t port) {
     this->_expectedHost = host;
     this->_expectedPort = port;
 }
+
+void ShimClient::setSeed(uint32_t seed) {
+    this->seed = seed ? seed : 1;
+}
+
+void ShimClient::setLatency(uint32_t ms) {
+    this->latency = ms;
+}
+
+void ShimClient::setBandwidth(uint32_t bytesPerSecond) {
+    this->bandwidth = bytesPerSecond;
+    this->bandwidthLevel = 0;
+    this->bandwidthLast = millis();
+}
+
+void ShimClient::setFragmentation(uint16_t maxBytes, uint32_t gapMs) {
+    this->fragmentMax = maxBytes;
+    this->fragmentGap = gapMs;
+    this->fragmentLeft = 0;
+    this->fragmentAt = millis();
+}
+
+void ShimClient::setShortWrites(uint16_t perMille) {
+    this->shortWrites = perMille;
+}
+
+void ShimClient::setDisconnects(uint16_t perMille) {
+    this->disconnects = perMille;
+}
+
+void ShimClient::setStalls(uint16_t perMille, uint32_t ms) {
+    this->stalls = perMille;
+    this->stallTime = ms;
+}
+
+uint32_t ShimClient::disconnectCount() {
+    return this->_dropped;
+}
+
+// xorshift32
+uint32_t ShimClient::random() {
+    this->seed ^= this->seed << 13;
+    this->seed ^= this->seed >> 17;
+    this->seed ^= this->seed << 5;
+    return this->seed;
+}
+
+bool ShimClient::chance(uint16_t perMille) {
+    return perMille != 0 && (random() % 1000) < perMille;
+}
+
+// Drops the connection, and anything in flight, when a disconnect is due
+bool ShimClient::dropped() {
+    if (!this->_connected) {
+        return true;
+    }
+    if (!chance(this->disconnects)) {
+        return false;
+    }
+    TRACE("disconnect\n");
+    this->_connected = false;
+    this->_dropped++;
+    this->pending.clear();
+    while (this->responseBuffer->available()) {
+        this->responseBuffer->next();
+    }
+    return true;
+}
+
+// Whether a byte can be read now, after releasing responses whose latency has passed
+bool ShimClient::readable() {
+    uint32_t now = millis();
+    while (!this->pending.empty() && (int32_t)(now - this->pending.front().due) >= 0) {
+        Pending& p = this->pending.front();
+        this->responseBuffer->add(p.data.data(),p.data.size());
+        this->pending.pop_front();
+    }
+    if (!this->responseBuffer->available()) {
+        return false;
+    }
+    if ((int32_t)(now - this->stalledUntil) < 0) {
+        return false;
+    }
+    if (this->fragmentMax != 0 && this->fragmentLeft == 0) {
+        if ((int32_t)(now - this->fragmentAt) < 0) {
+            return false;
+        }
+        this->fragmentLeft = 1 + random() % this->fragmentMax;
+    }
+    if (this->bandwidth != 0) {
+        // Level is in thousandths of a byte, with at most a second's worth banked
+        this->bandwidthLevel += (int64_t)this->bandwidth*(now - this->bandwidthLast);
+        this->bandwidthLast = now;
+        if (this->bandwidthLevel > (int64_t)this->bandwidth*1000) {
+            this->bandwidthLevel = (int64_t)this->bandwidth*1000;
+        }
+        if (this->bandwidthLevel < 1000) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Accounts for one byte read
+void ShimClient::consumed() {
+    if (this->bandwidth != 0) {
+        this->bandwidthLevel -= 1000;
+    }
+    if (this->fragmentMax != 0 && --this->fragmentLeft == 0) {
+        this->fragmentAt = millis()+this->fragmentGap;
+    }
+    if (chance(this->stalls)) {
+        this->stalledUntil = millis()+this->stallTime;
+    }
+}
@@ -5,6 +5,8 @@
 #include "Client.h"
 #include "IPAddress.h"
 #include "Buffer.h"
+#include <deque>
+#include <vector>
 
 
 class ShimClient : public Client {
@@ -19,9 +21,40 @@ private:
     IPAddress _expectedIP;
     uint16_t _expectedPort;
     const char* _expectedHost;
-    
+    const char* _refusedHost;
+
+    // Network impairments, all driven by the (virtual) millis() clock and a
+    // seeded generator so every run of a scenario is identical
+    struct Pending {
+        uint32_t due;
+        std::vector<uint8_t> data;
+    };
+    std::deque<Pending> pending;
+    uint32_t seed;
+    uint32_t latency;
+    uint32_t bandwidth;
+    int64_t bandwidthLevel;
+    uint32_t bandwidthLast;
+    uint16_t fragmentMax;
+    uint32_t fragmentGap;
+    uint16_t fragmentLeft;
+    uint32_t fragmentAt;
+    uint16_t shortWrites;
+    uint16_t disconnects;
+    uint16_t stalls;
+    uint32_t stallTime;
+    uint32_t stalledUntil;
+    uint32_t _dropped;
+
+    uint32_t random();
+    bool chance(uint16_t perMille);
+    bool readable();
+    void consumed();
+    bool dropped();
+
 public:
   ShimClient();
+  virtual ~ShimClient();
   virtual int connect(IPAddress ip, uint16_t port);
   virtual int connect(const char *host, uint16_t port);
   virtual size_t write(uint8_t);
@@ -45,7 +78,21 @@ public:
   virtual bool error();
   
   virtual void setAllowConnect(bool b);
+  virtual void refuseHost(const char *host);
   virtual void setConnected(bool b);
+
+  // Impairments: responses become readable 'ms' after respond(), reads are
+  // capped to bytesPerSecond (0 = unlimited) and arrive in random chunks of
+  // 1..maxBytes separated by gapMs. Short writes, disconnects and stalls
+  // happen with the given chance per thousand calls.
+  virtual void setSeed(uint32_t seed);
+  virtual void setLatency(uint32_t ms);
+  virtual void setBandwidth(uint32_t bytesPerSecond);
+  virtual void setFragmentation(uint16_t maxBytes, uint32_t gapMs);
+  virtual void setShortWrites(uint16_t perMille);
+  virtual void setDisconnects(uint16_t perMille);
+  virtual void setStalls(uint16_t perMille, uint32_t ms);
+  virtual uint32_t disconnectCount();
 };
 
 #endif
@@ -9,6 +9,10 @@ Stream::Stream() {
     this->_written = 0;
 }
 
+Stream::~Stream() {
+    delete this->expectBuffer;
+}
+
 size_t Stream::write(uint8_t b)  {
     this->_written++;
     TRACE(std::hex << (unsigned int)b);
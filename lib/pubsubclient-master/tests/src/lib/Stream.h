@@ -12,6 +12,7 @@ private:
 
 public:
     Stream();
+    virtual ~Stream();
     virtual size_t write(uint8_t);
     
     virtual bool error();
@@ -0,0 +1,75 @@
+#include "PubSubClient.h"
+#include "LoopbackBroker.h"
+#include <stdio.h>
+#include <chrono>
+
+// End-to-end throughput and latency through the in-process broker: one
+// publisher, a varying number of subscribers. Prints one JSON object per result.
+
+typedef std::chrono::steady_clock benchclock;
+
+static unsigned long delivered = 0;
+
+void callback(char* topic, uint8_t* payload, unsigned int length) {
+    delivered++;
+}
+
+static void run(int subscribers, unsigned payloadLength) {
+    LoopbackBroker broker;
+    LoopbackClient publisherNet(broker);
+    PubSubClient publisher(publisherNet);
+    publisher.setServer("broker",1883);
+    publisher.connect("publisher");
+
+    std::vector<LoopbackClient*> nets;
+    std::vector<PubSubClient*> clients;
+    char id[16];
+    for (int i = 0; i < subscribers; i++) {
+        nets.push_back(new LoopbackClient(broker));
+        clients.push_back(new PubSubClient(*nets[i]));
+        clients[i]->setServer("broker",1883).setCallback(callback);
+        sprintf(id,"sub%d",i);
+        clients[i]->connect(id);
+        clients[i]->subscribe("bench/topic");
+        clients[i]->loop();
+    }
+
+    uint8_t payload[100];
+    memset(payload,'x',sizeof(payload));
+    unsigned long messages = 0;
+    double maxLatency = 0;
+    delivered = 0;
+    benchclock::time_point start = benchclock::now();
+    benchclock::time_point end;
+    do {
+        benchclock::time_point sent = benchclock::now();
+        publisher.publish("bench/topic",payload,payloadLength);
+        for (int i = 0; i < subscribers; i++) {
+            clients[i]->loop();
+        }
+        end = benchclock::now();
+        double latency = std::chrono::duration_cast<std::chrono::nanoseconds>(end - sent).count();
+        if (latency > maxLatency) {
+            maxLatency = latency;
+        }
+        messages++;
+    } while (end - start < std::chrono::milliseconds(200));
+
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    printf("{\"bench\":\"loopback\",\"subscribers\":%d,\"payload\":%u,\"messages\":%lu,\"delivered\":%lu,\"deliveries_per_s\":%.0f,\"avg_latency_ns\":%.0f,\"max_latency_ns\":%.0f}\n",
+           subscribers,payloadLength,messages,delivered,delivered/(ns/1e9),ns/messages,maxLatency);
+
+    for (int i = 0; i < subscribers; i++) {
+        delete clients[i];
+        delete nets[i];
+    }
+}
+
+int main() {
+    static const int subscribers[] = { 1, 10, 100 };
+    for (unsigned s = 0; s < sizeof(subscribers)/sizeof(subscribers[0]); s++) {
+        run(subscribers[s],16);
+        run(subscribers[s],100);
+    }
+    return delivered > 0 ? 0 : 1;
+}
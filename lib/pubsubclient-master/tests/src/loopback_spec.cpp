@@ -0,0 +1,173 @@
+#include "PubSubClient.h"
+#include "LoopbackBroker.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+int callbackCount = 0;
+char lastTopic[1024];
+unsigned int lastLength = 0;
+
+void reset_callback() {
+    callbackCount = 0;
+    lastTopic[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+    strcpy(lastTopic,topic);
+    lastLength = length;
+}
+
+int test_loopback_publish_subscribe() {
+    IT("delivers a publish from one client to another");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net1(broker);
+    LoopbackClient net2(broker);
+
+    PubSubClient publisher(net1);
+    PubSubClient subscriber(net2);
+    publisher.setServer("broker",1883);
+    subscriber.setServer("broker",1883).setCallback(callback);
+
+    IS_TRUE(publisher.connect("publisher"));
+    IS_TRUE(subscriber.connect("subscriber"));
+    IS_TRUE(broker.connections() == 2);
+
+    IS_TRUE(subscriber.subscribe("sensors/+/temp"));
+    IS_TRUE(subscriber.loop());
+    IS_TRUE(subscriber.pendingAcks() == 0);
+
+    IS_TRUE(publisher.publish("sensors/kitchen/temp","21.5"));
+    IS_TRUE(publisher.publish("sensors/kitchen/humidity","40"));
+    while (net2.available()) {
+        IS_TRUE(subscriber.loop());
+    }
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(strcmp(lastTopic,"sensors/kitchen/temp") == 0);
+    IS_TRUE(lastLength == 4);
+    IS_TRUE(broker.received == 2);
+    IS_TRUE(broker.delivered == 1);
+    IS_TRUE(broker.errors == 0);
+
+    publisher.disconnect();
+    IS_TRUE(broker.connections() == 1);
+
+    END_IT
+}
+
+int test_loopback_fan_out() {
+    IT("fans a publish out to many clients");
+    reset_callback();
+    const int count = 100;
+    LoopbackBroker broker;
+    LoopbackClient* nets[count];
+    PubSubClient* clients[count];
+    char id[16];
+    for (int i = 0; i < count; i++) {
+        nets[i] = new LoopbackClient(broker);
+        clients[i] = new PubSubClient(*nets[i]);
+        clients[i]->setServer("broker",1883).setCallback(callback);
+        sprintf(id,"client%d",i);
+        IS_TRUE(clients[i]->connect(id));
+        IS_TRUE(clients[i]->subscribe("fan/#"));
+    }
+
+    for (int m = 0; m < 10; m++) {
+        IS_TRUE(clients[m]->publish("fan/out","payload"));
+        for (int i = 0; i < count; i++) {
+            while (nets[i]->available()) {
+                IS_TRUE(clients[i]->loop());
+            }
+        }
+    }
+    IS_TRUE(callbackCount == 10*count);
+    IS_TRUE(broker.delivered == 10*count);
+
+    for (int i = 0; i < count; i++) {
+        delete clients[i];
+        delete nets[i];
+    }
+    IS_TRUE(broker.connections() == 0);
+
+    END_IT
+}
+
+int test_loopback_qos1() {
+    IT("acknowledges QoS 1 deliveries");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+
+    PubSubClient client(net);
+    client.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(client.connect("client"));
+    IS_TRUE(client.subscribe("alerts",1));
+    IS_TRUE(client.loop());
+
+    broker.publish("alerts",(const uint8_t*)"fire",4,1);
+    broker.publish("alerts",(const uint8_t*)"flood",5,1);
+    while (net.available()) {
+        IS_TRUE(client.loop());
+    }
+    IS_TRUE(callbackCount == 2);
+    IS_TRUE(broker.acked == 2);
+
+    END_IT
+}
+
+int test_loopback_large_message() {
+    IT("carries messages larger than the old 1KB shim buffer");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net1(broker);
+    LoopbackClient net2(broker);
+
+    BasicPubSubClient<8192, 4, MQTTCallbackFunction> publisher(net1);
+    BasicPubSubClient<8192, 4, MQTTCallbackFunction> subscriber(net2);
+    publisher.setServer("broker",1883);
+    subscriber.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(publisher.connect("publisher"));
+    IS_TRUE(subscriber.connect("subscriber"));
+    IS_TRUE(subscriber.subscribe("big"));
+
+    uint8_t payload[6000];
+    memset(payload,'A',sizeof(payload));
+    IS_TRUE(publisher.publish("big",payload,sizeof(payload)));
+    while (net2.available()) {
+        IS_TRUE(subscriber.loop());
+    }
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(lastLength == sizeof(payload));
+
+    END_IT
+}
+
+int test_loopback_topic_matching() {
+    IT("matches topic filters with wildcards");
+    IS_TRUE(LoopbackBroker::matches("a/b","a/b"));
+    IS_FALSE(LoopbackBroker::matches("a/b","a/c"));
+    IS_TRUE(LoopbackBroker::matches("a/+/c","a/b/c"));
+    IS_FALSE(LoopbackBroker::matches("a/+/c","a/b/d/c"));
+    IS_TRUE(LoopbackBroker::matches("a/#","a/b/c"));
+    IS_TRUE(LoopbackBroker::matches("a/#","a"));
+    IS_TRUE(LoopbackBroker::matches("#","a/b"));
+    IS_FALSE(LoopbackBroker::matches("a/b","a/b/c"));
+    IS_FALSE(LoopbackBroker::matches("a/b/c","a/b"));
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Loopback");
+    test_loopback_publish_subscribe();
+    test_loopback_fan_out();
+    test_loopback_qos1();
+    test_loopback_large_message();
+    test_loopback_topic_matching();
+
+    FINISH
+}
@@ -0,0 +1,196 @@
+#include "PubSubClient.h"
+#include "MQTTConnectionManager.h"
+#include "LoopbackBroker.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+int cloudCount = 0;
+int localCount = 0;
+PubSubClientBase* bridgeTo = NULL;
+
+void reset_callbacks() {
+    cloudCount = 0;
+    localCount = 0;
+    bridgeTo = NULL;
+}
+
+void cloudCallback(char* topic, byte* payload, unsigned int length) {
+    cloudCount++;
+    if (bridgeTo != NULL) {
+        bridgeTo->publish("bridged",payload,length);
+    }
+}
+
+void localCallback(char* topic, byte* payload, unsigned int length) {
+    localCount++;
+}
+
+int test_manager_two_sessions() {
+    IT("runs two sessions from one loop on a single pool buffer");
+    reset_callbacks();
+    LoopbackBroker cloud;
+    LoopbackBroker local;
+    LoopbackClient cloudNet(cloud);
+    LoopbackClient localNet(local);
+
+    BasicMQTTBufferPool<MQTT_MAX_PACKET_SIZE, 1> pool;
+    MQTTConnectionManager manager(pool);
+    PooledPubSubClient cloudClient(cloudNet);
+    PooledPubSubClient localClient(localNet);
+    IS_TRUE(manager.add(cloudClient));
+    IS_TRUE(manager.add(localClient));
+    IS_TRUE(manager.size() == 2);
+    cloudClient.setServer("cloud",8883).setCallback(cloudCallback);
+    localClient.setServer("local",1883).setCallback(localCallback);
+    IS_TRUE(cloudClient.getBufferSize() == MQTT_MAX_PACKET_SIZE);
+
+    IS_TRUE(cloudClient.connect("gateway"));
+    IS_TRUE(localClient.connect("gateway"));
+    IS_TRUE(cloudClient.subscribe("cmd"));
+    IS_TRUE(localClient.subscribe("sensors/#"));
+    IS_TRUE(manager.loop() == 2);
+
+    cloud.publish("cmd",(const uint8_t*)"on",2,0);
+    local.publish("sensors/1",(const uint8_t*)"21.5",4,0);
+    IS_TRUE(manager.loop() == 2);
+    IS_TRUE(cloudCount == 1);
+    IS_TRUE(localCount == 1);
+
+    IS_TRUE(pool.getHighWater() == 1);
+    IS_TRUE(pool.getMisses() == 0);
+    IS_TRUE(pool.available() == 1);
+    // Less than a buffer each
+    IS_TRUE(sizeof(pool) + 2*sizeof(PooledPubSubClient) < 2*sizeof(PubSubClient));
+
+    END_IT
+}
+
+int test_manager_bridge() {
+    IT("lends a second buffer to a callback that publishes on another client");
+    reset_callbacks();
+    LoopbackBroker cloud;
+    LoopbackBroker local;
+    LoopbackClient cloudNet(cloud);
+    LoopbackClient localNet(local);
+    LoopbackClient watcherNet(local);
+
+    BasicMQTTBufferPool<MQTT_MAX_PACKET_SIZE, 2> pool;
+    MQTTConnectionManager manager(pool);
+    PooledPubSubClient cloudClient(cloudNet);
+    PooledPubSubClient localClient(localNet);
+    manager.add(cloudClient);
+    manager.add(localClient);
+    cloudClient.setServer("cloud",8883).setCallback(cloudCallback);
+    localClient.setServer("local",1883);
+    IS_TRUE(cloudClient.connect("gateway"));
+    IS_TRUE(localClient.connect("gateway"));
+    IS_TRUE(cloudClient.subscribe("cmd"));
+
+    PubSubClient watcher(watcherNet);
+    watcher.setServer("local",1883).setCallback(localCallback);
+    IS_TRUE(watcher.connect("watcher"));
+    IS_TRUE(watcher.subscribe("bridged"));
+    manager.loop();
+
+    bridgeTo = &localClient;
+    cloud.publish("cmd",(const uint8_t*)"on",2,0);
+    manager.loop();
+    while (watcherNet.available()) {
+        watcher.loop();
+    }
+    IS_TRUE(cloudCount == 1);
+    IS_TRUE(localCount == 1);
+    IS_TRUE(pool.getHighWater() == 2);
+    IS_TRUE(pool.available() == 2);
+
+    END_IT
+}
+
+int test_manager_pool_exhausted() {
+    IT("fails calls cleanly when the pool has no buffer free");
+    reset_callbacks();
+    LoopbackBroker cloud;
+    LoopbackBroker local;
+    LoopbackClient cloudNet(cloud);
+    LoopbackClient localNet(local);
+
+    BasicMQTTBufferPool<MQTT_MAX_PACKET_SIZE, 1> pool;
+    MQTTConnectionManager manager(pool);
+    PooledPubSubClient cloudClient(cloudNet);
+    PooledPubSubClient localClient(localNet);
+    manager.add(cloudClient);
+    manager.add(localClient);
+    cloudClient.setServer("cloud",8883).setCallback(cloudCallback);
+    localClient.setServer("local",1883);
+    IS_TRUE(cloudClient.connect("gateway"));
+    IS_TRUE(localClient.connect("gateway"));
+    IS_TRUE(cloudClient.subscribe("cmd"));
+    manager.loop();
+
+    // The callback's publish has no buffer to use
+    bridgeTo = &localClient;
+    cloud.publish("cmd",(const uint8_t*)"on",2,0);
+    manager.loop();
+    IS_TRUE(cloudCount == 1);
+    IS_TRUE(localClient.getMetrics().publishFailures == 1);
+    IS_TRUE(pool.getMisses() == 1);
+    IS_TRUE(pool.available() == 1);
+
+    // Without a pool a buffer-less client cannot connect
+    PooledPubSubClient unpooled(localNet);
+    unpooled.setServer("local",1883);
+    IS_FALSE(unpooled.connect("other"));
+
+    END_IT
+}
+
+int test_manager_fairness() {
+    IT("moves the first client serviced along each loop");
+    reset_callbacks();
+    LoopbackBroker cloud;
+    LoopbackBroker local;
+    LoopbackClient cloudNet(cloud);
+    LoopbackClient localNet(local);
+
+    BasicMQTTBufferPool<MQTT_MAX_PACKET_SIZE, 1> pool;
+    MQTTConnectionManager manager(pool);
+    PooledPubSubClient cloudClient(cloudNet);
+    PooledPubSubClient localClient(localNet);
+    manager.add(cloudClient);
+    manager.add(localClient);
+    cloudClient.setServer("cloud",8883).setCallback(cloudCallback);
+    localClient.setServer("local",1883).setCallback(localCallback);
+    IS_TRUE(cloudClient.connect("gateway"));
+    IS_TRUE(localClient.connect("gateway"));
+    IS_TRUE(cloudClient.subscribe("cmd"));
+    IS_TRUE(localClient.subscribe("sensors"));
+    manager.loop();
+    manager.loop();
+
+    // A burst on one connection does not hold up the other
+    for (int i = 0; i < 50; i++) {
+        cloud.publish("cmd",(const uint8_t*)"x",1,0);
+    }
+    local.publish("sensors",(const uint8_t*)"y",1,0);
+    manager.loop();
+    IS_TRUE(localCount == 1);
+    IS_TRUE(cloudCount == 1);
+    while (cloudNet.available()) {
+        manager.loop();
+    }
+    IS_TRUE(cloudCount == 50);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Manager");
+    test_manager_two_sessions();
+    test_manager_bridge();
+    test_manager_pool_exhausted();
+    test_manager_fairness();
+
+    FINISH
+}
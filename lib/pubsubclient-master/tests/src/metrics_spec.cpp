@@ -0,0 +1,139 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+int test_metrics_count_packets() {
+    IT("counts packets and bytes by type");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    const MQTTMetrics& metrics = client.getMetrics();
+    IS_TRUE(metrics.packetsSent[MQTTCONNECT>>4] == 1);
+    IS_TRUE(metrics.bytesSent[MQTTCONNECT>>4] == 26);
+    IS_TRUE(metrics.packetsSent[MQTTPUBLISH>>4] == 1);
+    IS_TRUE(metrics.bytesSent[MQTTPUBLISH>>4] == 16);
+    IS_TRUE(metrics.packetsSent[MQTTPUBACK>>4] == 1);
+    IS_TRUE(metrics.packetsReceived[MQTTCONNACK>>4] == 1);
+    IS_TRUE(metrics.packetsReceived[MQTTPUBLISH>>4] == 1);
+    IS_TRUE(metrics.bytesReceived[MQTTPUBLISH>>4] == 18);
+    IS_TRUE(metrics.connects == 1);
+    IS_TRUE(metrics.reconnects == 0);
+
+    client.resetMetrics();
+    IS_TRUE(client.getMetrics().packetsSent[MQTTPUBLISH>>4] == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_metrics_count_failures() {
+    IT("counts publish failures, oversize drops and reconnects");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    char payload[MQTT_MAX_PACKET_SIZE];
+    memset(payload,'A',sizeof(payload));
+    payload[sizeof(payload)-1] = 0;
+    rc = client.publish((char*)"topic",payload);
+    IS_FALSE(rc);
+    IS_TRUE(client.getMetrics().publishFailures == 1);
+
+    int length = MQTT_MAX_PACKET_SIZE+1;
+    byte bigPublish[length];
+    memset(bigPublish,'A',length);
+    byte publish[] = {0x30,(byte)(length-2),0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    memcpy(bigPublish,publish,9);
+    shimClient.respond(bigPublish,length);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getMetrics().oversizeDrops == 1);
+
+    client.disconnect();
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getMetrics().connects == 2);
+    IS_TRUE(client.getMetrics().reconnects == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_metrics_ping_rtt() {
+    IT("measures ping round trips");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setKeepAlive(1);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getPingRttAvg() == 0);
+
+    // Idle for longer than the keepalive so the next loop pings
+    advanceMillis(1001);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getMetrics().packetsSent[MQTTPINGREQ>>4] == 1);
+
+    advanceMillis(40);
+    byte pingresp[] = { 0xD0,0x0 };
+    shimClient.respond(pingresp,2);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getMetrics().pings == 1);
+    IS_TRUE(client.getMetrics().pingRttMin == 40);
+    IS_TRUE(client.getMetrics().pingRttMax == 40);
+    IS_TRUE(client.getPingRttAvg() == 40);
+    IS_TRUE(client.getMetrics().maxLoopTime > 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Metrics");
+    test_metrics_count_packets();
+    test_metrics_count_failures();
+    test_metrics_ping_rtt();
+
+    FINISH
+}
@@ -0,0 +1,203 @@
+#include "PubSubClient.h"
+#include "LoopbackBroker.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+int callbackCount = 0;
+char lastPayload[256];
+
+void reset_callback() {
+    callbackCount = 0;
+    lastPayload[0] = '\0';
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+    memcpy(lastPayload,payload,length);
+    lastPayload[length] = '\0';
+}
+
+// A probe as the client would have sent it at `sent`
+void send_probe(LoopbackBroker& broker, uint16_t seq, uint32_t sent) {
+    uint8_t probe[] = { 'L', 'P', (uint8_t)(seq >> 8), (uint8_t)seq,
+                        (uint8_t)(sent >> 24), (uint8_t)(sent >> 16), (uint8_t)(sent >> 8), (uint8_t)sent };
+    broker.publish("probe/device",probe,sizeof(probe),0);
+}
+
+void drain(LoopbackClient& net, PubSubClientBase& client) {
+    while (net.available()) {
+        client.loop();
+    }
+}
+
+int test_probe_round_trip() {
+    IT("measures the round trip of its own probes");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+    PubSubClient client(net);
+    client.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(client.connect("device"));
+
+    MQTTLatencyProbe probe = { "probe/device", 1000, NULL, 0 };
+    client.setLatencyProbe(&probe);
+    // Subscribes and sends the first probe straight away
+    IS_TRUE(client.loop());
+    IS_TRUE(probe.subscribed);
+    IS_TRUE(client.getMetrics().probesSent == 1);
+
+    advanceMillis(25);
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesReceived == 1);
+    IS_TRUE(client.getProbeRtt(50) == 25);
+    // Probes are not passed to the callback
+    IS_TRUE(callbackCount == 0);
+
+    // Not due again until the interval has passed
+    IS_TRUE(client.loop());
+    IS_TRUE(client.getMetrics().probesSent == 1);
+    advanceMillis(1000);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.getMetrics().probesSent == 2);
+
+    END_IT
+}
+
+int test_probe_loss_and_reorder() {
+    IT("counts lost and reordered probes");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+    PubSubClient client(net);
+    client.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(client.connect("device"));
+
+    // Too long an interval to send a second probe during the test
+    MQTTLatencyProbe probe = { "probe/device", 60000, NULL, 0 };
+    client.setLatencyProbe(&probe);
+    IS_TRUE(client.loop());
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesReceived == 1);
+
+    uint32_t now = millis();
+    send_probe(broker,3,now);
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesLost == 2);
+
+    send_probe(broker,2,now);
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesLost == 1);
+    IS_TRUE(client.getMetrics().probesReordered == 1);
+    IS_TRUE(client.getMetrics().probesReceived == 3);
+
+    // A duplicate is ignored
+    send_probe(broker,3,now);
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesReceived == 3);
+
+    // Anything else on the topic goes to the callback
+    broker.publish("probe/device",(const uint8_t*)"hello",5,0);
+    drain(net,client);
+    IS_TRUE(callbackCount == 1);
+
+    END_IT
+}
+
+int test_probe_percentiles() {
+    IT("reports round trip percentiles over the recent probes");
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+    PubSubClient client(net);
+    client.setServer("broker",1883);
+    IS_TRUE(client.connect("device"));
+
+    MQTTLatencyProbe probe = { "probe/device", 60000, NULL, 0 };
+    client.setLatencyProbe(&probe);
+    IS_TRUE(client.getProbeRtt(50) == 0);
+    IS_TRUE(client.loop());
+    drain(net,client);
+
+    // Round trips of 1..100ms, of which the last MQTT_PROBE_SAMPLES are kept
+    advanceMillis(1000);
+    for (uint16_t i = 1; i <= 100; i++) {
+        send_probe(broker,i,millis()-i);
+        drain(net,client);
+    }
+    IS_TRUE(client.getProbeRtt(100) == 100);
+    IS_TRUE(client.getProbeRtt(50) == 100-MQTT_PROBE_SAMPLES/2);
+    IS_TRUE(client.getProbeRtt(0) == 100-MQTT_PROBE_SAMPLES+1);
+
+    END_IT
+}
+
+int test_probe_report() {
+    IT("publishes a report of the results");
+    reset_callback();
+    LoopbackBroker broker;
+    LoopbackClient net1(broker);
+    LoopbackClient net2(broker);
+
+    BasicPubSubClient<256, 4, MQTTCallbackFunction> device(net1);
+    PubSubClient monitor(net2);
+    device.setServer("broker",1883);
+    monitor.setServer("broker",1883).setCallback(callback);
+    IS_TRUE(device.connect("device"));
+    IS_TRUE(monitor.connect("monitor"));
+    IS_TRUE(monitor.subscribe("probe/report"));
+    drain(net2,monitor);
+
+    MQTTLatencyProbe probe = { "probe/device", 100, "probe/report", 1 };
+    device.setLatencyProbe(&probe);
+    for (int i = 0; i < 10; i++) {
+        IS_TRUE(device.loop());
+        advanceMillis(10);
+        drain(net1,device);
+        advanceMillis(90);
+    }
+    IS_TRUE(device.loop());
+    drain(net2,monitor);
+    IS_TRUE(callbackCount == 1);
+    const char* counts = "{\"sent\":11,\"received\":10,\"lost\":0,\"reordered\":0,";
+    IS_TRUE(strncmp(lastPayload,counts,strlen(counts)) == 0);
+    IS_TRUE(strstr(lastPayload,"\"max\":10}") != NULL);
+
+    END_IT
+}
+
+int test_probe_acknowledged() {
+    IT("acknowledges probes delivered at QoS 1");
+    LoopbackBroker broker;
+    LoopbackClient net(broker);
+    PubSubClient client(net);
+    client.setServer("broker",1883);
+    IS_TRUE(client.connect("device"));
+    MQTTLatencyProbe probe = { "probe/device", 60000, NULL, 0 };
+    client.setLatencyProbe(&probe);
+    IS_TRUE(client.loop());
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesReceived == 1);
+
+    // The probe subscribes at QoS 0; a broker may still deliver at QoS 1
+    IS_TRUE(client.subscribe("probe/device",1));
+    drain(net,client);
+    uint8_t payload[] = { 'L', 'P', 0, 1, 0, 0, 0, 0 };
+    broker.publish("probe/device",payload,sizeof(payload),1);
+    drain(net,client);
+    IS_TRUE(client.getMetrics().probesReceived == 2);
+    IS_TRUE(broker.acked == 1);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Probe");
+    test_probe_round_trip();
+    test_probe_loss_and_reorder();
+    test_probe_percentiles();
+    test_probe_report();
+    test_probe_acknowledged();
+
+    FINISH
+}
@@ -1,6 +1,7 @@
 #include "PubSubClient.h"
 #include "ShimClient.h"
 #include "Buffer.h"
+#include "Allocations.h"
 #include "BDDTest.h"
 #include "trace.h"
 
@@ -175,6 +176,33 @@ int test_publish_P() {
 
 
 
+int test_publish_no_allocation() {
+    IT("publishes without allocating");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte payload[] = { 0x01,0x02,0x03,0x0,0x05 };
+    AllocationCounter allocations;
+    for (int i = 0; i < 100; i++) {
+        rc = client.publish((char*)"topic",(char*)"payload");
+        IS_TRUE(rc);
+        rc = client.publish((char*)"topic",payload,5,true);
+        IS_TRUE(rc);
+    }
+    IS_TRUE(allocations.count() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Publish");
@@ -185,6 +213,7 @@ int main()
     test_publish_not_connected();
     test_publish_too_long();
     test_publish_P();
+    test_publish_no_allocation();
 
     FINISH
 }
@@ -0,0 +1,215 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+int test_ratelimit_defers_to_queue() {
+    IT("queues publishes over the rate limit and drains them from loop");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t queue[256];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishRate(1,2).setOutboundQueue(queue,sizeof(queue));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    uint16_t connectLength = shimClient.received();
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    for (int i = 0; i < 4; i++) {
+        shimClient.expect(publish,16);
+        rc = client.publish((char*)"topic",(char*)"payload");
+        IS_TRUE(rc);
+    }
+    IS_TRUE(client.queuedMessages() == 2);
+    IS_TRUE(client.getRateLimitStats().sent == 2);
+    IS_TRUE(client.getRateLimitStats().deferred == 2);
+
+    advanceMillis(3000);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.queuedMessages() == 0);
+    IS_TRUE(shimClient.received() == connectLength + 4*16);
+    IS_TRUE(client.getRateLimitStats().drained == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_ratelimit_fails_without_queue() {
+    IT("fails publishes over the rate limit when there is no queue");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishRate(1,1);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+    IS_TRUE(client.getRateLimitStats().dropped == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_ratelimit_bytes() {
+    IT("limits publish bytes separately from publish count");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t queue[20];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setByteRate(16,16).setOutboundQueue(queue,sizeof(queue));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    // Deferred: 16 bytes plus its length fit the 20 byte queue
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(client.queuedMessages() == 1);
+    // Dropped: the queue is full
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+
+    const MQTTRateLimitStats& stats = client.getRateLimitStats();
+    IS_TRUE(stats.sent == 1);
+    IS_TRUE(stats.deferred == 1);
+    IS_TRUE(stats.dropped == 1);
+    IS_TRUE(stats.queueHighWater == 18);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_ratelimit_drain_short_write() {
+    IT("stops draining the queue at a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t queue[256];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishRate(1,1).setOutboundQueue(queue,sizeof(queue));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    for (int i = 0; i < 3; i++) {
+        rc = client.publish((char*)"topic",(char*)"payload");
+        IS_TRUE(rc);
+    }
+    IS_TRUE(client.getRateLimitStats().sent == 1);
+    IS_TRUE(client.queuedMessages() == 2);
+
+    uint32_t failures = client.getMetrics().publishFailures;
+    shimClient.setShortWrites(1000);
+    advanceMillis(5000);
+    client.loop();
+    IS_TRUE(client.getRateLimitStats().drained == 0);
+    IS_TRUE(client.getMetrics().publishFailures == failures+1);
+    IS_TRUE(client.queuedMessages() == 1);
+
+    END_IT
+}
+
+int test_ratelimit_failed_send_not_counted() {
+    IT("does not count a publish that fails to send as sent");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishRate(10,10);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.setShortWrites(1000);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+    IS_TRUE(client.getRateLimitStats().sent == 0);
+
+    END_IT
+}
+
+int test_ratelimit_large_forced_debt() {
+    IT("charges streamed publishes over 64KB in full without wrapping");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setByteRate(1000,1000);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 70000 bytes of debt take 70 seconds to pay off, not the 4.5 a
+    // length cut to 16 bits would
+    rc = client.beginPublish("topic",70000,false);
+    IS_TRUE(rc);
+    advanceMillis(10000);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+    advanceMillis(65000);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    // Debt this size would wrap the level round to a full bucket
+    rc = client.beginPublish("topic",200000000,false);
+    IS_TRUE(rc);
+    rc = client.beginPublish("topic",200000000,false);
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_FALSE(rc);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Rate limit");
+    test_ratelimit_defers_to_queue();
+    test_ratelimit_fails_without_queue();
+    test_ratelimit_bytes();
+    test_ratelimit_drain_short_write();
+    test_ratelimit_failed_send_not_counted();
+    test_ratelimit_large_forced_debt();
+
+    FINISH
+}
@@ -1,6 +1,7 @@
 #include "PubSubClient.h"
 #include "ShimClient.h"
 #include "Buffer.h"
+#include "Allocations.h"
 #include "BDDTest.h"
 #include "trace.h"
 
@@ -107,7 +108,7 @@ int test_receive_max_sized_message() {
 
     int length = MQTT_MAX_PACKET_SIZE;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -143,7 +144,7 @@ int test_receive_oversized_message() {
 
     int length = MQTT_MAX_PACKET_SIZE+1;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -188,6 +189,34 @@ int test_drop_invalid_remaining_length_message() {
     END_IT
 }
 
+int test_drop_invalid_topic_length_message() {
+    IT("drops a message whose topic length overruns the packet");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0x7,0xff,0xff,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.respond(publish,9);
+
+    rc = client.loop();
+
+    IS_FALSE(rc);
+    IS_FALSE(client.connected());
+
+    IS_FALSE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
 
 int test_receive_oversized_stream_message() {
     IT("drops an oversized message");
@@ -208,7 +237,7 @@ int test_receive_oversized_stream_message() {
     int length = MQTT_MAX_PACKET_SIZE+1;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
 
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -264,6 +293,117 @@ int test_receive_qos1() {
     END_IT
 }
 
+int test_receive_sized_client() {
+    IT("receives a message larger than the default buffer with a larger client");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    BasicPubSubClient<512, 1, MQTTCallbackFunction> client(server, 1883, callback, shimClient);
+    IS_TRUE(client.getBufferSize() == 512);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    int length = 300;
+    byte publish[] = {0x30,0xa9,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    byte bigPublish[length];
+    memset(bigPublish,'A',length);
+    memcpy(bigPublish,publish,10);
+    shimClient.respond(bigPublish,length);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == length-10);
+    IS_TRUE(memcmp(lastPayload,bigPublish+10,lastLength)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_qos1_duplicate() {
+    IT("acknowledges but does not dispatch a redelivered qos1 message");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.respond(publish,18);
+    shimClient.expect(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+
+    reset_callback();
+    publish[0] = 0x3A; // DUP
+    shimClient.respond(publish,18);
+    shimClient.expect(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // The broker may reuse an acknowledged id for a new message
+    publish[0] = 0x32;
+    shimClient.respond(publish,18);
+    shimClient.expect(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_no_allocation() {
+    IT("receives without allocating");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte publishQos1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+    shimClient.respond(publishQos1,18);
+
+    AllocationCounter allocations;
+    rc = client.loop();
+    IS_TRUE(rc);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(allocations.count() == 0);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Receive");
@@ -271,9 +411,13 @@ int main()
     test_receive_stream();
     test_receive_max_sized_message();
     test_drop_invalid_remaining_length_message();
+    test_drop_invalid_topic_length_message();
     test_receive_oversized_message();
     test_receive_oversized_stream_message();
     test_receive_qos1();
+    test_receive_sized_client();
+    test_receive_qos1_duplicate();
+    test_receive_no_allocation();
 
     FINISH
 }
@@ -0,0 +1,186 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Replayer.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+int callbackCount = 0;
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+}
+
+int test_recorder_captures_both_directions() {
+    IT("records inbound and outbound packets with direction and length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t recording[256];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRecorder(recording,sizeof(recording));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    // CONNECT (26) + CONNACK (4) + PUBLISH (16), each with a 7 byte header
+    IS_TRUE(client.recordingLength() == 26+4+16+3*MQTT_RECORD_HEADER_SIZE);
+
+    uint8_t out[256];
+    uint16_t length = client.readRecording(out,sizeof(out));
+    IS_TRUE(length == client.recordingLength());
+
+    IS_TRUE(out[0] == MQTT_RECORD_OUTBOUND);
+    IS_TRUE(out[5] == 0 && out[6] == 26);
+    IS_TRUE(out[7] == MQTTCONNECT);
+
+    uint8_t* connackRecord = out+MQTT_RECORD_HEADER_SIZE+26;
+    IS_TRUE(connackRecord[0] == MQTT_RECORD_INBOUND);
+    IS_TRUE(connackRecord[6] == 4);
+    IS_TRUE(memcmp(connackRecord+MQTT_RECORD_HEADER_SIZE,connack,4) == 0);
+
+    uint8_t* publishRecord = connackRecord+MQTT_RECORD_HEADER_SIZE+4;
+    IS_TRUE(publishRecord[0] == MQTT_RECORD_OUTBOUND);
+    IS_TRUE(publishRecord[MQTT_RECORD_HEADER_SIZE] == MQTTPUBLISH);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_recorder_overwrites_oldest() {
+    IT("overwrites the oldest records when full");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t recording[50];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRecorder(recording,sizeof(recording));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    for (int i = 0; i < 5; i++) {
+        rc = client.publish((char*)"topic",(char*)"payload");
+        IS_TRUE(rc);
+    }
+    // Only two 23 byte publish records fit
+    IS_TRUE(client.recordingLength() == 46);
+    IS_TRUE(client.recordsDropped() == 5);
+
+    uint8_t out[50];
+    uint16_t length = client.readRecording(out,sizeof(out));
+    IS_TRUE(length == 46);
+    IS_TRUE(out[MQTT_RECORD_HEADER_SIZE] == MQTTPUBLISH);
+    IS_TRUE(out[23+MQTT_RECORD_HEADER_SIZE] == MQTTPUBLISH);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_recorder_large_ring() {
+    IT("reads whole records from a ring larger than 32KB");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    static uint8_t recording[65000];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRecorder(recording,sizeof(recording));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 2826 publish records of 23 bytes fill the ring; this many more leave
+    // the oldest near its end, so reading it wraps past 65535
+    for (int i = 0; i < 2826+2780; i++) {
+        rc = client.publish((char*)"topic",(char*)"payload");
+        IS_TRUE(rc);
+    }
+    IS_TRUE(client.recordingLength() == 2826*23);
+
+    static uint8_t out[65000];
+    uint16_t length = client.readRecording(out,sizeof(out));
+    IS_TRUE(length == 2826*23);
+    for (uint16_t pos = 0; pos < length; pos += 23) {
+        IS_TRUE(out[pos] == MQTT_RECORD_OUTBOUND);
+        IS_TRUE(out[pos+6] == 16);
+        IS_TRUE(out[pos+MQTT_RECORD_HEADER_SIZE] == MQTTPUBLISH);
+    }
+
+    END_IT
+}
+
+int test_recorder_replay() {
+    IT("replays a recorded session through a fresh client");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t recording[512];
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRecorder(recording,sizeof(recording));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte publishQos1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+    shimClient.respond(publishQos1,18);
+    shimClient.respond(publish,16);
+    while (shimClient.available()) {
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_TRUE(callbackCount == 3);
+
+    uint8_t capture[512];
+    uint16_t length = client.readRecording(capture,sizeof(capture));
+
+    callbackCount = 0;
+    ShimClient replayShim;
+    replayShim.setAllowConnect(true);
+    replayShim.respond(connack,4);
+    PubSubClient replayClient(server, 1883, callback, replayShim);
+    rc = replayClient.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    replayShim.expect(puback,4);
+
+    Replayer replayer(capture,length);
+    rc = replayer.run(&replayShim,&replayClient);
+    IS_TRUE(rc);
+    IS_TRUE(replayer.packets == 3);
+    IS_TRUE(replayer.bytes == 16+18+16);
+    IS_TRUE(callbackCount == 3);
+
+    IS_FALSE(replayShim.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Recorder");
+    test_recorder_captures_both_directions();
+    test_recorder_overwrites_oldest();
+    test_recorder_large_ring();
+    test_recorder_replay();
+
+    FINISH
+}
@@ -0,0 +1,271 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+int callbackCount = 0;
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+}
+
+// Stands in for flash: survives the client that saved to it
+class MemoryStore : public MQTTSessionStore {
+public:
+    uint8_t data[256];
+    uint16_t length;
+    int saves;
+    MemoryStore() : length(0), saves(0) {}
+    virtual bool save(const uint8_t* data, uint16_t length) {
+        memcpy(this->data,data,length);
+        this->length = length;
+        this->saves++;
+        return true;
+    }
+    virtual uint16_t load(uint8_t* data, uint16_t size) {
+        if (this->length > size) {
+            return 0;
+        }
+        memcpy(data,this->data,this->length);
+        return this->length;
+    }
+    bool holds(const char* topic) {
+        return memmem(this->data,this->length,topic,strlen(topic)+1) != NULL;
+    }
+};
+
+byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+byte connackPresent[] = { 0x20, 0x02, 0x01, 0x00 };
+
+boolean connect_persistent(PubSubClient& client) {
+    return client.connect("client_test1",NULL,NULL,NULL,0,false,NULL,false);
+}
+
+int test_session_checkpoint_subscriptions() {
+    IT("checkpoints the subscription list as it changes");
+    MemoryStore store;
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_FALSE(client.sessionPresent());
+
+    IS_TRUE(client.subscribe("topic",1));
+    IS_TRUE(store.holds("topic"));
+    IS_TRUE(client.subscribe("other"));
+    IS_TRUE(store.holds("other"));
+    IS_TRUE(client.unsubscribe("topic"));
+    IS_FALSE(store.holds("topic"));
+    IS_TRUE(store.holds("other"));
+
+    END_IT
+}
+
+int test_session_resume() {
+    IT("resumes a session the broker still holds without subscribing again");
+    MemoryStore store;
+    {
+        uint8_t storage[128];
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+        shimClient.respond(connack,4);
+        PubSubClient client(server, 1883, callback, shimClient);
+        client.setSession(&store,storage,sizeof(storage));
+        IS_TRUE(connect_persistent(client));
+        IS_TRUE(client.subscribe("topic",1));
+    }
+
+    // After a reboot
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connackPresent,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_TRUE(client.sessionPresent());
+
+    uint16_t sent = shimClient.received();
+    IS_TRUE(client.subscribe("topic",1));
+    IS_TRUE(shimClient.received() == sent);
+
+    // Packet ids carry on from the last session
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x6f,0x74,0x68,0x65,0x72,0x0 };
+    shimClient.expect(subscribe,12);
+    IS_TRUE(client.subscribe("other"));
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_session_resubscribe() {
+    IT("subscribes again when the broker has lost the session");
+    MemoryStore store;
+    {
+        uint8_t storage[128];
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+        shimClient.respond(connack,4);
+        PubSubClient client(server, 1883, callback, shimClient);
+        client.setSession(&store,storage,sizeof(storage));
+        IS_TRUE(connect_persistent(client));
+        IS_TRUE(client.subscribe("topic",1));
+    }
+
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_FALSE(client.sessionPresent());
+    // CONNECT then the SUBSCRIBE for the stored topic
+    IS_TRUE(shimClient.received() == 26+12);
+    IS_TRUE(client.pendingAcks() == 1);
+
+    END_IT
+}
+
+int test_session_clean() {
+    IT("starts an empty session on a clean connect");
+    MemoryStore store;
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_TRUE(client.subscribe("topic",1));
+    client.disconnect();
+
+    shimClient.respond(connack,4);
+    IS_TRUE(client.connect("client_test1"));
+    IS_FALSE(store.holds("topic"));
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1 };
+    shimClient.expect(subscribe,12);
+    IS_TRUE(client.subscribe("topic",1));
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_session_duplicates_survive() {
+    IT("suppresses a redelivery of a message dispatched before a reboot");
+    callbackCount = 0;
+    MemoryStore store;
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    {
+        uint8_t storage[128];
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+        shimClient.respond(connack,4);
+        PubSubClient client(server, 1883, callback, shimClient);
+        client.setSession(&store,storage,sizeof(storage));
+        IS_TRUE(connect_persistent(client));
+        shimClient.respond(publish,18);
+        IS_TRUE(client.loop());
+        IS_TRUE(callbackCount == 1);
+        // Saved from loop() once the checkpoint interval has passed
+        advanceMillis(MQTT_SESSION_CHECKPOINT*1000);
+        int saves = store.saves;
+        IS_TRUE(client.loop());
+        IS_TRUE(store.saves == saves+1);
+    }
+
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connackPresent,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    // Redelivered with DUP set
+    publish[0] |= 0x08;
+    shimClient.respond(publish,18);
+    IS_TRUE(client.loop());
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(client.getMetrics().duplicates == 1);
+
+    END_IT
+}
+
+int test_session_ignores_bad_store() {
+    IT("ignores a stored session it cannot read");
+    MemoryStore store;
+    memcpy(store.data,"garbage",7);
+    store.length = 7;
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_TRUE(shimClient.received() == 26);
+    IS_TRUE(client.checkpoint());
+    IS_TRUE(store.data[0] == 'S');
+
+    END_IT
+}
+
+int test_session_ignores_corrupt_subscriptions() {
+    IT("ignores a stored session whose subscriptions run past its end");
+    MemoryStore store;
+    {
+        uint8_t storage[128];
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+        shimClient.respond(connack,4);
+        PubSubClient client(server, 1883, callback, shimClient);
+        client.setSession(&store,storage,sizeof(storage));
+        IS_TRUE(connect_persistent(client));
+        IS_TRUE(client.subscribe("topic",1));
+    }
+    uint16_t header = store.length-7;
+
+    // A record with a qos but no topic, after one that is fine
+    store.data[store.length++] = 0;
+    uint8_t storage[128];
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(connect_persistent(client));
+    IS_TRUE(client.checkpoint());
+    IS_TRUE(store.length == header);
+    IS_FALSE(store.holds("topic"));
+
+    // A topic that is not ended
+    memcpy(store.data+header,"\x01topic",6);
+    store.length = header+6;
+    client.setSession(&store,storage,sizeof(storage));
+    IS_TRUE(client.checkpoint());
+    IS_TRUE(store.length == header);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Session");
+    test_session_checkpoint_subscriptions();
+    test_session_resume();
+    test_session_resubscribe();
+    test_session_clean();
+    test_session_duplicates_survive();
+    test_session_ignores_bad_store();
+    test_session_ignores_corrupt_subscriptions();
+
+    FINISH
+}
@@ -163,6 +163,47 @@ int test_unsubscribe_not_connected() {
     END_IT
 }
 
+int test_subscribe_tracks_acks() {
+    IT("tracks outstanding subscribe acks");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    BasicPubSubClient<MQTT_MAX_PACKET_SIZE, 2, MQTTCallbackFunction> client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.pendingAcks() == 0);
+
+    rc = client.subscribe((char*)"topic");
+    IS_TRUE(rc);
+    rc = client.subscribe((char*)"topic2");
+    IS_TRUE(rc);
+    IS_TRUE(client.pendingAcks() == 2);
+
+    // A full table never blocks a subscribe
+    rc = client.unsubscribe((char*)"topic");
+    IS_TRUE(rc);
+    IS_TRUE(client.pendingAcks() == 2);
+
+    byte suback[] = { 0x90,0x3,0x0,0x3,0x0 };
+    shimClient.respond(suback,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.pendingAcks() == 1);
+
+    byte unsuback[] = { 0xB0,0x2,0x0,0x4 };
+    shimClient.respond(unsuback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.pendingAcks() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Subscribe");
@@ -173,5 +214,6 @@ int main()
     test_subscribe_too_long();
     test_unsubscribe();
     test_unsubscribe_not_connected();
+    test_subscribe_tracks_acks();
     FINISH
 }
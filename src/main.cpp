@@ -36,8 +36,13 @@ const String get_data_password = "232323";
 const char*  server = "ioticosadmin.ml";
 
 //MQTT
-const char *mqtt_server = "ioticos.org";
-const int mqtt_port = 8883;
+//brokers en orden de preferencia, si el primero cae se usa el siguiente
+MQTTEndpoint mqtt_servers[] = {
+  { "ioticos.org", 8883 }
+};
+const uint8_t mqtt_server_count = sizeof(mqtt_servers) / sizeof(mqtt_servers[0]);
+//cada cuántos segundos se intenta volver al broker principal
+const uint16_t mqtt_failback_interval = 300;
 
 //no completar, el dispositivo se encargará de averiguar qué usuario y qué contraseña mqtt debe usar.
 char mqtt_user[20] = "";
@@ -45,6 +50,16 @@ char mqtt_pass[20] = "";
 
 const int expected_topic_length = 26;
 
+//benchmark de publicación: publicar "segundos,bytes,qos" en <tópico>/actions/bench
+//lo dispara; el resultado se publica en <tópico>/bench y se muestra por Serial.
+//Descomentar BENCH_AT_BOOT para lanzarlo al conectar con los valores por defecto.
+//#define BENCH_AT_BOOT
+#define BENCH_SECONDS 10
+//el benchmark bloquea loop(), así que no se aceptan corridas más largas
+#define BENCH_MAX_SECONDS 60
+#define BENCH_PAYLOAD 32
+#define BENCH_QOS 0
+
 WiFiManager wifiManager;
 WiFiClientSecure client;
 PubSubClient mqttclient(client);
@@ -63,6 +78,7 @@ void callback(char* topic, byte* payload, unsigned int length);
 void reconnect();
 void send_mqtt_data();
 void send_to_database();
+void run_benchmark(unsigned int seconds, unsigned int payload_size, byte qos);
 
 
 
@@ -72,6 +88,7 @@ void send_to_database();
 bool topic_obteined = false;
 char device_topic_subscribe [40];
 char device_topic_publish [40];
+char device_topic_bench [expected_topic_length + sizeof("/bench")];
 char msg[25];
 float temp = 0;
 int hum = 0;
@@ -79,6 +96,14 @@ long milliseconds = 0;
 byte sw1 = 0;
 byte sw2 = 0;
 byte slider = 0;
+#ifdef BENCH_AT_BOOT
+bool bench_pending = true;
+#else
+bool bench_pending = false;
+#endif
+unsigned int bench_seconds = BENCH_SECONDS;
+unsigned int bench_payload = BENCH_PAYLOAD;
+byte bench_qos = BENCH_QOS;
 
 
 
@@ -113,7 +138,8 @@ void setup() {
 
   //set mqtt cert
   //client.setCACert(mqtt_cert);
-  mqttclient.setServer(mqtt_server, mqtt_port);
+  mqttclient.setServers(mqtt_servers, mqtt_server_count);
+  mqttclient.setFailback(mqtt_failback_interval, NULL);
 	mqttclient.setCallback(callback);
 
 
@@ -154,6 +180,12 @@ void loop() {
 
   mqttclient.loop();
 
+  //el benchmark se corre aquí y no en el callback, que usa el buffer del cliente
+  if (bench_pending && mqttclient.connected()){
+    bench_pending = false;
+    run_benchmark(bench_seconds, bench_payload, bench_qos);
+  }
+
 }
 
 
@@ -193,6 +225,16 @@ void callback(char* topic, byte* payload, unsigned int length) {
     ledcWrite(ledChannel,slider);
   }
 
+  if(command=="bench"){
+    //"segundos,bytes,qos", los campos vacíos toman el valor por defecto
+    int seconds = s.separa(incoming,',',0).toInt();
+    int payload_size = s.separa(incoming,',',1).toInt();
+    bench_seconds = seconds > 0 ? min(seconds, BENCH_MAX_SECONDS) : BENCH_SECONDS;
+    bench_payload = payload_size > 0 ? payload_size : BENCH_PAYLOAD;
+    bench_qos = s.separa(incoming,',',2).toInt();
+    bench_pending = true;
+  }
+
 }
 
 void reconnect() {
@@ -206,8 +248,8 @@ void reconnect() {
 		if (mqttclient.connect(clientId.c_str(),mqtt_user,mqtt_pass)) {
 			Serial.println("Connected!");
 			// We subscribe to topic
-
-			mqttclient.subscribe(device_topic_subscribe);
+			// QoS 1 so actions survive a flaky link; redeliveries are filtered by the client
+			mqttclient.subscribe(device_topic_subscribe,1);
 
 		} else {
 			Serial.print("falló :( con error -> ");
@@ -271,6 +313,8 @@ bool get_topic(int length){
       Serial.println(device_topic_subscribe);
       String temporal_topic_publish = temporal_topic + "/data";
       temporal_topic_publish.toCharArray(device_topic_publish,40);
+      String temporal_topic_bench = temporal_topic + "/bench";
+      temporal_topic_bench.toCharArray(device_topic_bench,sizeof(device_topic_bench));
       temporal_user.toCharArray(mqtt_user,20);
       temporal_password.toCharArray(mqtt_pass,20);
 
@@ -323,3 +367,81 @@ void send_to_database(){
     }
 
   }
+
+
+//inunda el broker durante `seconds` con mensajes de `payload_size` bytes y
+//reporta mensajes/s, bytes/s, tiempo de CPU dentro de loop() y el mínimo de heap libre
+void run_benchmark(unsigned int seconds, unsigned int payload_size, byte qos){
+
+  if (seconds > BENCH_MAX_SECONDS){
+    Serial.println("Benchmark: duración reducida a " + String(BENCH_MAX_SECONDS) + " s");
+    seconds = BENCH_MAX_SECONDS;
+  }
+
+  //el cliente solo publica con QoS 0; se informa el pedido y el usado
+  if (qos != 0){
+    Serial.println("Benchmark: el cliente solo publica QoS 0, se usa QoS 0 en lugar de QoS " + String(qos));
+  }
+
+  //el mensaje completo debe caber en el buffer del cliente
+  unsigned int max_payload = mqttclient.getBufferSize() - MQTT_MAX_HEADER_SIZE - 2 - strlen(device_topic_publish);
+  if (payload_size > max_payload){
+    Serial.println("Benchmark: payload reducido a " + String(max_payload) + " bytes para caber en el buffer");
+    payload_size = max_payload;
+  }
+
+  uint8_t payload[MQTT_MAX_PACKET_SIZE];
+  memset(payload, 'x', payload_size);
+
+  Serial.println("Benchmark: " + String(seconds) + " s, " + String(payload_size) + " bytes por mensaje");
+
+  uint32_t sent = 0;
+  uint32_t failed = 0;
+  uint32_t loop_us = 0;
+  uint32_t heap_min = ESP.getFreeHeap();
+  unsigned long start = millis();
+  unsigned long duration = seconds * 1000UL;
+
+  while (millis() - start < duration && mqttclient.connected()){
+    if (mqttclient.publish(device_topic_publish, payload, payload_size)){
+      sent++;
+    } else {
+      failed++;
+    }
+
+    unsigned long loop_start = micros();
+    mqttclient.loop();
+    loop_us += micros() - loop_start;
+
+    //el mínimo de esta corrida; getMinFreeHeap() incluye el arranque
+    uint32_t heap = ESP.getFreeHeap();
+    if (heap < heap_min){
+      heap_min = heap;
+    }
+    yield();
+  }
+
+  unsigned long elapsed = millis() - start;
+  if (elapsed == 0){
+    elapsed = 1;
+  }
+  uint32_t msgs_s = sent * 1000UL / elapsed;
+  uint32_t bytes_s = (uint64_t)sent * payload_size * 1000UL / elapsed;
+
+  Serial.println("Benchmark terminado en " + String(elapsed) + " ms");
+  Serial.println("Mensajes enviados -> " + String(sent) + " (fallidos " + String(failed) + ")");
+  Serial.println("Mensajes/s -> " + String(msgs_s));
+  Serial.println("Bytes/s -> " + String(bytes_s));
+  Serial.println("CPU en loop() -> " + String(loop_us) + " us (" + String(loop_us / 10UL / elapsed) + "%)");
+  Serial.println("Heap mínimo -> " + String(heap_min) + " bytes");
+
+  //el reporte debe caber en el buffer del cliente junto con el tópico
+  String report = "{\"msgs_s\":" + String(msgs_s) + ",\"bytes_s\":" + String(bytes_s) +
+                  ",\"loop_us\":" + String(loop_us) + ",\"heap_min\":" + String(heap_min) +
+                  ",\"fail\":" + String(failed) + "}";
+  if (MQTT_MAX_HEADER_SIZE + 2 + strlen(device_topic_bench) + report.length() > mqttclient.getBufferSize()){
+    Serial.println("El resultado del benchmark no cabe en el buffer del cliente, no se publica");
+  } else if (!mqttclient.publish(device_topic_bench, report.c_str())){
+    Serial.println("No se pudo publicar el resultado del benchmark");
+  }
+}